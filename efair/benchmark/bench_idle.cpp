@@ -0,0 +1,90 @@
+//
+// Created by Qianlin Liang on 4/24/23.
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <sys/resource.h>
+#include <tvm/runtime/registry.h>
+
+#include "scheduler/scheduler.h"
+
+#define RESNET18_LIB_PATH MODEL_DIR "/resnet18/resnet18.so"
+#define RESNET18_PROFILE_PATH MODEL_DIR "/resnet18/resnet18_profile.json"
+
+using efair::scheduler::EFairScheduler;
+
+double cpu_seconds(){
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+/*
+ * CPU burned by an idle scheduler and the delay from submitting a task to the scheduler starting it, for the busy
+ * polling loop and for spin-then-park. Tasks are submitted one at a time with a gap, so every one of them finds the
+ * scheduler idle. Usage: bench_idle [num_tasks] [gap_ms] [max_spin_us]
+ */
+void bench_mode(const std::string &label, EFairScheduler::IdleMode mode, tvm::Device dev, size_t num_tasks,
+                size_t gap_ms, efair::MicroSeconds max_spin){
+    EFairScheduler scheduler(40000, 1.0, dev);
+    ASSERT_STATUS(scheduler.set_idle_mode(mode, max_spin));
+
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_STATUS(scheduler.create_entity(0, eid));
+    ASSERT_STATUS(scheduler.load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, "1300500000", mid));
+    ASSERT_STATUS(scheduler.run());
+
+    // Let the scheduler settle, then measure a second of doing nothing
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto cpu_start = cpu_seconds();
+    auto wall_start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    double idle_cpu = (cpu_seconds() - cpu_start) /
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+    std::vector<double> latencies;
+    std::vector<std::chrono::steady_clock::time_point> timestamps;
+    for (size_t i = 0; i < num_tasks; i++){
+        efair::TaskID tid;
+        ASSERT_STATUS(scheduler.new_task(mid, tid));
+        ASSERT_STATUS(scheduler.wait_task(tid));
+        ASSERT_STATUS(scheduler.get_task_timestamps(tid, timestamps));
+        latencies.push_back(std::chrono::duration<double, std::micro>(timestamps[1] - timestamps[0]).count());
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(gap_ms));
+    }
+    ASSERT_STATUS(scheduler.shutdown());
+
+    std::sort(latencies.begin(), latencies.end());
+    double mean = 0;
+    for (auto l : latencies){
+        mean += l;
+    }
+    mean /= latencies.size();
+
+    std::cout << label << "," << idle_cpu * 100 << "," << mean << "," << latencies[latencies.size() / 2] << ","
+              << latencies[latencies.size() * 99 / 100] << "\n";
+}
+
+int main(int argc, char **argv){
+    size_t num_tasks = argc > 1 ? std::stoul(argv[1]) : 200;
+    size_t gap_ms = argc > 2 ? std::stoul(argv[2]) : 10;
+    efair::MicroSeconds max_spin = argc > 3 ? std::stoul(argv[3]) : 200;
+
+    tvm::Device dev{kDLCPU, 0};
+    if (tvm::runtime::Registry::Get("device_api.cuda"))
+        dev = {kDLCUDA, 0};
+
+    std::cout << "mode,idle_cpu_percent,start_latency_mean_us,start_latency_p50_us,start_latency_p99_us\n";
+    bench_mode("busy_poll", EFairScheduler::BusyPoll, dev, num_tasks, gap_ms, max_spin);
+    bench_mode("spin_then_park", EFairScheduler::SpinThenPark, dev, num_tasks, gap_ms, max_spin);
+    bench_mode("park", EFairScheduler::SpinThenPark, dev, num_tasks, gap_ms, 0);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+//
+// Created by Qianlin Liang on 5/2/23.
+//
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <tvm/runtime/registry.h>
+
+#include "scheduler/scheduler.h"
+
+#define RESNET18_LIB_PATH MODEL_DIR "/resnet18/resnet18.so"
+#define RESNET18_PROFILE_PATH MODEL_DIR "/resnet18/resnet18_profile.json"
+#define CHIHUAHUA_IMAGE_FILEPATH SAMPLE_DIR "/image_chihuahua.bytes"
+
+using efair::scheduler::EFairScheduler;
+
+/*
+ * Throughput of one entity kept saturated with tasks that each bring their own input, with the inputs copied to the
+ * device when a task starts and with them staged while the task before runs. Every task is submitted up front so
+ * that the dispatcher never waits for work. Usage: bench_input_staging [num_tasks] [rounds]
+ */
+double bench_mode(bool staging, tvm::Device dev, const std::vector<char> &input, size_t num_tasks){
+    EFairScheduler scheduler(40000, 1.0, dev);
+    ASSERT_STATUS(scheduler.set_executor_instances(2));
+    ASSERT_STATUS(scheduler.set_input_staging(staging));
+
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_STATUS(scheduler.create_entity(0, eid));
+    ASSERT_STATUS(scheduler.load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, "1300500000", mid));
+
+    std::vector<efair::TaskID> tids(num_tasks);
+    for (auto &tid : tids){
+        ASSERT_STATUS(scheduler.new_task(mid, {{"input", input.data(), input.size()}}, tid));
+    }
+
+    auto start_t = std::chrono::steady_clock::now();
+    ASSERT_STATUS(scheduler.run());
+    for (auto tid : tids){
+        ASSERT_STATUS(scheduler.wait_task(tid));
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_t).count();
+    ASSERT_STATUS(scheduler.shutdown());
+
+    return num_tasks / elapsed;
+}
+
+int main(int argc, char **argv){
+    size_t num_tasks = argc > 1 ? std::stoul(argv[1]) : 500;
+    size_t rounds = argc > 2 ? std::stoul(argv[2]) : 3;
+
+    tvm::Device dev{kDLCPU, 0};
+    if (tvm::runtime::Registry::Get("device_api.cuda"))
+        dev = {kDLCUDA, 0};
+
+    std::ifstream input_file(CHIHUAHUA_IMAGE_FILEPATH, std::ios::binary);
+    std::vector<char> input((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
+
+    std::cout << "round,serial_tasks_per_second,staged_tasks_per_second,gain_percent\n";
+    for (size_t r = 0; r < rounds; r++){
+        double serial = bench_mode(false, dev, input, num_tasks);
+        double staged = bench_mode(true, dev, input, num_tasks);
+        std::cout << r << "," << serial << "," << staged << "," << (staged / serial - 1) * 100 << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+//
+// Created by Qianlin Liang on 3/18/23.
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "executor/profile.h"
+
+#define RESNET18_PROFILE_PATH MODEL_DIR "/resnet18/resnet18_profile.json"
+
+namespace pt = boost::property_tree;
+
+/*
+ * Per-kernel accounting cost: ptree path lookups (the original execute_kernel accounting) against the compiled
+ * KernelCostTable. Usage: bench_profile [profile_path] [iterations]
+ */
+int main(int argc, char **argv){
+    std::string profile_path = argc > 1 ? argv[1] : RESNET18_PROFILE_PATH;
+    size_t iterations = argc > 2 ? std::stoul(argv[2]) : 100000;
+
+    efair::executor::ModelProfile profile;
+    ASSERT_STATUS(profile.load_json(profile_path));
+
+    // Use the profile's own kernel order in place of the module's
+    const auto &kernel_names = profile.get_kernel_names();
+    const auto &frequencies = profile.get_frequencies();
+    efair::executor::KernelCostTable table;
+    ASSERT_STATUS(table.build(profile, kernel_names));
+
+    pt::ptree root;
+    pt::read_json(profile_path, root);
+
+    size_t num_kernels = kernel_names.size(), num_freqs = frequencies.size();
+    size_t num_lookups = iterations * num_kernels;
+    volatile efair::MicroJoule sink = 0;
+    std::chrono::steady_clock::time_point start_t, end_t;
+
+    start_t = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++){
+        const auto &freq = frequencies[i % num_freqs];
+        for (size_t k = 0; k < num_kernels; k++){
+            std::string time_json_path = "kernel_profile." + kernel_names[k] + ".exec_time." + freq;
+            auto time_used = root.get<efair::MicroSeconds>(time_json_path);
+            auto power = root.get<efair::MilliWatt>("gpu_power." + freq);
+            sink = sink + static_cast<efair::MicroJoule>(power * time_used * 1e-3);
+        }
+    }
+    end_t = std::chrono::steady_clock::now();
+    auto ptree_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_t - start_t).count();
+
+    start_t = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++){
+        efair::FreqIdx f = i % num_freqs;
+        for (efair::KernelIdx k = 0; k < num_kernels; k++){
+            sink = sink + table.get(k, f).energy;
+        }
+    }
+    end_t = std::chrono::steady_clock::now();
+    auto table_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_t - start_t).count();
+
+    // Executors hold a snapshot between syncs instead of loading the latest one per kernel
+    auto snapshot = table.get_snapshot();
+    start_t = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++){
+        efair::FreqIdx f = i % num_freqs;
+        for (efair::KernelIdx k = 0; k < num_kernels; k++){
+            sink = sink + snapshot->get(k, f).energy;
+        }
+    }
+    end_t = std::chrono::steady_clock::now();
+    auto snapshot_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_t - start_t).count();
+
+    std::cout << "Kernels: " << num_kernels << " Frequencies: " << num_freqs << " Lookups: " << num_lookups << "\n";
+    std::cout << "ptree lookup: " << static_cast<double>(ptree_ns) / num_lookups << " ns/kernel\n";
+    std::cout << "Dense table lookup: " << static_cast<double>(table_ns) / num_lookups << " ns/kernel\n";
+    std::cout << "Held snapshot lookup: " << static_cast<double>(snapshot_ns) / num_lookups << " ns/kernel\n";
+
+    return 0;
+}
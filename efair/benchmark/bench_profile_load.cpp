@@ -0,0 +1,73 @@
+//
+// Created by Qianlin Liang on 4/12/23.
+//
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <unistd.h>
+
+#include "executor/profile.h"
+
+#define RESNET50_PROFILE_PATH MODEL_DIR "/resnet50/resnet50_profile.json"
+
+size_t resident_bytes(){
+    size_t total_pages = 0, resident_pages = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> total_pages >> resident_pages;
+    return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+void bench_load(const std::string &label, const std::string &path, size_t num_models, bool binary){
+    std::vector<std::unique_ptr<efair::executor::ModelProfile>> profiles;
+    size_t rss_before = resident_bytes();
+
+    auto start_t = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_models; i++){
+        profiles.emplace_back(new efair::executor::ModelProfile);
+        if (binary)
+            ASSERT_STATUS(profiles.back()->load_binary(path));
+        else
+            ASSERT_STATUS(profiles.back()->load_json(path));
+    }
+    auto end_t = std::chrono::steady_clock::now();
+
+    // Touch every value once, as building the kernel cost tables would
+    volatile size_t sink = 0;
+    for (const auto &profile : profiles){
+        for (size_t row = 0; row < profile->get_num_kernels(); row++){
+            for (efair::FreqIdx f = 0; f < profile->get_num_frequencies(); f++){
+                sink = sink + profile->get_kernel_exec_time(row, f);
+            }
+        }
+    }
+
+    size_t rss_after = resident_bytes();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_t - start_t).count();
+    std::cout << label << ": " << static_cast<double>(duration) / num_models << " µs/model, resident "
+              << static_cast<double>(rss_after - rss_before) / num_models / 1024 << " KiB/model\n";
+}
+
+/*
+ * Load time and resident memory of JSON against binary profiles.
+ * Usage: bench_profile_load [json_profile_path] [num_models]
+ */
+int main(int argc, char **argv){
+    std::string json_path = argc > 1 ? argv[1] : RESNET50_PROFILE_PATH;
+    size_t num_models = argc > 2 ? std::stoul(argv[2]) : 300;
+    std::string binary_path = json_path + ".bin";
+
+    efair::executor::ModelProfile profile;
+    ASSERT_STATUS(profile.load_json(json_path));
+    ASSERT_STATUS(profile.save_binary(binary_path));
+
+    std::cout << "Loading " << num_models << " copies of " << profile.get_model_name() << "\n";
+    bench_load("JSON", json_path, num_models, false);
+    bench_load("Binary", binary_path, num_models, true);
+
+    std::remove(binary_path.c_str());
+    return 0;
+}
@@ -0,0 +1,85 @@
+//
+// Created by Qianlin Liang on 4/20/23.
+//
+
+#include <iostream>
+#include <map>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <vector>
+
+#include "scheduler/run_queue.h"
+
+/*
+ * Per-decision cost of the run queue: pick the minimum vruntime entity, charge it for a quantum and put it back, with
+ * one entity in every hundred going idle and waking up again. The multimap baseline does the same and then walks the
+ * tree for the total weight, like the scheduler used to. Usage: bench_run_queue [decisions]
+ */
+int main(int argc, char **argv){
+    size_t decisions = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    std::mt19937_64 rng(0);
+    std::uniform_real_distribution<double> charge(0.1, 1.0);
+
+    std::cout << "entities,run_queue_ns,multimap_ns\n";
+    for (size_t num_entities : {10, 1000, 100000}){
+        std::vector<size_t> weights(num_entities);
+        for (auto &w : weights){
+            w = 1 + rng() % 8;
+        }
+
+        efair::scheduler::RunQueue<size_t> run_queue;
+        std::vector<efair::scheduler::RunQueue<size_t>::Handle> handles(num_entities);
+        run_queue.reserve(num_entities);
+        for (size_t e = 0; e < num_entities; e++){
+            handles[e] = run_queue.insert(e, charge(rng), weights[e]);
+        }
+
+        volatile size_t sink = 0;
+        auto start_t = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < decisions; i++){
+            auto h = run_queue.top();
+            auto e = run_queue.get(h);
+            auto vruntime = run_queue.get_vruntime(h) + charge(rng);
+
+            if (i % 100 == 0){
+                run_queue.remove(h);
+                handles[e] = run_queue.insert(e, run_queue.get_min_vruntime(), weights[e]);
+            } else {
+                run_queue.update(h, vruntime);
+            }
+            sink = sink + run_queue.get_total_weight();
+        }
+        auto run_queue_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_t).count();
+
+        std::multimap<efair::VRuntime, size_t> tree;
+        for (size_t e = 0; e < num_entities; e++){
+            tree.insert({charge(rng), e});
+        }
+
+        // The linear total weight walk makes large trees slow, so they get fewer decisions
+        size_t tree_decisions = std::min(decisions, 100000000 / num_entities);
+        start_t = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < tree_decisions; i++){
+            auto it = tree.begin();
+            auto e = it->second;
+            auto vruntime = it->first + charge(rng);
+            tree.erase(it);
+            tree.insert({vruntime, e});
+
+            size_t total_weight = 0;
+            for (const auto &[key, entity] : tree){
+                total_weight += weights[entity];
+            }
+            sink = sink + total_weight;
+        }
+        auto multimap_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_t).count();
+
+        std::cout << num_entities << "," << static_cast<double>(run_queue_ns) / decisions << ","
+                  << static_cast<double>(multimap_ns) / tree_decisions << "\n";
+    }
+
+    return 0;
+}
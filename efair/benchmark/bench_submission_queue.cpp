@@ -0,0 +1,93 @@
+//
+// Created by Qianlin Liang on 4/26/23.
+//
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "scheduler/submission_queue.h"
+
+struct Item {
+    size_t value;
+    Item *next;
+};
+
+/*
+ * Submission throughput with 1 to N producer threads against one consumer that keeps draining, for the lock-free
+ * submission queue and for a mutex protected deque that producers and the consumer share, like the entity queue did.
+ * The consumer column is the longest single drain, which for the mutex includes waiting for producers.
+ * Usage: bench_submission_queue [items_per_producer] [max_producers]
+ */
+template<typename Push, typename Drain>
+void run(size_t num_producers, size_t num_items, Push push, Drain drain, double &mops, double &max_drain_us){
+    std::vector<std::vector<Item>> items(num_producers, std::vector<Item>(num_items));
+    std::atomic_bool start{false};
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < num_producers; p++){
+        producers.emplace_back([&, p] {
+            while (!start.load());
+            for (auto &item : items[p]){
+                push(&item);
+            }
+        });
+    }
+
+    size_t received = 0;
+    max_drain_us = 0;
+    auto start_t = std::chrono::steady_clock::now();
+    start.store(true);
+    while (received < num_producers * num_items){
+        auto drain_start_t = std::chrono::steady_clock::now();
+        received += drain();
+        max_drain_us = std::max(max_drain_us, std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - drain_start_t).count());
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_t).count();
+
+    for (auto &t : producers){
+        t.join();
+    }
+    mops = num_producers * num_items / seconds * 1e-6;
+}
+
+int main(int argc, char **argv){
+    size_t num_items = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    size_t max_producers = argc > 2 ? std::stoul(argv[2]) : std::max(2u, std::thread::hardware_concurrency()) - 1;
+
+    std::cout << "producers,queue_mops,queue_max_drain_us,mutex_mops,mutex_max_drain_us\n";
+    for (size_t num_producers = 1; num_producers <= max_producers; num_producers *= 2){
+        double queue_mops, queue_drain, mutex_mops, mutex_drain;
+
+        efair::scheduler::SubmissionQueue<Item, &Item::next> queue;
+        run(num_producers, num_items, [&](Item *item) { queue.push(item); }, [&] {
+            size_t n = 0;
+            for (auto *item = queue.drain(); item != nullptr; item = item->next){
+                n++;
+            }
+            return n;
+        }, queue_mops, queue_drain);
+
+        std::mutex lock;
+        std::deque<Item *> deque;
+        run(num_producers, num_items, [&](Item *item) {
+            std::unique_lock<std::mutex> guard(lock);
+            deque.push_back(item);
+        }, [&] {
+            std::unique_lock<std::mutex> guard(lock);
+            size_t n = deque.size();
+            deque.clear();
+            return n;
+        }, mutex_mops, mutex_drain);
+
+        std::cout << num_producers << "," << queue_mops << "," << queue_drain << "," << mutex_mops << ","
+                  << mutex_drain << "\n";
+    }
+
+    return 0;
+}
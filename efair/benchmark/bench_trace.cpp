@@ -0,0 +1,57 @@
+//
+// Created by Qianlin Liang on 4/28/23.
+//
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "util/trace.h"
+
+/*
+ * Cost of recording one trace event from 1 to N threads, each recording into its own ring, compared with recording
+ * while tracing is disabled. Every event takes a steady clock reading, which is most of the cost.
+ * Usage: bench_trace [events_per_thread] [max_threads]
+ */
+double run(efair::util::Tracer &tracer, size_t num_threads, size_t num_events){
+    std::atomic_bool start{false};
+    std::vector<double> ns_per_event(num_threads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; t++){
+        threads.emplace_back([&, t] {
+            tracer.record(efair::util::TaskSubmit, 0, t);   // registers the ring outside the timed loop
+            while (!start.load());
+            auto start_t = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < num_events; i++){
+                tracer.record(efair::util::KernelDispatch, i, t);
+            }
+            ns_per_event[t] = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start_t).count() / num_events;
+        });
+    }
+    start.store(true);
+    for (auto &t : threads){
+        t.join();
+    }
+    return *std::max_element(ns_per_event.begin(), ns_per_event.end());
+}
+
+int main(int argc, char **argv){
+    size_t num_events = argc > 1 ? std::stoul(argv[1]) : 10000000;
+    size_t max_threads = argc > 2 ? std::stoul(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+
+    std::cout << "threads,enabled_ns_per_event,disabled_ns_per_event\n";
+    for (size_t num_threads = 1; num_threads <= max_threads; num_threads *= 2){
+        efair::util::Tracer tracer;
+        tracer.set_enabled(true);
+        double enabled_ns = run(tracer, num_threads, num_events);
+        tracer.set_enabled(false);
+        double disabled_ns = run(tracer, num_threads, num_events);
+        std::cout << num_threads << "," << enabled_ns << "," << disabled_ns << "\n";
+    }
+
+    return 0;
+}
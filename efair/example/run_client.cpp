@@ -8,6 +8,7 @@
 #include <thread>
 #include <csignal>
 #include <chrono>
+#include <cstring>
 
 #include "rpc/client.h"
 
@@ -21,7 +22,7 @@ void interrupt_handler(int signum) {
 int main(int argc, char **argv) {
     if (argc < 6) {
         std::cerr << "Expected arguments [model_path] [model_profile_path] [frequency_idx] [priority] [num_threads] "
-                  << "with optional [delay start time] and [duration]"
+                  << "with optional [delay start time], [duration] and [deadline_us]"
                   << std::endl;
         std::exit(1);
     }
@@ -33,22 +34,32 @@ int main(int argc, char **argv) {
 
     std::string model_path = argv[1];
     std::string model_profile_path = argv[2];
-    std::string frequency = avai_frequencies[std::atoi(argv[3])];
+    // sloN asks the server for the most energy efficient frequency that finishes an inference in N µs
+    std::string frequency;
+    efair::MicroSeconds latency_target = 0;
+    if (std::strncmp(argv[3], "slo", 3) == 0)
+        latency_target = std::stoul(argv[3] + 3);
+    else
+        frequency = avai_frequencies[std::atoi(argv[3])];
     int priority = std::atoi(argv[4]);
     int num_threads = std::atoi(argv[5]);
     int delay_start_time_second = 0, duration_second = 0;
+    efair::MicroSeconds deadline = 0;
 
     if (argc > 6)
         delay_start_time_second = std::atoi(argv[6]);
     if (argc > 7)
         duration_second = std::atoi(argv[7]);
+    if (argc > 8)
+        deadline = std::atol(argv[8]);
 
     if (delay_start_time_second > 0)
         std::this_thread::sleep_for(std::chrono::seconds(delay_start_time_second));
 
     std::signal(SIGINT, interrupt_handler);
 
-    efair::rpc::EFairClient client(SERVER_ADDRESS, model_path, model_profile_path, frequency, priority);
+    efair::rpc::EFairClient client(SERVER_ADDRESS, model_path, model_profile_path, frequency, priority, deadline,
+                                    latency_target);
 
     std::vector<std::thread> thread_pool;
 
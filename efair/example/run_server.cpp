@@ -3,6 +3,10 @@
 //
 
 #include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cstring>
 #include <csignal>
 #include <mutex>
 #include <condition_variable>
@@ -13,6 +17,7 @@
 efair::scheduler::EFairScheduler *scheduler = nullptr;
 efair::rpc::EFairServer *server = nullptr;
 bool shutdown_requested = false;
+bool tracing = false;
 std::mutex lk;
 std::condition_variable cv;
 
@@ -46,29 +51,91 @@ void shutdown_server(){
 
     std::filesystem::create_directories(result_folder/folder_name);
     scheduler->export_task_data(result_folder/folder_name/"tasks.csv");
+    if (tracing)
+        scheduler->export_trace(result_folder/folder_name/"trace.json");
+}
+
+void usage(){
+    std::cerr << "Usage: run_server [quantum_size] [phi] [device] [--option=value ...], with options "
+              << "--executors_per_model=N --dispatch_mode=range --model_memory_mb=N --task_spill_path=PATH "
+              << "--freq_group_lag=X --trace --log_every_n=N --vruntime_mode=hybrid --quantum_fit=yield|borrow "
+              << "--batch_delay=US --input_staging" << std::endl;
+    std::exit(1);
 }
 
 int main(int argc, char **argv){
-    if (argc < 4) {
-        std::cerr << "Need as least 3 arguments to run server: [quantum_size] [phi] [device] " << std::endl;
-        std::exit(1);
-    }
+    if (argc < 4)
+        usage();
 
     std::signal(SIGINT, interrupt_handler);
 
     auto quantum_size = static_cast<efair::MicroSeconds>(std::atoi(argv[1]));
     auto phi = std::atof(argv[2]);
 
-    tvm::Device dev;
+    std::vector<tvm::Device> devices;
+    size_t cpu_threads = 0;
     if (std::strcmp(argv[3], "gpu") == 0){
         std::cout << "Using GPU." << std::endl;
-        dev = {kDLCUDA, 0};
+        devices.push_back({kDLCUDA, 0});
     } else {
-        std::cout << "Using CPU" << std::endl;
-        dev = {kDLCPU};
+        // cpuN splits the CPU into N devices with their own dispatcher and share of the cores
+        size_t num_devices = std::strncmp(argv[3], "cpu", 3) == 0 && argv[3][3] != '\0' ? std::stoul(argv[3] + 3) : 1;
+        for (size_t i = 0; i < num_devices; i++){
+            devices.push_back({kDLCPU, static_cast<int>(i)});
+        }
+        if (num_devices > 1)
+            cpu_threads = std::max(1u, std::thread::hardware_concurrency() / static_cast<unsigned>(num_devices));
+        std::cout << "Using CPU as " << num_devices << " devices" << std::endl;
     }
 
-    scheduler = new efair::scheduler::EFairScheduler(quantum_size, phi, dev);
+    scheduler = new efair::scheduler::EFairScheduler(quantum_size, phi, devices);
+    if (cpu_threads > 0)
+        ASSERT_STATUS(scheduler->set_cpu_threads(cpu_threads));
+    for (int i = 4; i < argc; i++){
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+            usage();
+        auto eq = arg.find('=');
+        auto name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        auto value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+
+        if (name == "executors_per_model"){
+            ASSERT_STATUS(scheduler->set_executor_instances(std::stoul(value)));
+        } else if (name == "dispatch_mode"){
+            if (value != "range")
+                usage();
+            ASSERT_STATUS(scheduler->set_dispatch_mode(efair::scheduler::EFairScheduler::KernelRange));
+        } else if (name == "model_memory_mb"){
+            ASSERT_STATUS(scheduler->set_model_memory_budget(std::stoul(value) << 20));
+        } else if (name == "task_spill_path"){
+            ASSERT_STATUS(scheduler->set_task_history(65536, value));
+        } else if (name == "freq_group_lag"){
+            ASSERT_STATUS(scheduler->set_frequency_grouping(std::stod(value)));
+        } else if (name == "trace"){
+            tracing = true;
+            ASSERT_STATUS(scheduler->set_tracing(true));
+        } else if (name == "log_every_n"){
+            ASSERT_STATUS(scheduler->set_hot_path_logging(std::stoul(value)));
+        } else if (name == "vruntime_mode"){
+            if (value != "hybrid")
+                usage();
+            ASSERT_STATUS(scheduler->set_vruntime_mode(efair::scheduler::EFairScheduler::Hybrid));
+        } else if (name == "quantum_fit"){
+            if (value == "yield")
+                ASSERT_STATUS(scheduler->set_quantum_fit(efair::scheduler::EFairScheduler::Yield));
+            else if (value == "borrow")
+                ASSERT_STATUS(scheduler->set_quantum_fit(efair::scheduler::EFairScheduler::Borrow));
+            else
+                usage();
+        } else if (name == "batch_delay"){
+            ASSERT_STATUS(scheduler->set_batch_delay(std::stoul(value)));
+        } else if (name == "input_staging"){
+            ASSERT_STATUS(scheduler->set_input_staging(true));
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            usage();
+        }
+    }
     server = new efair::rpc::EFairServer(SERVER_ADDRESS, scheduler);
 
     std::thread t(shutdown_server);
@@ -2,7 +2,13 @@
 // Created by ubuntu on 2/28/23.
 //
 
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_set>
 #include <tvm/runtime/data_type.h>
+#include <tvm/runtime/registry.h>
 
 #include "executor.h"
 
@@ -11,107 +17,438 @@ namespace efair {
 namespace executor {
 
     Executor::Executor(const std::string &model_filename, tvm::Device dev) {
-        // Load model
-        tvm::runtime::Module module_factory = tvm::runtime::Module::LoadFromFile(model_filename);
-        _module = module_factory.GetFunction("default")(dev);
-        _device = dev;
-
-        _set_input_fn = _module.GetFunction(SET_INPUT_FUNC_NAME);
-        _get_output_fn = _module.GetFunction(GET_OUTPUT_FUNC_NAME);
-        _execute_fn = _module.GetFunction(EXECUTE_FUNC_NAME);
-        _execute_kernel_fn = _module.GetFunction(EXECUTE_KERNEL_FUNC_NAME);
-
+        load_module(model_filename, dev);
         model_name = model_filename;
     }
+
     Executor::Executor(const std::string &model_filename, const std::string &profile_filename, tvm::Device dev) {
+        load_module(model_filename, dev);
+
+        // Load profile
+        _model_profile = std::make_shared<ModelProfile>();
+        if (_model_profile->load(profile_filename) != Status::Succeed)
+            throw std::runtime_error("Cannot load model profile " + profile_filename);
+
+        model_name = _model_profile->get_model_name();
+
+        // Compile the profile into a dense table in kernel order
+        _cost_table = std::make_shared<KernelCostTable>();
+        if (_cost_table->build(*_model_profile, _kernel_names) != Status::Succeed)
+            throw std::runtime_error("Profile " + profile_filename + " does not match model " + model_filename);
+        _costs = _cost_table->get_snapshot();
+    }
+
+    Executor::Executor(const Executor &prototype, tvm::Device dev) :
+            model_name(prototype.model_name),
+            _library(prototype._library),
+            _param_source(&prototype),
+            _has_kernel_api(prototype._has_kernel_api),
+            _kernel_names(prototype._kernel_names),
+            _input_info(prototype._input_info),
+            _model_profile(prototype._model_profile),
+            _cost_table(prototype._cost_table),
+            _costs(prototype._cost_table ? prototype._cost_table->get_snapshot() : nullptr) {
+        instantiate(dev);
+    }
+
+    void Executor::load_module(const std::string &model_filename, tvm::Device dev) {
         // Load model
-        tvm::runtime::Module module_factory = tvm::runtime::Module::LoadFromFile(model_filename);
-        _module = module_factory.GetFunction("default")(dev);
+        _library = tvm::runtime::Module::LoadFromFile(model_filename);
+        instantiate(dev);
+
+        // Resolve kernel names so that nothing on the execution path goes through the function table
+        tvm::runtime::PackedFunc get_num_kernels_fn = _module.GetFunction(GET_NUM_KERNELS_FUNC_NAME);
+        tvm::runtime::PackedFunc get_kernel_name_fn = _module.GetFunction(GET_KERNEL_NAME_FUNC_NAME);
+        _has_kernel_api = get_num_kernels_fn.defined() && get_kernel_name_fn.defined();
+
+        if (_has_kernel_api){
+            int num_kernels = get_num_kernels_fn();
+            _kernel_names.reserve(num_kernels);
+            for (int i = 0; i < num_kernels; i++){
+                _kernel_names.push_back(static_cast<tvm::String>(get_kernel_name_fn(i)));
+            }
+        }
+
+        tvm::runtime::PackedFunc get_input_info_fn = _module.GetFunction(GET_INPUT_INFO_FUNC_NAME);
+        if (get_input_info_fn.defined()){
+            tvm::Map<tvm::String, tvm::ObjectRef> input_info = get_input_info_fn();
+            auto input_shapes = tvm::Downcast<tvm::Map<tvm::String, tvm::ObjectRef>>(input_info["shape"]);
+            auto input_dtypes = tvm::Downcast<tvm::Map<tvm::String, tvm::ObjectRef>>(input_info["dtype"]);
+
+            for (const auto &[key, shape] : input_shapes){
+                TensorInfo info;
+                info.shape = tvm::Downcast<tvm::ShapeTuple>(shape);
+                info.dtype = tvm::runtime::String2DLDataType(tvm::Downcast<tvm::String>(input_dtypes[key]));
+                info.nbytes = info.dtype.bits * info.dtype.lanes / 8;
+                for (auto &s : info.shape){
+                    info.nbytes *= s;
+                }
+                _input_info.insert({key, info});
+            }
+        }
+    }
+
+    void Executor::instantiate(tvm::Device dev) {
+        // Every instance gets its own graph executor, and with it its own activation and input storage.
+        // Parameters are only uploaded when there is no loaded instance on dev to take them from.
+        if (can_share_params(dev)){
+            tvm::runtime::Module factory = _library.GetFunction("remove_params")();
+            _module = factory.GetFunction("default")(dev);
+            share_params();
+        } else {
+            _module = _library.GetFunction("default")(dev);
+        }
         _device = dev;
 
+        // CPU has no streams and gets nullptr back, every other device gets a stream of its own
+        _device_api = tvm::runtime::DeviceAPI::Get(dev);
+        _stream = _device_api->CreateStream(dev);
+
         _set_input_fn = _module.GetFunction(SET_INPUT_FUNC_NAME);
+        _get_input_fn = _module.GetFunction(GET_INPUT_FUNC_NAME);
         _get_output_fn = _module.GetFunction(GET_OUTPUT_FUNC_NAME);
         _execute_fn = _module.GetFunction(EXECUTE_FUNC_NAME);
         _execute_kernel_fn = _module.GetFunction(EXECUTE_KERNEL_FUNC_NAME);
+        _execute_kernel_range_fn = _module.GetFunction(EXECUTE_KERNEL_RANGE_FUNC_NAME);
+
+        set_pinned_staging(true);
+
+        _outputs.clear();
+        _output_info.clear();
+        _host_outputs.clear();
+        tvm::runtime::PackedFunc get_num_outputs_fn = _module.GetFunction(GET_NUM_OUTPUTS_FUNC_NAME);
+        if (get_num_outputs_fn.defined()){
+            int num_outputs = get_num_outputs_fn();
+            for (int i = 0; i < num_outputs; i++){
+                tvm::runtime::NDArray out = _get_output_fn(i);
+                _outputs.push_back(out);
+
+                TensorInfo info;
+                info.shape = out.Shape();
+                info.dtype = out->dtype;
+                info.nbytes = info.dtype.bits * info.dtype.lanes / 8;
+                for (auto &s : info.shape){
+                    info.nbytes *= s;
+                }
+                _output_info.push_back(info);
+
+                if (dev.device_type == kDLCPU)
+                    _host_outputs.push_back(out);
+                else
+                    _host_outputs.push_back(tvm::runtime::NDArray::Empty(info.shape, info.dtype, _staging_device));
+            }
+        }
+    }
 
-        // Load profile
-        auto *root = new pt::ptree;
-        pt::read_json(profile_filename, *root);
+    bool Executor::can_share_params(tvm::Device dev) const {
+        if (_param_source == nullptr || !_param_source->is_loaded())
+            return false;
+        if (_param_source->_device.device_type != dev.device_type || _param_source->_device.device_id != dev.device_id)
+            return false;
+
+        const tvm::runtime::Module &source = _param_source->_module;
+        return _library.GetFunction("remove_params").defined() &&
+               source.GetFunction("get_num_inputs").defined() &&
+               source.GetFunction("get_input_index").defined() &&
+               source.GetFunction(GET_INPUT_FUNC_NAME).defined() &&
+               source.GetFunction("set_input_zero_copy").defined();
+    }
+
+    void Executor::share_params() {
+        const tvm::runtime::Module &source = _param_source->_module;
+        tvm::runtime::PackedFunc get_input_index_fn = _module.GetFunction("get_input_index");
+        tvm::runtime::PackedFunc set_input_zero_copy_fn = _module.GetFunction("set_input_zero_copy");
+        tvm::runtime::PackedFunc get_source_input_fn = source.GetFunction(GET_INPUT_FUNC_NAME);
+
+        // Graph inputs that are not model inputs are parameters, point them at the source's tensors
+        std::unordered_set<int> data_inputs;
+        for (const auto &kv : _input_info){
+            int idx = get_input_index_fn(kv.first);
+            data_inputs.insert(idx);
+        }
+
+        _shared_params.clear();
+        int num_inputs = source.GetFunction("get_num_inputs")();
+        for (int i = 0; i < num_inputs; i++){
+            if (data_inputs.count(i))
+                continue;
+            tvm::runtime::NDArray param = get_source_input_fn(i);
+            set_input_zero_copy_fn(i, param);
+            _shared_params.push_back(param);
+        }
+    }
 
-        _model_profile.reset(root);
-        model_name = _model_profile->get<std::string>("model_name");
+    void Executor::unload() {
+        if (!is_loaded())
+            return;
+
+        sync();
+        if (_stream != nullptr)
+            _device_api->FreeStream(_device, _stream);
+        _stream = nullptr;
+
+        _set_input_fn = tvm::runtime::PackedFunc();
+        _get_input_fn = tvm::runtime::PackedFunc();
+        _get_output_fn = tvm::runtime::PackedFunc();
+        _execute_fn = tvm::runtime::PackedFunc();
+        _execute_kernel_fn = tvm::runtime::PackedFunc();
+        _execute_kernel_range_fn = tvm::runtime::PackedFunc();
+
+        // Output info is metadata and stays valid, the tensors go with the graph executor
+        _outputs.clear();
+        _host_outputs.clear();
+        _shared_params.clear();
+        _module = tvm::runtime::Module();
+    }
+
+    void Executor::reload() {
+        if (!is_loaded())
+            instantiate(_device);
     }
 
     Status Executor::get_input_shape(const std::string &key, tvm::runtime::ShapeTuple &ret_shape) {
-        auto get_input_info_fn = _module.GetFunction("get_input_info");
+        auto it = _input_info.find(key);
+        if (it == _input_info.end()) return Status::Fail;
+
+        ret_shape = it->second.shape;
+        return Status::Succeed;
+    }
 
-        if (!get_input_info_fn.defined()) return Status::Fail;
-        tvm::Map<tvm::String, tvm::ObjectRef> input_info = get_input_info_fn();
+    Status Executor::get_input_dtype(const std::string &key, DLDataType &ret_dtype) {
+        auto it = _input_info.find(key);
+        if (it == _input_info.end()) return Status::Fail;
 
-        auto input_shapes = tvm::Downcast<tvm::Map<tvm::String, tvm::ObjectRef>>(input_info["shape"]);
+        ret_dtype = it->second.dtype;
+        return Status::Succeed;
+    }
 
-        ret_shape = tvm::Downcast<tvm::ShapeTuple>(input_shapes[key]);
+    Status Executor::get_input_size(const std::string &key, size_t &ret_size) {
+        auto it = _input_info.find(key);
+        if (it == _input_info.end()) return Status::Fail;
 
+        ret_size = it->second.nbytes;
         return Status::Succeed;
     }
 
-    Status Executor::get_input_dtype(const std::string &key, DLDataType &ret_dtype) {
-        auto get_input_info_fn = _module.GetFunction("get_input_info");
+    Status Executor::get_num_outputs(size_t &n) {
+        n = _output_info.size();
+        return Status::Succeed;
+    }
 
-        if (!get_input_info_fn.defined()) return Status::Fail;
-        tvm::Map<tvm::String, tvm::ObjectRef> input_info = get_input_info_fn();
+    Status Executor::get_output_shape(size_t idx, tvm::runtime::ShapeTuple &ret_shape) {
+        if (idx >= _output_info.size()) return Status::Fail;
 
-        auto input_shapes = tvm::Downcast<tvm::Map<tvm::String, tvm::ObjectRef>>(input_info["dtype"]);
+        ret_shape = _output_info[idx].shape;
+        return Status::Succeed;
+    }
+
+    Status Executor::get_output_dtype(size_t idx, DLDataType &ret_dtype) {
+        if (idx >= _output_info.size()) return Status::Fail;
+
+        ret_dtype = _output_info[idx].dtype;
+        return Status::Succeed;
+    }
+
+    Status Executor::get_output_size(size_t idx, size_t &ret_size) {
+        if (idx >= _output_info.size()) return Status::Fail;
 
-        ret_dtype = tvm::runtime::String2DLDataType(tvm::Downcast<tvm::String>(input_shapes[key]));
+        ret_size = _output_info[idx].nbytes;
         return Status::Succeed;
     }
 
     Status Executor::get_gpu_power(std::string freq, efair::MilliWatt &ret_gpu_power) {
-        std::string power_path = "gpu_power." + freq;
-        ret_gpu_power = _model_profile->get<MilliWatt>(power_path);
+        FreqIdx freq_idx;
+        RETURN_STATUS(get_freq_index(freq, freq_idx))
+
+        ret_gpu_power = _model_profile->get_gpu_power(freq_idx);
+        return Status::Succeed;
+    }
+
+    Status Executor::get_frequencies(std::vector<std::string> &freqs) {
+        freqs = _model_profile->get_frequencies();
         return Status::Succeed;
     }
 
     Status Executor::get_max_gpu_power(MilliWatt &ret_power) {
-        float cur_power = 0, max_power = 0;
+        MilliWatt max_power = 0;
 
-        for (const auto & [freq, power] : _model_profile->get_child("gpu_power")){
-            cur_power = std::stof(power.data());
-            if (cur_power > max_power)
-                max_power = cur_power;
+        for (FreqIdx f = 0; f < _model_profile->get_num_frequencies(); f++){
+            if (_model_profile->get_gpu_power(f) > max_power)
+                max_power = _model_profile->get_gpu_power(f);
         }
 
-        ret_power = static_cast<MilliWatt>(max_power);
+        ret_power = max_power;
         return Status::Succeed;
     }
 
+    Status Executor::get_freq_index(const std::string &freq, FreqIdx &freq_idx) {
+        if (_model_profile == nullptr)
+            return Status::Fail;
+
+        Status s = _model_profile->get_freq_index(freq, freq_idx);
+        if (s != Status::Succeed)
+            LOG(ERROR) << "Frequency " << freq << " is not found in the profile of " << model_name;
+        return s;
+    }
+
     Status Executor::set_input(const std::string &key, const void *input_data, size_t size) {
-        tvm::ShapeTuple shape;
-        DLDataType dtype;
-        tvm::Device cpu{kDLCPU, 0};
+        auto it = _input_info.find(key);
+        if (it == _input_info.end()){
+            LOG(ERROR) << "Input " << key << " is not found in model " << model_name;
+            return Status::Fail;
+        }
+
+        const auto &info = it->second;
+        if (size > info.nbytes){
+            LOG(ERROR) << "Copy input bytes fail, expect input size " << info.nbytes << " but get " << size;
+            return Status::Fail;
+        }
+
+        // A full input is copied once, straight into the input tensor of the module
+        if (size == info.nbytes){
+            if (!_get_input_fn.defined())
+                return set_input_zero_copy(key, input_data, size);
+            tvm::runtime::NDArray input = _get_input_fn(key);
+            input.CopyFromBytes(input_data, size);
+            return Status::Succeed;
+        }
+
+        // A shorter input fills the front of the tensor, the rest is zeroed rather than left from an earlier input
+        tvm::runtime::NDArray input_ndarray;
+        RETURN_STATUS(acquire_staging_buffer(key, input_ndarray))
+        auto *staged = static_cast<uint8_t *>(input_ndarray->data);
+        std::memcpy(staged, input_data, size);
+        std::memset(staged + size, 0, info.nbytes - size);
+
+        Status s = set_input(key, input_ndarray);
+        release_staging_buffer(key, std::move(input_ndarray));
+        return s;
+    }
+
+    Status Executor::set_input_zero_copy(const std::string &key, const void *input_data, size_t size) {
+        auto it = _input_info.find(key);
+        if (it == _input_info.end()){
+            LOG(ERROR) << "Input " << key << " is not found in model " << model_name;
+            return Status::Fail;
+        }
+
+        const auto &info = it->second;
+        if (size != info.nbytes){
+            LOG(ERROR) << "Copy input bytes fail, expect input size " << info.nbytes << " but get " << size;
+            return Status::Fail;
+        }
+
+        if (!_set_input_fn.defined()){
+            LOG(ERROR) << "PackedFunction set_input is not defined.";
+            return Status::Fail;
+        }
+
+        // Wrap the caller's buffer so that set_input copies it straight into the device input
+        DLTensor input_tensor;
+        input_tensor.data = const_cast<void *>(input_data);
+        input_tensor.device = {kDLCPU, 0};
+        input_tensor.ndim = static_cast<int32_t>(info.shape.size());
+        input_tensor.dtype = info.dtype;
+        input_tensor.shape = const_cast<int64_t *>(info.shape.data());
+        input_tensor.strides = nullptr;
+        input_tensor.byte_offset = 0;
+
+        _set_input_fn(key, &input_tensor);
+        return Status::Succeed;
+    }
+
+    Status Executor::stage_input(const std::string &key, const tvm::runtime::NDArray &input_data,
+                                 TVMStreamHandle stream) {
+        return stage_tensor(key, input_data.operator->(), stream);
+    }
+
+    Status Executor::stage_input(const std::string &key, const void *input_data, size_t size, TVMStreamHandle stream) {
+        auto it = _input_info.find(key);
+        if (it == _input_info.end()){
+            LOG(ERROR) << "Input " << key << " is not found in model " << model_name;
+            return Status::Fail;
+        }
+
+        const auto &info = it->second;
+        if (size != info.nbytes){
+            LOG(ERROR) << "Copy input bytes fail, expect input size " << info.nbytes << " but get " << size;
+            return Status::Fail;
+        }
+
+        DLTensor input_tensor;
+        input_tensor.data = const_cast<void *>(input_data);
+        input_tensor.device = {kDLCPU, 0};
+        input_tensor.ndim = static_cast<int32_t>(info.shape.size());
+        input_tensor.dtype = info.dtype;
+        input_tensor.shape = const_cast<int64_t *>(info.shape.data());
+        input_tensor.strides = nullptr;
+        input_tensor.byte_offset = 0;
+        return stage_tensor(key, &input_tensor, stream);
+    }
 
-        RETURN_STATUS(get_input_shape(key, shape));
-        RETURN_STATUS(get_input_dtype(key, dtype));
+    Status Executor::stage_tensor(const std::string &key, const DLTensor *input_tensor, TVMStreamHandle stream) {
+        if (_input_info.find(key) == _input_info.end()){
+            LOG(ERROR) << "Input " << key << " is not found in model " << model_name;
+            return Status::Fail;
+        }
 
-        size_t data_size = 1;
-        for (auto& s : shape){
-            data_size *= s;
+        // set_input copies on the default stream, which waits for the kernels of every other instance. Modules
+        // handing out their input tensors get the copy on stream instead.
+        if (!_get_input_fn.defined()){
+            if (!_set_input_fn.defined()){
+                LOG(ERROR) << "PackedFunction set_input is not defined.";
+                return Status::Fail;
+            }
+            _set_input_fn(key, const_cast<DLTensor *>(input_tensor));
+            return Status::Succeed;
         }
-        data_size = data_size * (dtype.bits / 8);
 
-        if (size > data_size){
-            LOG(ERROR) << "Copy input bytes fail, expect input size " << data_size << " but get " << size;
+        tvm::runtime::NDArray input = _get_input_fn(key);
+        tvm::runtime::NDArray::CopyFromTo(input_tensor, const_cast<DLTensor *>(input.operator->()), stream);
+        return Status::Succeed;
+    }
+
+    Status Executor::acquire_staging_buffer(const std::string &key, tvm::runtime::NDArray &buffer) {
+        auto it = _input_info.find(key);
+        if (it == _input_info.end()){
+            LOG(ERROR) << "Input " << key << " is not found in model " << model_name;
             return Status::Fail;
         }
 
-        tvm::runtime::NDArray input_ndarray = tvm::runtime::NDArray::Empty(shape, dtype, cpu);
-        input_ndarray.CopyFromBytes(input_data, size);
+        {
+            std::unique_lock<std::mutex> lock(_staging_lock);
+            auto &pool = _staging_pool[key];
+            if (!pool.empty()){
+                buffer = std::move(pool.back());
+                pool.pop_back();
+                return Status::Succeed;
+            }
+        }
 
-        RETURN_STATUS(set_input(key, input_ndarray));
+        buffer = tvm::runtime::NDArray::Empty(it->second.shape, it->second.dtype, _staging_device);
         return Status::Succeed;
     }
 
+    void Executor::release_staging_buffer(const std::string &key, tvm::runtime::NDArray buffer) {
+        std::unique_lock<std::mutex> lock(_staging_lock);
+
+        // Drop buffers allocated before the staging device changed
+        if (buffer->device.device_type != _staging_device.device_type)
+            return;
+        _staging_pool[key].push_back(std::move(buffer));
+    }
+
+    void Executor::set_pinned_staging(bool pinned) {
+        std::unique_lock<std::mutex> lock(_staging_lock);
+
+        if (pinned && _device.device_type == kDLCUDA && tvm::runtime::Registry::Get("device_api.cuda_host"))
+            _staging_device = {kDLCUDAHost, 0};
+        else
+            _staging_device = {kDLCPU, 0};
+
+        _staging_pool.clear();
+    }
+
     Status Executor::set_input(const std::string &key, const tvm::runtime::NDArray &input_data) {
         if (!_set_input_fn.defined()){
             LOG(ERROR) << "PackedFunction set_input is not defined.";
@@ -123,7 +460,7 @@ namespace executor {
 
 
     Status Executor::get_output(size_t idx, tvm::runtime::NDArray &out) {
-        int num_outputs = _module.GetFunction("get_num_outputs")();
+        size_t num_outputs = _outputs.size();
         if (idx >= num_outputs){
             LOG(ERROR) << "Get output out of range, totally " << num_outputs << " but getting index " << idx;
             return Status::Fail;
@@ -133,62 +470,284 @@ namespace executor {
         return Status::Succeed;
     }
 
+    Status Executor::get_output(size_t idx, void *buffer, size_t size) {
+        if (idx >= _outputs.size()){
+            LOG(ERROR) << "Get output out of range, totally " << _outputs.size() << " but getting index " << idx;
+            return Status::Fail;
+        }
+
+        if (size != _output_info[idx].nbytes){
+            LOG(ERROR) << "Copy output bytes fail, expect output size " << _output_info[idx].nbytes << " but get "
+                       << size;
+            return Status::Fail;
+        }
+
+        _outputs[idx].CopyToBytes(buffer, size);
+        return Status::Succeed;
+    }
+
+    Status Executor::get_output_view(size_t idx, const DLTensor *&view) {
+        if (idx >= _outputs.size()){
+            LOG(ERROR) << "Get output out of range, totally " << _outputs.size() << " but getting index " << idx;
+            return Status::Fail;
+        }
+
+        // The view stays valid until the next call for the same output
+        if (_device.device_type != kDLCPU)
+            _outputs[idx].CopyTo(_host_outputs[idx]);
+
+        view = _host_outputs[idx].operator->();
+        return Status::Succeed;
+    }
+
+    Status Executor::get_output_rows(size_t idx, const float *&data, size_t &num_rows, size_t &row_size) {
+        const DLTensor *view;
+        RETURN_STATUS(get_output_view(idx, view))
+
+        if (view->dtype.code != kDLFloat || view->dtype.bits != 32 || view->ndim == 0){
+            LOG(ERROR) << "Host output reduction requires a float32 output";
+            return Status::Fail;
+        }
+
+        row_size = view->shape[view->ndim - 1];
+        num_rows = row_size == 0 ? 0 : _output_info[idx].nbytes / sizeof(float) / row_size;
+        data = reinterpret_cast<const float *>(static_cast<const char *>(view->data) + view->byte_offset);
+        return Status::Succeed;
+    }
+
+    Status Executor::get_host_output_argmax(size_t idx, std::vector<int64_t> &indices) {
+        const float *data;
+        size_t num_rows, row_size;
+        RETURN_STATUS(get_output_rows(idx, data, num_rows, row_size))
+
+        indices.resize(num_rows);
+        for (size_t r = 0; r < num_rows; r++){
+            const float *row = data + r * row_size;
+            indices[r] = std::max_element(row, row + row_size) - row;
+        }
+
+        return Status::Succeed;
+    }
+
+    Status Executor::get_host_output_topk(size_t idx, size_t k, std::vector<int64_t> &indices,
+                                          std::vector<float> &values) {
+        const float *data;
+        size_t num_rows, row_size;
+        RETURN_STATUS(get_output_rows(idx, data, num_rows, row_size))
+
+        k = std::min(k, row_size);
+        indices.resize(num_rows * k);
+        values.resize(num_rows * k);
+
+        std::vector<int64_t> order(row_size);
+        for (size_t r = 0; r < num_rows; r++){
+            const float *row = data + r * row_size;
+            std::iota(order.begin(), order.end(), 0);
+            std::partial_sort(order.begin(), order.begin() + k, order.end(),
+                              [row](int64_t a, int64_t b) { return row[a] > row[b]; });
+
+            for (size_t i = 0; i < k; i++){
+                indices[r * k + i] = order[i];
+                values[r * k + i] = row[order[i]];
+            }
+        }
+
+        return Status::Succeed;
+    }
+
+    Executor::~Executor() {
+        if (_stream != nullptr)
+            _device_api->FreeStream(_device, _stream);
+    }
+
     void Executor::execute() {
+        bind_stream();
         _execute_fn();
     }
 
     void Executor::execute(const std::string &freq, efair::MicroSeconds &time_used, efair::MicroJoule &energy_used) {
-        execute();
-        std::string time_json_path = "exec_time." + freq;
-        std::string energy_json_path = "energy." + freq;
+        FreqIdx freq_idx;
+        ASSERT_STATUS(get_freq_index(freq, freq_idx));
+        execute(freq_idx, time_used, energy_used);
+    }
 
+    void Executor::execute(const FreqIdx &freq_idx, efair::MicroSeconds &time_used, efair::MicroJoule &energy_used) {
+        if (_timing) start_timer();
+        execute();
 
-        time_used = _model_profile->get<efair::MicroSeconds>(time_json_path);
-        energy_used = _model_profile->get<efair::MicroJoule>(energy_json_path);
+        time_used = _model_profile->get_exec_time(freq_idx);
+        energy_used = _model_profile->get_energy(freq_idx);
+        if (_timing) stop_timer(0, _kernel_names.size(), freq_idx, time_used);
     }
 
     void Executor::execute_kernel(const size_t &idx) {
+        bind_stream();
         _execute_kernel_fn(idx);
     }
 
     void Executor::execute_kernel(const size_t &idx, const std::string &freq, efair::MicroSeconds &time_used,
                                   efair::MicroJoule &energy_used) {
+        FreqIdx freq_idx;
+        ASSERT_STATUS(get_freq_index(freq, freq_idx));
+        execute_kernel(idx, freq_idx, time_used, energy_used);
+    }
+
+    void Executor::execute_kernel(const size_t &idx, const FreqIdx &freq_idx, efair::MicroSeconds &time_used,
+                                  efair::MicroJoule &energy_used) {
+        if (_timing) start_timer();
         execute_kernel(idx);
 
-        std::string kernel_name;
-        MilliWatt cur_gpu_power;
-        get_kernel_name(idx, kernel_name);
+        auto cost = _costs->get(idx, freq_idx);
+        time_used = cost.exec_time;
+        energy_used = cost.energy;
+        if (_timing) stop_timer(idx, idx + 1, freq_idx, time_used);
+    }
+
+    void Executor::execute_kernel_range(const KernelIdx &begin, const KernelIdx &end) {
+        bind_stream();
+
+        // Runtimes without the ranged entry point still get the range, one kernel per call
+        if (_execute_kernel_range_fn.defined()){
+            _execute_kernel_range_fn(begin, end);
+            return;
+        }
+
+        for (KernelIdx idx = begin; idx < end; idx++){
+            _execute_kernel_fn(idx);
+        }
+    }
 
-        std::string time_json_path = "kernel_profile." + kernel_name + ".exec_time." + freq;
-//        std::string energy_json_path = "kernel_profile." + kernel_name + ".energy." + freq;
+    void Executor::execute_kernel_range(const KernelIdx &begin, const KernelIdx &end, const FreqIdx &freq_idx,
+                                        efair::MicroSeconds &time_used, efair::MicroJoule &energy_used) {
+        if (_timing) start_timer();
+        execute_kernel_range(begin, end);
 
-        time_used = _model_profile->get<efair::MicroSeconds>(time_json_path);
-        get_gpu_power(freq, cur_gpu_power);
-        energy_used = cur_gpu_power * time_used * 1e-3;
-//        energy_used = _model_profile->get<efair::MicroJoule>(energy_json_path);
+        _costs->get_range(begin, end, freq_idx, time_used, energy_used);
+        if (_timing) stop_timer(begin, end, freq_idx, time_used);
     }
 
-    Status Executor::get_num_kernels(size_t &n) {
-        tvm::runtime::PackedFunc get_num_kernels_fn = _module.GetFunction(GET_NUM_KERNELS_FUNC_NAME);
+    KernelIdx Executor::fit_kernel_range(const KernelIdx &begin, const FreqIdx &freq_idx, efair::MicroSeconds budget) {
+        return _costs->fit_range(begin, freq_idx, budget);
+    }
 
-        if (!get_num_kernels_fn.defined()) return Status::Fail;
+    Status Executor::get_kernel_range_cost(const KernelIdx &begin, const KernelIdx &end, const FreqIdx &freq_idx,
+                                           efair::MicroSeconds &exec_time, efair::MicroJoule &energy) {
+        if (!_has_kernel_api || begin > end || end > _cost_table->get_num_kernels() ||
+            freq_idx >= _cost_table->get_num_frequencies())
+            return Status::Fail;
 
-        int k = get_num_kernels_fn();
-        n = (size_t) k;
+        // Also asked by other threads, e.g. admission, so this reads the table rather than this instance's view
+        _cost_table->get_range(begin, end, freq_idx, exec_time, energy);
         return Status::Succeed;
     }
 
-    Status Executor::get_kernel_name(size_t idx, std::string &kernel_name) {
-        tvm::runtime::PackedFunc get_kernel_name_fn = _module.GetFunction(GET_KERNEL_NAME_FUNC_NAME);
+    Status Executor::get_num_kernels(size_t &n) {
+        if (!_has_kernel_api) return Status::Fail;
 
-        if (!get_kernel_name_fn.defined()) return Status::Fail;
+        n = _kernel_names.size();
+        return Status::Succeed;
+    }
 
-        kernel_name = static_cast<tvm::String>(get_kernel_name_fn(idx));
+    Status Executor::get_kernel_name(size_t idx, std::string &kernel_name) {
+        if (!_has_kernel_api || idx >= _kernel_names.size()) return Status::Fail;
+
+        kernel_name = _kernel_names[idx];
         return Status::Succeed;
     }
 
     void Executor::sync() {
-        TVMSynchronize(_device.device_type, _device.device_id, _stream);
+        _device_api->StreamSync(_device, _stream);
+
+        for (auto &pending : _pending_timers){
+            MicroSeconds measured_time = pending.timer->SyncAndGetElapsedNanos() / 1000;
+            _measured_time += measured_time;
+
+            if (_ewma_alpha <= 0 || !_cost_table)
+                continue;
+
+            if (!_cost_table->observe(pending.begin, pending.end, pending.freq_idx, measured_time, _ewma_alpha,
+                                      _deviation_threshold)){
+                LOG_EVERY_N(WARNING, 100) << model_name << " kernels [" << pending.begin << ", " << pending.end
+                                          << ") took " << measured_time << " µs, off the profile by more than "
+                                          << _deviation_threshold * 100 << "%";
+            }
+            if (std::find(_corrected_freqs.begin(), _corrected_freqs.end(), pending.freq_idx) == _corrected_freqs.end())
+                _corrected_freqs.push_back(pending.freq_idx);
+        }
+        _pending_timers.clear();
+
+        // Instances loaded without a profile have no costs to correct
+        if (!_cost_table)
+            return;
+
+        // Picks up corrections folded in by the other instances too
+        _cost_table->refresh(_corrected_freqs);
+        _corrected_freqs.clear();
+        _costs = _cost_table->get_snapshot();
+    }
+
+    void Executor::set_online_correction(double ewma_alpha, double deviation_threshold) {
+        _ewma_alpha = ewma_alpha;
+        _deviation_threshold = deviation_threshold;
+        if (_ewma_alpha > 0)
+            _timing = true;
+    }
+
+    Status Executor::save_profile(const std::string &profile_filename) {
+        if (_model_profile == nullptr || _cost_table == nullptr)
+            return Status::Fail;
+
+        // Other instances keep reading the shared profile, so the corrections go into a copy of it
+        ModelProfile corrected;
+        _model_profile->clone(corrected);
+
+        size_t row;
+        for (FreqIdx f = 0; f < _cost_table->get_num_frequencies(); f++){
+            double profiled_time = 0, current_time = 0;
+            for (KernelIdx k = 0; k < _kernel_names.size(); k++){
+                RETURN_STATUS(corrected.get_kernel_row(_kernel_names[k], row))
+
+                auto cost = _cost_table->get(k, f);
+                profiled_time += corrected.get_kernel_exec_time(row, f);
+                current_time += cost.exec_time;
+                corrected.set_kernel_cost(row, f, cost.exec_time, cost.energy);
+            }
+
+            // Model totals include the time between kernels, so they are scaled rather than replaced
+            if (profiled_time > 0){
+                double ratio = current_time / profiled_time;
+                corrected.set_cost(f, corrected.get_exec_time(f) * ratio, corrected.get_energy(f) * ratio);
+            }
+        }
+
+        return corrected.save_binary(profile_filename);
+    }
+
+    void Executor::set_timing(bool enabled) {
+        _timing = enabled;
+    }
+
+    void Executor::get_timing(efair::MicroSeconds &measured_time, efair::MicroSeconds &profiled_time) const {
+        measured_time = _measured_time;
+        profiled_time = _profiled_time;
+    }
+
+    void Executor::reset_timing() {
+        _pending_timers.clear();
+        _measured_time = 0;
+        _profiled_time = 0;
+    }
+
+    void Executor::start_timer() {
+        // Timer events are recorded on the runtime's current stream, so bind ours first
+        bind_stream();
+        _timer = tvm::runtime::Timer::Start(_device);
+    }
+
+    void Executor::stop_timer(KernelIdx begin, KernelIdx end, FreqIdx freq_idx, efair::MicroSeconds profiled_time) {
+        _timer->Stop();
+        _pending_timers.push_back({std::move(_timer), begin, end, freq_idx});
+        _profiled_time += profiled_time;
     }
 
 }   // namespace executor
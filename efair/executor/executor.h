@@ -8,90 +8,213 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <mutex>
+#include <unordered_map>
 
 #include <tvm/runtime/ndarray.h>
 #include <tvm/runtime/module.h>
 #include <tvm/runtime/device_api.h>
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/json_parser.hpp>
+#include <tvm/runtime/profiling.h>
 
+#include "executor/profile.h"
 #include "util/common.h"
 
 #define SET_INPUT_FUNC_NAME "set_input"
+#define GET_INPUT_FUNC_NAME "get_input"
 #define GET_OUTPUT_FUNC_NAME "get_output"
 #define EXECUTE_FUNC_NAME "execute"
 #define EXECUTE_KERNEL_FUNC_NAME "execute_kernel"
+#define EXECUTE_KERNEL_RANGE_FUNC_NAME "execute_kernel_range"
 #define GET_NUM_KERNELS_FUNC_NAME "get_num_kernels"
 #define GET_KERNEL_NAME_FUNC_NAME "get_kernel_name"
-
-namespace pt = boost::property_tree;
+#define GET_INPUT_INFO_FUNC_NAME "get_input_info"
+#define GET_NUM_OUTPUTS_FUNC_NAME "get_num_outputs"
 
 namespace efair {
 namespace executor {
     class Executor {
     public:
+        struct TensorInfo {
+            tvm::runtime::ShapeTuple shape;
+            DLDataType dtype;
+            size_t nbytes;
+        };
+
         std::string model_name;
 
         Executor() = delete;
         Executor(const std::string &model_filename, tvm::Device dev);
         Executor(const std::string &model_filename, const std::string &profile_filename, tvm::Device dev);
-        ~Executor() = default;
+        // New instance of prototype's model on dev, sharing the loaded library and profile, and the
+        // prototype's parameters when it is loaded on the same device. The prototype must outlive it.
+        Executor(const Executor &prototype, tvm::Device dev);
+        // Owns a stream and possibly aliases another instance's parameters, so it is never copied
+        Executor(const Executor &) = delete;
+        Executor &operator=(const Executor &) = delete;
+        ~Executor();
 
         Status get_input_shape(const std::string& key, tvm::runtime::ShapeTuple& ret_shape);
         Status get_input_dtype(const std::string& key, DLDataType& ret_dtype);
+        Status get_input_size(const std::string& key, size_t& ret_size);
+        Status get_num_outputs(size_t &n);
+        Status get_output_shape(size_t idx, tvm::runtime::ShapeTuple& ret_shape);
+        Status get_output_dtype(size_t idx, DLDataType& ret_dtype);
+        Status get_output_size(size_t idx, size_t& ret_size);
         Status get_max_gpu_power(MilliWatt &ret_power);
         Status get_gpu_power(std::string freq, MilliWatt &ret_gpu_power);
+        Status get_freq_index(const std::string &freq, FreqIdx &freq_idx);
+        // Profiled frequencies, indexed by FreqIdx
+        Status get_frequencies(std::vector<std::string> &freqs);
 
         Status set_input(const std::string& key, const tvm::runtime::NDArray& input_data);
+        // A full input is copied once into the device input. Inputs shorter than the tensor go through a host buffer
+        // that fills its front and zero pads the rest, the zero-copy paths need the full size.
         Status set_input(const std::string& key, const void* input_data, size_t size);
+        Status set_input_zero_copy(const std::string& key, const void* input_data, size_t size);
+        // Copy an input into the device input on stream without waiting for it, so that it can be staged while other
+        // instances run. The input is in place once stream is synchronized.
+        Status stage_input(const std::string& key, const tvm::runtime::NDArray& input_data, TVMStreamHandle stream);
+        Status stage_input(const std::string& key, const void* input_data, size_t size, TVMStreamHandle stream);
+
+        Status acquire_staging_buffer(const std::string& key, tvm::runtime::NDArray& buffer);
+        void release_staging_buffer(const std::string& key, tvm::runtime::NDArray buffer);
+        void set_pinned_staging(bool pinned);
 
         Status get_output(size_t idx, tvm::runtime::NDArray& out);
 
+        Status get_output(size_t idx, void* buffer, size_t size);
+        Status get_output_view(size_t idx, const DLTensor*& view);
+        // Reductions over the last dimension of a float32 output, computed on the host copy get_output_view makes. On
+        // an accelerator the whole output still crosses the bus, only the results handed back are smaller.
+        Status get_host_output_argmax(size_t idx, std::vector<int64_t>& indices);
+        Status get_host_output_topk(size_t idx, size_t k, std::vector<int64_t>& indices, std::vector<float>& values);
+
         template<typename T>
         Status get_output(size_t idx, std::vector<T>& out) {
-            DLDevice cpu{kDLCPU};
-
-            tvm::runtime::NDArray out_array = static_cast<tvm::runtime::NDArray>(_get_output_fn(idx)).CopyTo(cpu);
-            if (out_array->dtype.bits / 8 != sizeof(T)){
-                LOG(ERROR) << "Types not compatible";
+            if (idx >= _output_info.size()){
+                LOG(ERROR) << "Get output out of range, totally " << _output_info.size() << " but getting index "
+                           << idx;
                 return Status::Fail;
             }
 
-            size_t output_size = 1;
-            for (auto i = 0; i < out_array->ndim; ++i){
-                output_size *= out_array->shape[i];
-            }
-
-            out.clear();
-            for (auto i = 0; i < output_size; ++i){
-                out.push_back(static_cast<T*>(out_array->data)[i]);
+            const auto &info = _output_info[idx];
+            if (info.dtype.bits / 8 != sizeof(T)){
+                LOG(ERROR) << "Types not compatible";
+                return Status::Fail;
             }
 
-            return Status::Succeed;
+            out.resize(info.nbytes / sizeof(T));
+            return get_output(idx, out.data(), info.nbytes);
         }
 
         void execute(void);
         void execute(const std::string &freq, efair::MicroSeconds &time_used, efair::MicroJoule &energy_used);
+        void execute(const FreqIdx &freq_idx, efair::MicroSeconds &time_used, efair::MicroJoule &energy_used);
         void execute_kernel(const size_t &idx);
         void execute_kernel(const size_t &idx, const std::string &freq, efair::MicroSeconds& time_used,
                             efair::MicroJoule &energy_used);
+        void execute_kernel(const size_t &idx, const FreqIdx &freq_idx, efair::MicroSeconds& time_used,
+                            efair::MicroJoule &energy_used);
+        void execute_kernel_range(const KernelIdx &begin, const KernelIdx &end);
+        void execute_kernel_range(const KernelIdx &begin, const KernelIdx &end, const FreqIdx &freq_idx,
+                                  efair::MicroSeconds& time_used, efair::MicroJoule &energy_used);
+        KernelIdx fit_kernel_range(const KernelIdx &begin, const FreqIdx &freq_idx, efair::MicroSeconds budget);
+        // Profiled cost of kernels [begin, end) at freq_idx, without running them
+        Status get_kernel_range_cost(const KernelIdx &begin, const KernelIdx &end, const FreqIdx &freq_idx,
+                                     efair::MicroSeconds &exec_time, efair::MicroJoule &energy);
         Status get_num_kernels(size_t &n);
         Status get_kernel_name(size_t idx, std::string &kernel_name);
 
+        // Release the graph executor and its device memory, keeping the library, metadata and profile
+        void unload();
+        void reload();
+        bool is_loaded() const { return _module.defined(); }
+        // Whether the parameters of the loaded graph executor are the prototype's rather than its own
+        bool shares_params() const { return !_shared_params.empty(); }
+
+        // Waits for the work queued on this instance's stream and collects pending kernel timings
         void sync(void);
 
+        // Times every dispatch made through the accounting overloads, read back after sync
+        void set_timing(bool enabled);
+        void get_timing(efair::MicroSeconds &measured_time, efair::MicroSeconds &profiled_time) const;
+        void reset_timing();
+
+        // Correct the shared kernel cost estimates from timed dispatches with an EWMA, 0 turns correction off
+        void set_online_correction(double ewma_alpha, double deviation_threshold);
+        // Write the profile with the current estimates folded in, in the binary format
+        Status save_profile(const std::string &profile_filename);
+
     private:
+        struct PendingTimer {
+            tvm::runtime::Timer timer;
+            KernelIdx begin;
+            KernelIdx end;
+            FreqIdx freq_idx;
+        };
+
+        void load_module(const std::string &model_filename, tvm::Device dev);
+        void instantiate(tvm::Device dev);
+        bool can_share_params(tvm::Device dev) const;
+        void share_params();
+        Status get_output_rows(size_t idx, const float*& data, size_t& num_rows, size_t& row_size);
+        Status stage_tensor(const std::string& key, const DLTensor* input_tensor, TVMStreamHandle stream);
+        void start_timer();
+        void stop_timer(KernelIdx begin, KernelIdx end, FreqIdx freq_idx, efair::MicroSeconds profiled_time);
+
+        inline void bind_stream() {
+            // The stream is thread local in the runtime and the dispatching thread is shared between instances
+            if (_stream != nullptr)
+                _device_api->SetStream(_device, _stream);
+        }
 
+        tvm::runtime::Module _library;
         tvm::runtime::Module _module;
         tvm::Device _device{};
+
+        // Instance whose parameters this one aliases, and the aliased tensors kept alive while loaded
+        const Executor *_param_source = nullptr;
+        std::vector<tvm::runtime::NDArray> _shared_params;
+        tvm::runtime::DeviceAPI *_device_api = nullptr;
         TVMStreamHandle _stream = nullptr;
 
+        // Timers of dispatches not yet synchronized, on CPU they measure the blocking call itself
+        bool _timing = false;
+        tvm::runtime::Timer _timer;
+        std::vector<PendingTimer> _pending_timers;
+        efair::MicroSeconds _measured_time = 0;
+        efair::MicroSeconds _profiled_time = 0;
+
+        double _ewma_alpha = 0;
+        double _deviation_threshold = 0;
+        std::vector<FreqIdx> _corrected_freqs;
+
         tvm::runtime::PackedFunc _set_input_fn;
+        tvm::runtime::PackedFunc _get_input_fn;
         tvm::runtime::PackedFunc _get_output_fn;
         tvm::runtime::PackedFunc _execute_fn;
         tvm::runtime::PackedFunc _execute_kernel_fn;
-
-        std::unique_ptr<pt::ptree> _model_profile;
+        tvm::runtime::PackedFunc _execute_kernel_range_fn;
+
+        // Module metadata resolved once at construction
+        bool _has_kernel_api = false;
+        std::vector<std::string> _kernel_names;
+        std::unordered_map<std::string, TensorInfo> _input_info;
+        std::vector<TensorInfo> _output_info;
+        std::vector<tvm::runtime::NDArray> _outputs;
+
+        // Host copies of the outputs reused across calls; on CPU these alias the outputs themselves
+        std::vector<tvm::runtime::NDArray> _host_outputs;
+
+        // Reusable host buffers for staging inputs, page-locked when the device supports it
+        std::mutex _staging_lock;
+        tvm::Device _staging_device{kDLCPU, 0};
+        std::unordered_map<std::string, std::vector<tvm::runtime::NDArray>> _staging_pool;
+
+        std::shared_ptr<ModelProfile> _model_profile;
+        std::shared_ptr<KernelCostTable> _cost_table;
+        // This instance's view of the costs, taken again in sync so charging a kernel needs no atomic load
+        std::shared_ptr<const KernelCostTable::Snapshot> _costs;
 
     };
 
@@ -0,0 +1,93 @@
+//
+// Created by Qianlin Liang on 4/10/23.
+//
+
+#include <sys/stat.h>
+
+#include "executor/executor_pool.h"
+
+namespace efair {
+namespace executor {
+
+    ExecutorPool::ExecutorPool(const std::string &model_filename, const std::string &profile_filename,
+                               tvm::Device dev, size_t num_instances) :
+            _device(dev),
+            _instance_footprint(estimate_instance_footprint(model_filename)) {
+        _prototype = std::make_shared<Executor>(model_filename, profile_filename, dev);
+        _instances.push_back(_prototype);
+
+        for (size_t i = 1; i < num_instances; i++){
+            _instances.push_back(std::make_shared<Executor>(*_prototype, dev));
+        }
+
+        _free_instances = _instances;
+    }
+
+    Status ExecutorPool::acquire(std::shared_ptr<Executor> &executor) {
+        std::unique_lock<std::mutex> lock(_lock);
+
+        if (_free_instances.empty()){
+            // Grow rather than stall the dispatcher, this only happens when more tasks are bound than configured
+            LOG(WARNING) << "All " << _instances.size() << " instances of " << _prototype->model_name
+                         << " are in use, creating a new one";
+            _instances.push_back(std::make_shared<Executor>(*_prototype, _device));
+            _free_instances.push_back(_instances.back());
+        }
+
+        executor = std::move(_free_instances.back());
+        _free_instances.pop_back();
+
+        // The prototype comes back first so the instance can take its parameters again
+        if (!_prototype->is_loaded())
+            _prototype->reload();
+        if (!executor->is_loaded())
+            executor->reload();
+        return Status::Succeed;
+    }
+
+    void ExecutorPool::release(const std::shared_ptr<Executor> &executor) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _free_instances.push_back(executor);
+    }
+
+    size_t ExecutorPool::estimate_instance_footprint(const std::string &model_filename) {
+        // Parameters are linked into the library, so its size approximates what each instance uploads
+        struct stat file_stat{};
+        return stat(model_filename.c_str(), &file_stat) == 0 ? file_stat.st_size : 0;
+    }
+
+    Status ExecutorPool::evict() {
+        std::unique_lock<std::mutex> lock(_lock);
+        if (_free_instances.size() != _instances.size())
+            return Status::Fail;
+
+        for (auto &instance : _instances){
+            instance->unload();
+        }
+        return Status::Succeed;
+    }
+
+    bool ExecutorPool::is_idle() {
+        std::unique_lock<std::mutex> lock(_lock);
+        return _free_instances.size() == _instances.size();
+    }
+
+    size_t ExecutorPool::get_footprint() {
+        std::unique_lock<std::mutex> lock(_lock);
+
+        // Instances sharing the prototype's parameters add only activations, which the estimate leaves out
+        size_t num_loaded = 0;
+        for (const auto &instance : _instances){
+            if (instance->is_loaded() && !instance->shares_params())
+                num_loaded++;
+        }
+        return num_loaded * _instance_footprint;
+    }
+
+    size_t ExecutorPool::get_num_instances() {
+        std::unique_lock<std::mutex> lock(_lock);
+        return _instances.size();
+    }
+
+}   // namespace executor
+}   // namespace efair
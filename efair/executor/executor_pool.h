@@ -0,0 +1,58 @@
+//
+// Created by Qianlin Liang on 4/10/23.
+//
+
+#ifndef EFAIR_EXECUTOR_POOL_H
+#define EFAIR_EXECUTOR_POOL_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include "executor/executor.h"
+#include "util/common.h"
+
+namespace efair {
+namespace executor {
+
+    /*
+     * A fixed set of executor instances of one model. All instances share the loaded library and profile, and
+     * the prototype's parameters where the runtime supports it; each has its own graph executor, so a task that
+     * binds an instance keeps its inputs and activations to itself.
+     * An idle pool can be evicted, which unloads every instance; instances are reloaded when they are acquired.
+     */
+    class ExecutorPool {
+    public:
+        ExecutorPool() = delete;
+        ExecutorPool(const std::string &model_filename, const std::string &profile_filename, tvm::Device dev,
+                     size_t num_instances);
+        ~ExecutorPool() = default;
+
+        Status acquire(std::shared_ptr<Executor> &executor);
+        void release(const std::shared_ptr<Executor> &executor);
+
+        // Instance used to query model metadata, it may also be bound to tasks
+        Executor* get_prototype() const { return _prototype.get(); }
+        size_t get_num_instances();
+
+        Status evict();
+        bool is_idle();
+        // Estimated device memory held by the loaded instances
+        size_t get_footprint();
+        size_t get_instance_footprint() const { return _instance_footprint; }
+        static size_t estimate_instance_footprint(const std::string &model_filename);
+
+    private:
+        tvm::Device _device;
+        size_t _instance_footprint;
+        std::mutex _lock;
+        std::shared_ptr<Executor> _prototype;
+        std::vector<std::shared_ptr<Executor>> _instances;
+        std::vector<std::shared_ptr<Executor>> _free_instances;
+    };
+
+}   // namespace executor
+}   // namespace efair
+
+#endif //EFAIR_EXECUTOR_POOL_H
@@ -0,0 +1,146 @@
+//
+// Created by Qianlin Liang on 4/17/23.
+//
+
+#include <stdexcept>
+
+#include "executor/model_cache.h"
+
+namespace efair {
+namespace executor {
+
+    ModelCache& ModelCache::global() {
+        static ModelCache cache;
+        return cache;
+    }
+
+    Status ModelCache::open(const std::string &model_filename, const std::string &profile_filename, tvm::Device dev,
+                            size_t num_instances, std::shared_ptr<ExecutorPool> &pool) {
+        std::string key = model_filename + '\0' + profile_filename + '\0' + std::to_string(dev.device_type) + ":" +
+                          std::to_string(dev.device_id);
+        std::unique_lock<std::mutex> lock(_lock);
+
+        auto found = _entries.find(key);
+        if (found != _entries.end()){
+            auto it = found->second;
+            it->refs++;
+            touch(it);
+            pool = it->pool;
+            return Status::Succeed;
+        }
+
+        make_room(num_instances * ExecutorPool::estimate_instance_footprint(model_filename), nullptr);
+        try {
+            pool = std::make_shared<ExecutorPool>(model_filename, profile_filename, dev, num_instances);
+        } catch (const std::exception &e) {
+            LOG(ERROR) << "Cannot load model " << model_filename << ": " << e.what();
+            return Status::Fail;
+        }
+
+        _lru.push_front({key, pool, 1});
+        _entries[key] = _lru.begin();
+        _pools[pool.get()] = _lru.begin();
+        return Status::Succeed;
+    }
+
+    void ModelCache::close(const std::shared_ptr<ExecutorPool> &pool) {
+        std::unique_lock<std::mutex> lock(_lock);
+
+        auto found = _pools.find(pool.get());
+        if (found == _pools.end())
+            return;
+
+        auto it = found->second;
+        if (--it->refs > 0)
+            return;
+
+        // Without a budget nothing would ever evict an unused pool, so drop it now; otherwise keep it warm
+        if (_memory_budget == 0){
+            _entries.erase(it->key);
+            _pools.erase(found);
+            _lru.erase(it);
+        }
+    }
+
+    Status ModelCache::acquire(const std::shared_ptr<ExecutorPool> &pool, std::shared_ptr<Executor> &executor) {
+        std::unique_lock<std::mutex> lock(_lock);
+
+        auto found = _pools.find(pool.get());
+        if (found == _pools.end())
+            return Status::NotFound;
+
+        // An evicted pool is reloaded one instance at a time, make room for it before touching the device
+        if (pool->get_footprint() == 0)
+            make_room(pool->get_instance_footprint(), pool.get());
+
+        RETURN_STATUS(pool->acquire(executor))
+        touch(found->second);
+        return Status::Succeed;
+    }
+
+    void ModelCache::release(const std::shared_ptr<ExecutorPool> &pool, const std::shared_ptr<Executor> &executor) {
+        pool->release(executor);
+
+        // Pools grow on demand, so trim once the instance is back
+        std::unique_lock<std::mutex> lock(_lock);
+        make_room(0, nullptr);
+    }
+
+    void ModelCache::set_memory_budget(size_t budget) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _memory_budget = budget;
+        make_room(0, nullptr);
+    }
+
+    size_t ModelCache::get_memory_usage() {
+        std::unique_lock<std::mutex> lock(_lock);
+        return memory_usage();
+    }
+
+    size_t ModelCache::get_num_models() {
+        std::unique_lock<std::mutex> lock(_lock);
+        return _lru.size();
+    }
+
+    void ModelCache::make_room(size_t needed, const ExecutorPool *keep) {
+        if (_memory_budget == 0)
+            return;
+
+        auto usage = memory_usage();
+        auto it = _lru.end();
+        while (usage + needed > _memory_budget && it != _lru.begin()){
+            --it;
+            auto footprint = it->pool->get_footprint();
+            if (it->pool.get() == keep || footprint == 0 || it->pool->evict() != Status::Succeed)
+                continue;
+
+            LOG(INFO) << "Evicted " << it->pool->get_prototype()->model_name << ", freeing " << footprint << " bytes";
+            usage -= footprint;
+
+            if (it->refs == 0){
+                _entries.erase(it->key);
+                _pools.erase(it->pool.get());
+                it = _lru.erase(it);
+            }
+        }
+
+        if (usage + needed > _memory_budget){
+            LOG(WARNING) << "Model memory " << usage + needed << " bytes is over the budget of " << _memory_budget
+                         << " bytes, every other model is in use";
+        }
+    }
+
+    size_t ModelCache::memory_usage() const {
+        size_t usage = 0;
+        for (const auto &entry : _lru){
+            usage += entry.pool->get_footprint();
+        }
+        return usage;
+    }
+
+    void ModelCache::touch(std::list<Entry>::iterator it) {
+        _lru.splice(_lru.begin(), _lru, it);
+    }
+
+}   // namespace executor
+}   // namespace efair
@@ -0,0 +1,71 @@
+//
+// Created by Qianlin Liang on 4/17/23.
+//
+
+#ifndef EFAIR_MODEL_CACHE_H
+#define EFAIR_MODEL_CACHE_H
+
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "executor/executor_pool.h"
+#include "util/common.h"
+
+namespace efair {
+namespace executor {
+
+    /*
+     * Process-wide cache of executor pools keyed by model path, profile path and device, so that every entity
+     * loading the same model shares one library, profile and set of instances. Pools are reference counted by the
+     * models opened on them. When the loaded pools exceed the device memory budget, idle pools are evicted in least
+     * recently used order and reloaded when an instance of them is acquired again.
+     */
+    class ModelCache {
+    public:
+        static ModelCache& global();
+
+        ModelCache() = default;
+        ModelCache(const ModelCache &) = delete;
+        ModelCache& operator=(const ModelCache &) = delete;
+        ~ModelCache() = default;
+
+        Status open(const std::string &model_filename, const std::string &profile_filename, tvm::Device dev,
+                    size_t num_instances, std::shared_ptr<ExecutorPool> &pool);
+        void close(const std::shared_ptr<ExecutorPool> &pool);
+
+        Status acquire(const std::shared_ptr<ExecutorPool> &pool, std::shared_ptr<Executor> &executor);
+        void release(const std::shared_ptr<ExecutorPool> &pool, const std::shared_ptr<Executor> &executor);
+
+        // Budget in bytes of estimated device memory, 0 for unlimited
+        void set_memory_budget(size_t budget);
+        size_t get_memory_usage();
+        size_t get_num_models();
+
+    private:
+        struct Entry {
+            std::string key;
+            std::shared_ptr<ExecutorPool> pool;
+            size_t refs;
+        };
+
+        // Evict idle pools other than keep, least recently used first, until needed more bytes fit the budget
+        void make_room(size_t needed, const ExecutorPool *keep);
+        size_t memory_usage() const;
+        void touch(std::list<Entry>::iterator it);
+
+        std::mutex _lock;
+        size_t _memory_budget = 0;
+
+        // Most recently used first
+        std::list<Entry> _lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> _entries;
+        std::unordered_map<const ExecutorPool *, std::list<Entry>::iterator> _pools;
+    };
+
+}   // namespace executor
+}   // namespace efair
+
+#endif //EFAIR_MODEL_CACHE_H
@@ -0,0 +1,454 @@
+//
+// Created by Qianlin Liang on 3/18/23.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <cstring>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "executor/profile.h"
+
+namespace pt = boost::property_tree;
+
+namespace efair {
+namespace executor {
+
+    ModelProfile::~ModelProfile() {
+        reset();
+    }
+
+    void ModelProfile::reset() {
+        if (_mapped != nullptr){
+            munmap(_mapped, _mapped_size);
+            _mapped = nullptr;
+            _mapped_size = 0;
+        }
+
+        _model_name.clear();
+        _frequencies.clear();
+        _freq2idx.clear();
+        _kernel_names.clear();
+        _kernel2row.clear();
+        _values.clear();
+        bind_values(nullptr);
+    }
+
+    void ModelProfile::bind_values(const uint32_t *values) {
+        auto num_freqs = _frequencies.size(), num_kernels = _kernel_names.size();
+
+        _exec_time = values;
+        _gpu_power = values + num_freqs;
+        _energy = values + 2 * num_freqs;
+        _kernel_exec_time = values + 3 * num_freqs;
+        _kernel_gpu_power = _kernel_exec_time + num_kernels * num_freqs;
+        _kernel_energy = _kernel_gpu_power + num_kernels * num_freqs;
+    }
+
+    void ModelProfile::materialize() {
+        if (_mapped == nullptr)
+            return;
+
+        size_t num_values = 3 * _frequencies.size() + 3 * _kernel_names.size() * _frequencies.size();
+        _values.assign(_exec_time, _exec_time + num_values);
+
+        munmap(_mapped, _mapped_size);
+        _mapped = nullptr;
+        _mapped_size = 0;
+        bind_values(_values.data());
+    }
+
+    void ModelProfile::clone(ModelProfile &copy) const {
+        copy.reset();
+        copy._model_name = _model_name;
+        copy._frequencies = _frequencies;
+        copy._freq2idx = _freq2idx;
+        copy._kernel_names = _kernel_names;
+        copy._kernel2row = _kernel2row;
+
+        size_t num_values = 3 * _frequencies.size() + 3 * _kernel_names.size() * _frequencies.size();
+        if (_exec_time != nullptr)
+            copy._values.assign(_exec_time, _exec_time + num_values);
+        copy.bind_values(copy._values.data());
+    }
+
+    void ModelProfile::set_cost(FreqIdx f, MicroSeconds exec_time, MicroJoule energy) {
+        materialize();
+        _values[f] = exec_time;
+        _values[2 * _frequencies.size() + f] = energy;
+    }
+
+    void ModelProfile::set_kernel_cost(size_t row, FreqIdx f, MicroSeconds exec_time, MicroJoule energy) {
+        materialize();
+        size_t num_freqs = _frequencies.size(), num_kernels = _kernel_names.size();
+        size_t kernel_values = 3 * num_freqs;
+
+        _values[kernel_values + row * num_freqs + f] = exec_time;
+        _values[kernel_values + 2 * num_kernels * num_freqs + row * num_freqs + f] = energy;
+    }
+
+    Status ModelProfile::load(const std::string &profile_filename) {
+        char magic[sizeof(ProfileHeader::magic)] = {0};
+        std::ifstream profile_file(profile_filename, std::ios::binary);
+
+        if (!profile_file.is_open()){
+            LOG(ERROR) << "Cannot open profile " << profile_filename;
+            return Status::NotFound;
+        }
+
+        profile_file.read(magic, sizeof(magic));
+        profile_file.close();
+
+        if (std::memcmp(magic, PROFILE_BINARY_MAGIC, sizeof(magic)) == 0)
+            return load_binary(profile_filename);
+        return load_json(profile_filename);
+    }
+
+    Status ModelProfile::load_json(const std::string &profile_filename) {
+        pt::ptree root;
+        reset();
+
+        try {
+            pt::read_json(profile_filename, root);
+
+            // The gpu_power section defines the set of frequencies and their order
+            for (const auto & [freq, power] : root.get_child("gpu_power")){
+                _freq2idx.insert({freq, _frequencies.size()});
+                _frequencies.push_back(freq);
+            }
+        } catch (const pt::ptree_error &e) {
+            LOG(ERROR) << "Cannot parse profile " << profile_filename << ": " << e.what();
+            return Status::Fail;
+        }
+
+        _model_name = root.get<std::string>("model_name", "");
+
+        auto kernel_profile = root.get_child_optional("kernel_profile");
+        if (kernel_profile){
+            for (const auto & [kernel_name, kernel] : *kernel_profile){
+                _kernel2row.insert({kernel_name, _kernel_names.size()});
+                _kernel_names.push_back(kernel_name);
+            }
+        }
+
+        auto num_freqs = _frequencies.size(), num_kernels = _kernel_names.size();
+        _values.assign(3 * num_freqs + 3 * num_kernels * num_freqs, 0);
+
+        uint32_t *exec_time = _values.data();
+        uint32_t *gpu_power = exec_time + num_freqs;
+        uint32_t *energy = gpu_power + num_freqs;
+        uint32_t *kernel_exec_time = energy + num_freqs;
+        uint32_t *kernel_gpu_power = kernel_exec_time + num_kernels * num_freqs;
+        uint32_t *kernel_energy = kernel_gpu_power + num_kernels * num_freqs;
+
+        auto to_value = [&](size_t value, uint32_t &ret) {
+            if (value > std::numeric_limits<uint32_t>::max()){
+                LOG(ERROR) << "Value " << value << " in profile " << profile_filename << " is out of range";
+                return false;
+            }
+            ret = static_cast<uint32_t>(value);
+            return true;
+        };
+
+        for (FreqIdx f = 0; f < num_freqs; f++){
+            const auto &freq = _frequencies[f];
+            if (!to_value(root.get<MicroSeconds>("exec_time." + freq, 0), exec_time[f]) ||
+                !to_value(root.get<MilliWatt>("gpu_power." + freq), gpu_power[f]) ||
+                !to_value(root.get<MicroJoule>("energy." + freq, 0), energy[f]))
+                return Status::Fail;
+        }
+
+        for (size_t row = 0; row < num_kernels; row++){
+            const auto &kernel_name = _kernel_names[row];
+            const auto &kernel = kernel_profile->get_child(pt::ptree::path_type(kernel_name, '\0'));
+
+            for (FreqIdx f = 0; f < num_freqs; f++){
+                const auto &freq = _frequencies[f];
+                auto kernel_time = kernel.get_optional<MicroSeconds>("exec_time." + freq);
+                if (!kernel_time){
+                    LOG(ERROR) << "Kernel " << kernel_name << " has no execution time at frequency " << freq;
+                    return Status::Fail;
+                }
+
+                if (!to_value(*kernel_time, kernel_exec_time[row * num_freqs + f]) ||
+                    !to_value(kernel.get<MilliWatt>("gpu_power." + freq, 0), kernel_gpu_power[row * num_freqs + f]) ||
+                    !to_value(kernel.get<MicroJoule>("energy." + freq, 0), kernel_energy[row * num_freqs + f]))
+                    return Status::Fail;
+            }
+        }
+
+        bind_values(_values.data());
+        return Status::Succeed;
+    }
+
+    Status ModelProfile::load_binary(const std::string &profile_filename) {
+        reset();
+
+        int fd = open(profile_filename.c_str(), O_RDONLY);
+        if (fd < 0){
+            LOG(ERROR) << "Cannot open profile " << profile_filename;
+            return Status::NotFound;
+        }
+
+        struct stat file_stat{};
+        if (fstat(fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(ProfileHeader))){
+            LOG(ERROR) << "Profile " << profile_filename << " is truncated";
+            close(fd);
+            return Status::Fail;
+        }
+
+        // Validate the header and the layout it implies against the file size before anything is mapped
+        size_t file_size = file_stat.st_size;
+        ProfileHeader header{};
+        if (pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+            std::memcmp(header.magic, PROFILE_BINARY_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != PROFILE_BINARY_VERSION){
+            LOG(ERROR) << "Profile " << profile_filename << " has an unsupported format";
+            close(fd);
+            return Status::Fail;
+        }
+
+        size_t num_freqs = header.num_freqs, num_kernels = header.num_kernels;
+        size_t freq_offset = sizeof(ProfileHeader);
+        size_t value_offset, name_offset, string_offset, end_offset;
+        size_t num_cells, num_values;
+        bool overflow = __builtin_mul_overflow(num_kernels, num_freqs, &num_cells) ||
+                        __builtin_add_overflow(num_cells, num_freqs, &num_values) ||
+                        __builtin_mul_overflow(num_values, 3 * sizeof(uint32_t), &num_values) ||
+                        __builtin_add_overflow(freq_offset, num_freqs * sizeof(uint64_t), &value_offset) ||
+                        __builtin_add_overflow(value_offset, num_values, &name_offset) ||
+                        __builtin_add_overflow(name_offset, (num_kernels + 1) * sizeof(uint32_t), &string_offset) ||
+                        __builtin_add_overflow(string_offset, header.string_table_size, &end_offset);
+
+        if (overflow || end_offset > file_size || header.model_name_length > header.string_table_size){
+            LOG(ERROR) << "Profile " << profile_filename << " is truncated";
+            close(fd);
+            return Status::Fail;
+        }
+
+        void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (mapped == MAP_FAILED){
+            LOG(ERROR) << "Cannot map profile " << profile_filename;
+            return Status::Fail;
+        }
+
+        _mapped = mapped;
+        _mapped_size = file_size;
+
+        const auto *base = static_cast<const char *>(mapped);
+
+        const auto *frequencies = reinterpret_cast<const uint64_t *>(base + freq_offset);
+        const auto *name_offsets = reinterpret_cast<const uint32_t *>(base + name_offset);
+        const char *strings = base + string_offset;
+
+        _model_name.assign(strings, header.model_name_length);
+
+        for (FreqIdx f = 0; f < num_freqs; f++){
+            _freq2idx.insert({std::to_string(frequencies[f]), f});
+            _frequencies.push_back(std::to_string(frequencies[f]));
+        }
+
+        for (size_t row = 0; row < num_kernels; row++){
+            if (name_offsets[row] > name_offsets[row + 1] || name_offsets[row + 1] > header.string_table_size){
+                LOG(ERROR) << "Profile " << profile_filename << " has a corrupted kernel name table";
+                reset();
+                return Status::Fail;
+            }
+
+            _kernel_names.emplace_back(strings + name_offsets[row], name_offsets[row + 1] - name_offsets[row]);
+            _kernel2row.insert({_kernel_names.back(), row});
+        }
+
+        bind_values(reinterpret_cast<const uint32_t *>(base + value_offset));
+        return Status::Succeed;
+    }
+
+    Status ModelProfile::save_binary(const std::string &profile_filename) const {
+        size_t num_freqs = _frequencies.size(), num_kernels = _kernel_names.size();
+
+        ProfileHeader header{};
+        std::memcpy(header.magic, PROFILE_BINARY_MAGIC, sizeof(header.magic));
+        header.version = PROFILE_BINARY_VERSION;
+        header.num_freqs = num_freqs;
+        header.num_kernels = num_kernels;
+        header.model_name_length = _model_name.size();
+
+        std::string strings = _model_name;
+        std::vector<uint32_t> name_offsets;
+        for (const auto &kernel_name : _kernel_names){
+            name_offsets.push_back(strings.size());
+            strings += kernel_name;
+        }
+        name_offsets.push_back(strings.size());
+        header.string_table_size = strings.size();
+
+        std::vector<uint64_t> frequencies;
+        for (const auto &freq : _frequencies){
+            frequencies.push_back(std::stoull(freq));
+        }
+
+        std::ofstream out_file(profile_filename, std::ios::binary | std::ios::trunc);
+        if (!out_file.is_open()){
+            LOG(ERROR) << "Cannot write to file " << profile_filename;
+            return Status::Fail;
+        }
+
+        out_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out_file.write(reinterpret_cast<const char *>(frequencies.data()), num_freqs * sizeof(uint64_t));
+        // bind_values lays all value arrays out back to back starting at _exec_time
+        out_file.write(reinterpret_cast<const char *>(_exec_time),
+                       (3 * num_freqs + 3 * num_kernels * num_freqs) * sizeof(uint32_t));
+        out_file.write(reinterpret_cast<const char *>(name_offsets.data()), name_offsets.size() * sizeof(uint32_t));
+        out_file.write(strings.data(), strings.size());
+        out_file.close();
+
+        return out_file.fail() ? Status::Fail : Status::Succeed;
+    }
+
+    Status ModelProfile::get_freq_index(const std::string &freq, FreqIdx &freq_idx) const {
+        auto it = _freq2idx.find(freq);
+        if (it == _freq2idx.end())
+            return Status::NotFound;
+
+        freq_idx = it->second;
+        return Status::Succeed;
+    }
+
+    Status ModelProfile::get_kernel_row(const std::string &kernel_name, size_t &row) const {
+        auto it = _kernel2row.find(kernel_name);
+        if (it == _kernel2row.end())
+            return Status::NotFound;
+
+        row = it->second;
+        return Status::Succeed;
+    }
+
+    Status KernelCostTable::build(const ModelProfile &profile, const std::vector<std::string> &kernel_names) {
+        _num_kernels = kernel_names.size();
+        _num_freqs = profile.get_num_frequencies();
+
+        auto snapshot = std::make_shared<Snapshot>();
+        snapshot->num_kernels = _num_kernels;
+        snapshot->num_freqs = _num_freqs;
+        snapshot->costs.assign(_num_kernels * _num_freqs, KernelCost{0, 0, 0});
+
+        size_t row;
+        for (KernelIdx k = 0; k < _num_kernels; k++){
+            if (profile.get_kernel_row(kernel_names[k], row) != Status::Succeed){
+                LOG(ERROR) << "Kernel " << kernel_names[k] << " is not found in the profile of "
+                           << profile.get_model_name();
+                return Status::NotFound;
+            }
+
+            for (FreqIdx f = 0; f < _num_freqs; f++){
+                // Energy is charged at the model's power draw at this frequency, not the per-kernel sample
+                auto &cost = snapshot->costs[k * _num_freqs + f];
+                cost.exec_time = profile.get_kernel_exec_time(row, f);
+                cost.power = profile.get_gpu_power(f);
+                cost.energy = cost.power * cost.exec_time * 1e-3;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(_update_lock);
+        _estimates.resize(snapshot->costs.size());
+        for (size_t i = 0; i < snapshot->costs.size(); i++){
+            _estimates[i] = snapshot->costs[i].exec_time;
+        }
+        _num_deviations = 0;
+
+        snapshot->prefix_time.assign(_num_freqs * (_num_kernels + 1), 0);
+        snapshot->prefix_energy.assign(_num_freqs * (_num_kernels + 1), 0);
+        for (FreqIdx f = 0; f < _num_freqs; f++){
+            rebuild(*snapshot, f);
+        }
+
+        std::atomic_store(&_snapshot, std::shared_ptr<const Snapshot>(std::move(snapshot)));
+        return Status::Succeed;
+    }
+
+    void KernelCostTable::rebuild(Snapshot &snapshot, FreqIdx f) const {
+        auto *prefix_time = &snapshot.prefix_time[f * (_num_kernels + 1)];
+        auto *prefix_energy = &snapshot.prefix_energy[f * (_num_kernels + 1)];
+
+        for (KernelIdx k = 0; k < _num_kernels; k++){
+            auto &cost = snapshot.costs[k * _num_freqs + f];
+            cost.exec_time = static_cast<MicroSeconds>(_estimates[k * _num_freqs + f] + 0.5);
+            cost.energy = cost.power * cost.exec_time * 1e-3;
+
+            prefix_time[k + 1] = prefix_time[k] + cost.exec_time;
+            prefix_energy[k + 1] = prefix_energy[k] + cost.energy;
+        }
+    }
+
+    void KernelCostTable::refresh(const std::vector<FreqIdx> &freqs) {
+        if (freqs.empty())
+            return;
+
+        // Readers may still hold the current snapshot, so corrections go into a copy that replaces it
+        std::unique_lock<std::mutex> lock(_update_lock);
+        auto snapshot = std::make_shared<Snapshot>(*get_snapshot());
+        for (auto f : freqs){
+            rebuild(*snapshot, f);
+        }
+        std::atomic_store(&_snapshot, std::shared_ptr<const Snapshot>(std::move(snapshot)));
+    }
+
+    bool KernelCostTable::observe(KernelIdx begin, KernelIdx end, FreqIdx f, MicroSeconds measured_time,
+                                  double ewma_alpha, double deviation_threshold) {
+        std::unique_lock<std::mutex> lock(_update_lock);
+
+        double estimated_time = 0;
+        for (KernelIdx k = begin; k < end; k++){
+            estimated_time += _estimates[k * _num_freqs + f];
+        }
+
+        // Nothing to scale, e.g. kernels profiled as taking no time at all
+        if (estimated_time <= 0)
+            return true;
+
+        double ratio = measured_time / estimated_time;
+        for (KernelIdx k = begin; k < end; k++){
+            auto &estimate = _estimates[k * _num_freqs + f];
+            estimate = (1 - ewma_alpha) * estimate + ewma_alpha * estimate * ratio;
+        }
+
+        if (std::abs(ratio - 1) > deviation_threshold){
+            _num_deviations++;
+            return false;
+        }
+        return true;
+    }
+
+    void KernelCostTable::Snapshot::get_range(KernelIdx begin, KernelIdx end, FreqIdx f, MicroSeconds &exec_time,
+                                              MicroJoule &energy) const {
+        const auto *range_time = &prefix_time[f * (num_kernels + 1)];
+        const auto *range_energy = &prefix_energy[f * (num_kernels + 1)];
+
+        exec_time = range_time[end] - range_time[begin];
+        energy = range_energy[end] - range_energy[begin];
+    }
+
+    KernelIdx KernelCostTable::Snapshot::fit_range(KernelIdx begin, FreqIdx f, MicroSeconds budget) const {
+        if (begin >= num_kernels)
+            return num_kernels;
+
+        const auto *range_time = &prefix_time[f * (num_kernels + 1)];
+        const auto *last = range_time + num_kernels + 1;
+
+        // First prefix that exceeds the budget marks one past the last kernel that fits
+        auto it = std::upper_bound(range_time + begin + 1, last, range_time[begin] + budget);
+        auto end = static_cast<KernelIdx>(it - range_time) - 1;
+        return end > begin ? end : begin + 1;
+    }
+
+}   // namespace executor
+}   // namespace efair
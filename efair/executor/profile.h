@@ -0,0 +1,204 @@
+//
+// Created by Qianlin Liang on 3/18/23.
+//
+
+#ifndef EFAIR_PROFILE_H
+#define EFAIR_PROFILE_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "util/common.h"
+
+#define PROFILE_BINARY_MAGIC "EFPROF\0\0"
+#define PROFILE_BINARY_VERSION 1
+
+namespace efair {
+namespace executor {
+
+    /*
+     * Header of the binary profile format. The file is laid out as
+     *
+     *   ProfileHeader
+     *   uint64_t frequencies[num_freqs]                    (Hz)
+     *   uint32_t exec_time[num_freqs], gpu_power[num_freqs], energy[num_freqs]
+     *   uint32_t kernel_exec_time[num_kernels][num_freqs]
+     *   uint32_t kernel_gpu_power[num_kernels][num_freqs]
+     *   uint32_t kernel_energy[num_kernels][num_freqs]
+     *   uint32_t kernel_name_offsets[num_kernels + 1]      (into the string table)
+     *   char     strings[string_table_size]                (model name, then kernel names)
+     *
+     * in host byte order, and is mapped read-only so that the value arrays are used in place.
+     */
+    struct ProfileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_freqs;
+        uint32_t num_kernels;
+        uint32_t model_name_length;
+        uint64_t string_table_size;
+    };
+
+    /*
+     * In-memory form of a model profile. Frequencies are interned to small integer indices in the order they appear
+     * in the profile, and every per-frequency quantity is stored in flat arrays indexed by that FreqIdx. The arrays
+     * either live in memory parsed from JSON or point into a memory-mapped binary profile.
+     */
+    class ModelProfile {
+    public:
+        ModelProfile() = default;
+        ModelProfile(const ModelProfile &) = delete;
+        ModelProfile& operator=(const ModelProfile &) = delete;
+        ~ModelProfile();
+
+        // Detects the format from the file content
+        Status load(const std::string &profile_filename);
+        Status load_json(const std::string &profile_filename);
+        Status load_binary(const std::string &profile_filename);
+        Status save_binary(const std::string &profile_filename) const;
+
+        Status get_freq_index(const std::string &freq, FreqIdx &freq_idx) const;
+        Status get_kernel_row(const std::string &kernel_name, size_t &row) const;
+
+        const std::string& get_model_name() const { return _model_name; }
+        const std::vector<std::string>& get_frequencies() const { return _frequencies; }
+        const std::vector<std::string>& get_kernel_names() const { return _kernel_names; }
+        size_t get_num_frequencies() const { return _frequencies.size(); }
+        size_t get_num_kernels() const { return _kernel_names.size(); }
+
+        MicroSeconds get_exec_time(FreqIdx f) const { return _exec_time[f]; }
+        MilliWatt get_gpu_power(FreqIdx f) const { return _gpu_power[f]; }
+        MicroJoule get_energy(FreqIdx f) const { return _energy[f]; }
+
+        MicroSeconds get_kernel_exec_time(size_t row, FreqIdx f) const { return _kernel_exec_time[row * get_num_frequencies() + f]; }
+        MilliWatt get_kernel_gpu_power(size_t row, FreqIdx f) const { return _kernel_gpu_power[row * get_num_frequencies() + f]; }
+        MicroJoule get_kernel_energy(size_t row, FreqIdx f) const { return _kernel_energy[row * get_num_frequencies() + f]; }
+
+        // Copy of this profile whose values are owned, so it can be changed without affecting readers of this one
+        void clone(ModelProfile &copy) const;
+
+        // Overwrite values in memory, a mapped profile is copied out of the mapping first. Not safe while other
+        // threads read this profile, change a clone instead.
+        void set_cost(FreqIdx f, MicroSeconds exec_time, MicroJoule energy);
+        void set_kernel_cost(size_t row, FreqIdx f, MicroSeconds exec_time, MicroJoule energy);
+
+    private:
+        void reset();
+        void materialize();
+        void bind_values(const uint32_t *values);
+
+        std::string _model_name;
+
+        std::vector<std::string> _frequencies;
+        std::unordered_map<std::string, FreqIdx> _freq2idx;
+
+        std::vector<std::string> _kernel_names;
+        std::unordered_map<std::string, size_t> _kernel2row;
+
+        // Backing storage of the value arrays, owned when parsed from JSON or mapped from a binary profile
+        std::vector<uint32_t> _values;
+        void *_mapped = nullptr;
+        size_t _mapped_size = 0;
+
+        // [freq_idx]
+        const uint32_t *_exec_time = nullptr;
+        const uint32_t *_gpu_power = nullptr;
+        const uint32_t *_energy = nullptr;
+
+        // [kernel_row][freq_idx]
+        const uint32_t *_kernel_exec_time = nullptr;
+        const uint32_t *_kernel_gpu_power = nullptr;
+        const uint32_t *_kernel_energy = nullptr;
+    };
+
+    /*
+     * Dense [kernel_idx][freq_idx] table of the costs charged when a kernel runs, laid out in the executor's kernel
+     * order so that accounting on the scheduling path is a single indexed load. The table is shared by every
+     * instance of a model: readers take the current snapshot of the costs and never block, corrections are folded
+     * in under a lock and published as a new snapshot.
+     */
+    class KernelCostTable {
+    public:
+        struct KernelCost {
+            MicroSeconds exec_time;
+            MilliWatt power;
+            MicroJoule energy;
+        };
+
+        /*
+         * Costs as of one refresh. A snapshot never changes once published, so a reader that holds one indexes it
+         * with plain loads and only goes back to the table when it wants newer corrections.
+         */
+        struct Snapshot {
+            size_t num_kernels = 0;
+            size_t num_freqs = 0;
+            std::vector<KernelCost> costs;
+
+            // [freq_idx][kernel_idx + 1] running totals, so ranges are charged in constant time
+            std::vector<MicroSeconds> prefix_time;
+            std::vector<MicroJoule> prefix_energy;
+
+            inline KernelCost get(KernelIdx k, FreqIdx f) const { return costs[k * num_freqs + f]; }
+            // Cost of kernels [begin, end) at frequency f
+            void get_range(KernelIdx begin, KernelIdx end, FreqIdx f, MicroSeconds &exec_time,
+                           MicroJoule &energy) const;
+            // Largest end such that [begin, end) fits in budget, always at least one kernel
+            KernelIdx fit_range(KernelIdx begin, FreqIdx f, MicroSeconds budget) const;
+        };
+
+        KernelCostTable() = default;
+        KernelCostTable(const KernelCostTable &) = delete;
+        KernelCostTable& operator=(const KernelCostTable &) = delete;
+        ~KernelCostTable() = default;
+
+        Status build(const ModelProfile &profile, const std::vector<std::string> &kernel_names);
+
+        // The latest snapshot. Loading it is an atomic shared_ptr load, so hot paths keep theirs across calls
+        inline std::shared_ptr<const Snapshot> get_snapshot() const { return std::atomic_load(&_snapshot); }
+
+        // Lookups against the latest snapshot, for callers off the scheduling path
+        inline KernelCost get(KernelIdx k, FreqIdx f) const { return get_snapshot()->get(k, f); }
+        void get_range(KernelIdx begin, KernelIdx end, FreqIdx f, MicroSeconds &exec_time, MicroJoule &energy) const {
+            get_snapshot()->get_range(begin, end, f, exec_time, energy);
+        }
+        KernelIdx fit_range(KernelIdx begin, FreqIdx f, MicroSeconds budget) const {
+            return get_snapshot()->fit_range(begin, f, budget);
+        }
+
+        /*
+         * Fold a measured duration of kernels [begin, end) at frequency f into the estimates with an EWMA of weight
+         * ewma_alpha. A range is corrected by the ratio of measured to estimated time, spread over its kernels in
+         * proportion to their estimates. Returns false if the measurement deviates from the estimate by more than
+         * deviation_threshold, relative. Estimates take effect after refresh.
+         */
+        bool observe(KernelIdx begin, KernelIdx end, FreqIdx f, MicroSeconds measured_time, double ewma_alpha,
+                     double deviation_threshold);
+        void refresh(FreqIdx f) { refresh(std::vector<FreqIdx>{f}); }
+        void refresh(const std::vector<FreqIdx> &freqs);
+        size_t get_num_deviations() const { return _num_deviations; }
+
+        size_t get_num_kernels() const { return _num_kernels; }
+        size_t get_num_frequencies() const { return _num_freqs; }
+
+    private:
+        void rebuild(Snapshot &snapshot, FreqIdx f) const;
+
+        size_t _num_kernels = 0;
+        size_t _num_freqs = 0;
+        std::shared_ptr<const Snapshot> _snapshot;
+
+        // Unrounded online estimates, [kernel_idx][freq_idx] like the costs, and writers of new snapshots
+        std::mutex _update_lock;
+        std::vector<double> _estimates;
+        std::atomic<size_t> _num_deviations{0};
+    };
+
+}   // namespace executor
+}   // namespace efair
+
+#endif //EFAIR_PROFILE_H
@@ -0,0 +1,48 @@
+//
+// Created by Qianlin Liang on 4/12/23.
+//
+
+#include <iostream>
+#include <string>
+
+#include "executor/profile.h"
+
+/*
+ * Converts a JSON model profile into the memory-mapped binary profile format.
+ */
+int main(int argc, char** argv){
+    if (argc < 3) {
+        std::cerr << "Expected arguments [json_profile_path] [binary_profile_path]" << std::endl;
+        exit(1);
+    }
+
+    efair::executor::ModelProfile profile, converted;
+    if (profile.load_json(argv[1]) != efair::Status::Succeed) {
+        LOG(ERROR) << "Cannot load profile " << argv[1];
+        exit(1);
+    }
+
+    ASSERT_STATUS(profile.save_binary(argv[2]));
+
+    // Read the result back and make sure nothing was lost
+    ASSERT_STATUS(converted.load_binary(argv[2]));
+    ASSERT(converted.get_model_name() == profile.get_model_name());
+    ASSERT(converted.get_frequencies() == profile.get_frequencies());
+    ASSERT(converted.get_kernel_names() == profile.get_kernel_names());
+
+    for (efair::FreqIdx f = 0; f < profile.get_num_frequencies(); f++){
+        ASSERT(converted.get_exec_time(f) == profile.get_exec_time(f));
+        ASSERT(converted.get_gpu_power(f) == profile.get_gpu_power(f));
+        ASSERT(converted.get_energy(f) == profile.get_energy(f));
+
+        for (size_t row = 0; row < profile.get_num_kernels(); row++){
+            ASSERT(converted.get_kernel_exec_time(row, f) == profile.get_kernel_exec_time(row, f));
+            ASSERT(converted.get_kernel_gpu_power(row, f) == profile.get_kernel_gpu_power(row, f));
+            ASSERT(converted.get_kernel_energy(row, f) == profile.get_kernel_energy(row, f));
+        }
+    }
+
+    std::cout << "Converted profile of " << profile.get_model_name() << " with " << profile.get_num_kernels()
+              << " kernels and " << profile.get_num_frequencies() << " frequencies to " << argv[2] << std::endl;
+    return 0;
+}
@@ -10,7 +10,8 @@ namespace efair {
 namespace rpc {
 
     EFairClient::EFairClient(std::string address, std::string model_path, std::string model_profile_path,
-                             std::string freq, int priority) :
+                             std::string freq, int priority, MicroSeconds relative_deadline,
+                             MicroSeconds latency_target) :
                              freq(freq),
                              priority(priority){
 
@@ -21,6 +22,7 @@ namespace rpc {
         CreateEntityRequest create_entity_request;
         CreateEntityResponse create_entity_response;
         create_entity_request.set_priority(priority);
+        create_entity_request.set_relative_deadline_us(relative_deadline);
         grpc::Status s = stub->CreateEntity(&create_entity_context, create_entity_request, &create_entity_response);
 
         if (s.ok() && create_entity_response.success()) {
@@ -37,6 +39,7 @@ namespace rpc {
         load_model_request.set_model_path(model_path);
         load_model_request.set_model_profile_path(model_profile_path);
         load_model_request.set_frequency(freq);
+        load_model_request.set_latency_target_us(latency_target);
 
         s = stub->LoadModel(&load_model_context, load_model_request, &load_model_response);
 
@@ -15,8 +15,10 @@ namespace efair {
 namespace rpc {
     class EFairClient {
     public:
+        // A non-zero relative_deadline registers a real-time entity instead of one with the priority, a non-zero
+        // latency_target lets the server choose the frequency instead of freq
         EFairClient(std::string address, std::string model_path, std::string model_profile_path, std::string freq,
-                    int priority);
+                    int priority, MicroSeconds relative_deadline = 0, MicroSeconds latency_target = 0);
         ~EFairClient() = default;
 
         bool infer();
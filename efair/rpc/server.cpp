@@ -32,8 +32,22 @@ namespace rpc {
     grpc::Status EFairServer::LoadModel(grpc::ServerContext *context, const efair::rpc::LoadModelRequest *request,
                                         efair::rpc::LoadModelResponse *response) {
         ModelID mid;
-        Status s = scheduler->load_model(request->model_path(), request->model_profile_path(),
-                                         request->eid(),request->frequency(), mid);
+        Status s;
+        if (request->latency_target_us() > 0)
+            s = scheduler->load_model_with_latency_target(request->model_path(), request->model_profile_path(),
+                                                          request->eid(), request->latency_target_us(), mid);
+        else
+            s = scheduler->load_model(request->model_path(), request->model_profile_path(),
+                                      request->eid(),request->frequency(), mid);
+
+        for (const auto &variant : request->batch_variants()){
+            if (s != Status::Succeed)
+                break;
+            s = scheduler->add_batch_variant(mid, variant.batch_size(), variant.model_path(),
+                                             variant.model_profile_path());
+            if (s != Status::Succeed)
+                scheduler->unload_model(mid);
+        }
 
         if (s == Status::Succeed)
             response->set_success(true);
@@ -44,10 +58,26 @@ namespace rpc {
         return grpc::Status::OK;
     }
 
+    grpc::Status EFairServer::UnloadModel(grpc::ServerContext *context, const efair::rpc::UnloadModelRequest *request,
+                                          efair::rpc::UnloadModelResponse *response) {
+        Status s = scheduler->unload_model(request->mid());
+
+        if (s == Status::Succeed)
+            response->set_success(true);
+        else
+            response->set_success(false);
+
+        return grpc::Status::OK;
+    }
+
     grpc::Status EFairServer::CreateEntity(grpc::ServerContext *context, const efair::rpc::CreateEntityRequest *request,
                                            efair::rpc::CreateEntityResponse *response) {
         EntityID eid;
-        Status s = scheduler->create_entity(request->priority(), eid);
+        Status s;
+        if (request->relative_deadline_us() > 0)
+            s = scheduler->create_realtime_entity(request->relative_deadline_us(), request->period_us(), eid);
+        else
+            s = scheduler->create_entity(request->priority(), eid);
 
         if (s == Status::Succeed)
             response->set_success(true);
@@ -74,7 +104,13 @@ namespace rpc {
     grpc::Status EFairServer::Infer(grpc::ServerContext *context, const efair::rpc::InferRequest *request,
                                     efair::rpc::InferResponse *response) {
         TaskID tid;
-        Status s = scheduler->new_task(request->mid(), tid);
+        std::vector<efair::scheduler::EFairScheduler::TaskInput> inputs;
+
+        // The request outlives the task, so input bytes go from the message to the device without a staging copy
+        if (!request->input_data().empty())
+            inputs.push_back({request->input_key(), request->input_data().data(), request->input_data().size()});
+
+        Status s = scheduler->new_task(request->mid(), inputs, tid);
 
         if (s == Status::Succeed)
             response->set_success(true);
@@ -82,7 +118,8 @@ namespace rpc {
             response->set_success(false);
 
         response->set_tid(tid);
-        scheduler->wait_task(tid);
+        if (s == Status::Succeed)
+            scheduler->wait_task(tid);
 
         return grpc::Status::OK;
     }
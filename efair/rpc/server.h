@@ -25,6 +25,9 @@ namespace rpc {
         grpc::Status LoadModel(grpc::ServerContext *context, const efair::rpc::LoadModelRequest *request,
                                efair::rpc::LoadModelResponse *response) override;
 
+        grpc::Status UnloadModel(grpc::ServerContext *context, const efair::rpc::UnloadModelRequest *request,
+                                 efair::rpc::UnloadModelResponse *response) override;
+
         grpc::Status CreateEntity(grpc::ServerContext *context, const efair::rpc::CreateEntityRequest *request,
                                   efair::rpc::CreateEntityResponse *response) override;
 
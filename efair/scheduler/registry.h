@@ -0,0 +1,138 @@
+//
+// Created by Qianlin Liang on 4/27/23.
+//
+
+#ifndef EFAIR_REGISTRY_H
+#define EFAIR_REGISTRY_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+namespace efair {
+namespace scheduler {
+
+    /*
+     * Registry of objects by the increasing ID stored in their Key member. Lookups take no lock and do no hashing: the
+     * ID masked by the table size indexes an array of atomic pointers, and the object found there is checked to carry
+     * the ID. Registration and removal are serialized by a lock. When a new ID lands on a slot still held by a live
+     * older ID the table doubles, so IDs can grow without bound while the table only grows with the span of live IDs.
+     * Replaced tables are kept until the registry is destroyed, which together is less than the current table.
+     *
+     * The registry does not own the objects. A removed object can still be returned by a lookup that raced with the
+     * removal, so it must stay valid for as long as lookups of its ID may be in flight. Objects that are recycled
+     * under a new ID while still reachable that way must keep the ID in a std::atomic<size_t>, which lookups load.
+     */
+    template<typename T, auto Key>
+    class ConcurrentRegistry {
+    public:
+        explicit ConcurrentRegistry(size_t initial_size = 64) {
+            size_t size = 1;
+            while (size < initial_size){
+                size <<= 1;
+            }
+            _tables.emplace_back(new Table(size));
+            _table.store(_tables.back().get());
+        }
+
+        ConcurrentRegistry(const ConcurrentRegistry &) = delete;
+        ConcurrentRegistry& operator=(const ConcurrentRegistry &) = delete;
+        ~ConcurrentRegistry() = default;
+
+        T* find(size_t id) const {
+            const Table *table = _table.load(std::memory_order_acquire);
+            T *object = table->slots[id & table->mask].load(std::memory_order_acquire);
+            return object != nullptr && key_of(object) == id ? object : nullptr;
+        }
+
+        void insert(T *object) {
+            std::unique_lock<std::mutex> guard(_lock);
+            size_t id = key_of(object);
+
+            Table *table = _table.load(std::memory_order_relaxed);
+            while (table->slots[id & table->mask].load(std::memory_order_relaxed) != nullptr){
+                table = grow(table);
+            }
+            table->slots[id & table->mask].store(object, std::memory_order_release);
+            _size++;
+        }
+
+        bool remove(size_t id) {
+            std::unique_lock<std::mutex> guard(_lock);
+
+            Table *table = _table.load(std::memory_order_relaxed);
+            auto &slot = table->slots[id & table->mask];
+            T *object = slot.load(std::memory_order_relaxed);
+            if (object == nullptr || key_of(object) != id)
+                return false;
+
+            slot.store(nullptr, std::memory_order_release);
+            _size--;
+            return true;
+        }
+
+        // Visits registered objects in table order, registration and removal wait until it returns
+        template<typename F>
+        void for_each(F &&f) {
+            std::unique_lock<std::mutex> guard(_lock);
+
+            Table *table = _table.load(std::memory_order_relaxed);
+            for (size_t i = 0; i <= table->mask; i++){
+                T *object = table->slots[i].load(std::memory_order_relaxed);
+                if (object != nullptr)
+                    f(object);
+            }
+        }
+
+        size_t size() {
+            std::unique_lock<std::mutex> guard(_lock);
+            return _size;
+        }
+
+        size_t get_table_size() {
+            std::unique_lock<std::mutex> guard(_lock);
+            return _table.load(std::memory_order_relaxed)->mask + 1;
+        }
+
+    private:
+        static size_t load_key(size_t key) { return key; }
+        static size_t load_key(const std::atomic<size_t> &key) { return key.load(std::memory_order_acquire); }
+        static size_t key_of(const T *object) { return load_key(object->*Key); }
+
+        struct Table {
+            explicit Table(size_t size) : mask(size - 1), slots(new std::atomic<T *>[size]) {
+                for (size_t i = 0; i < size; i++){
+                    slots[i].store(nullptr, std::memory_order_relaxed);
+                }
+            }
+
+            size_t mask;
+            std::unique_ptr<std::atomic<T *>[]> slots;
+        };
+
+        // IDs on different slots of a table stay on different slots of a table twice as large
+        Table* grow(Table *table) {
+            auto *larger = new Table((table->mask + 1) * 2);
+            for (size_t i = 0; i <= table->mask; i++){
+                T *object = table->slots[i].load(std::memory_order_relaxed);
+                if (object != nullptr)
+                    larger->slots[key_of(object) & larger->mask].store(object, std::memory_order_relaxed);
+            }
+
+            _tables.emplace_back(larger);
+            _table.store(larger, std::memory_order_release);
+            return larger;
+        }
+
+        std::mutex _lock;
+        std::atomic<Table *> _table{nullptr};
+        std::vector<std::unique_ptr<Table>> _tables;
+        size_t _size = 0;
+    };
+
+}   // namespace scheduler
+}   // namespace efair
+
+#endif //EFAIR_REGISTRY_H
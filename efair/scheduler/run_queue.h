@@ -0,0 +1,211 @@
+//
+// Created by Qianlin Liang on 4/20/23.
+//
+
+#ifndef EFAIR_RUN_QUEUE_H
+#define EFAIR_RUN_QUEUE_H
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+#include "util/common.h"
+
+namespace efair {
+namespace scheduler {
+
+    /*
+     * Run queue of schedule entities ordered by vruntime, earliest inserted first among equal vruntimes. It is a
+     * pairing heap whose nodes live in one contiguous arena and link to each other by index, so a Handle stays valid
+     * until the node is removed no matter how the heap is reshaped or the arena grows. Insert and decrease-key are
+     * O(1), remove and increase-key are amortized O(log n). The total weight of queued entities and the minimum
+     * vruntime are kept as the queue changes rather than recomputed.
+     */
+    template<typename T>
+    class RunQueue {
+    public:
+        typedef uint32_t Handle;
+        static constexpr Handle InvalidHandle = std::numeric_limits<Handle>::max();
+
+        RunQueue() = default;
+        ~RunQueue() = default;
+
+        Handle insert(const T &value, VRuntime vruntime, size_t weight) {
+            Handle h;
+            if (_free != InvalidHandle){
+                h = _free;
+                _free = _nodes[h].sibling;
+            } else {
+                h = static_cast<Handle>(_nodes.size());
+                _nodes.emplace_back();
+            }
+
+            auto &node = _nodes[h];
+            node.value = value;
+            node.vruntime = vruntime;
+            node.seq = _seq++;
+            node.weight = weight;
+            node.child = node.sibling = node.prev = InvalidHandle;
+            node.queued = true;
+
+            _root = meld(_root, h);
+            _total_weight += weight;
+            _size++;
+            return h;
+        }
+
+        void remove(Handle h) {
+            take(h);
+
+            auto &node = _nodes[h];
+            _total_weight -= node.weight;
+            _size--;
+
+            node.value = T();
+            node.queued = false;
+            node.sibling = _free;
+            _free = h;
+        }
+
+        void update(Handle h, VRuntime vruntime) {
+            auto &node = _nodes[h];
+
+            // A smaller key keeps the heap order below the node, so its subtree moves up as a whole
+            if (vruntime < node.vruntime && h != _root){
+                detach(h);
+                node.vruntime = vruntime;
+                _root = meld(_root, h);
+                return;
+            }
+
+            take(h);
+            node.vruntime = vruntime;
+            node.seq = _seq++;
+            _root = meld(_root, h);
+        }
+
+        void update_weight(Handle h, size_t weight) {
+            _total_weight = _total_weight - _nodes[h].weight + weight;
+            _nodes[h].weight = weight;
+        }
+
+        // Entity with the minimum vruntime, InvalidHandle when empty
+        Handle top() const { return _root; }
+
+        const T& get(Handle h) const { return _nodes[h].value; }
+        VRuntime get_vruntime(Handle h) const { return _nodes[h].vruntime; }
+        size_t get_weight(Handle h) const { return _nodes[h].weight; }
+
+        bool empty() const { return _size == 0; }
+        size_t size() const { return _size; }
+        size_t get_total_weight() const { return _total_weight; }
+        VRuntime get_min_vruntime() const { return _root == InvalidHandle ? 0 : _nodes[_root].vruntime; }
+
+        void reserve(size_t n) { _nodes.reserve(n); }
+
+        // Visits queued entities in arena order, not vruntime order
+        template<typename F>
+        void for_each(F &&f) const {
+            for (const auto &node : _nodes){
+                if (node.queued)
+                    f(node.value, node.vruntime, node.weight);
+            }
+        }
+
+    private:
+        struct Node {
+            T value{};
+            VRuntime vruntime = 0;
+            uint64_t seq = 0;
+            size_t weight = 0;
+            Handle child = InvalidHandle;
+            Handle sibling = InvalidHandle;     // next free node while not queued
+            Handle prev = InvalidHandle;        // parent if this is the first child, otherwise the left sibling
+            bool queued = false;
+        };
+
+        bool less(Handle a, Handle b) const {
+            const auto &x = _nodes[a], &y = _nodes[b];
+            return x.vruntime < y.vruntime || (x.vruntime == y.vruntime && x.seq < y.seq);
+        }
+
+        // Both a and b are roots without siblings
+        Handle meld(Handle a, Handle b) {
+            if (a == InvalidHandle) return b;
+            if (b == InvalidHandle) return a;
+            if (less(b, a)) std::swap(a, b);
+
+            auto &parent = _nodes[a], &child = _nodes[b];
+            child.prev = a;
+            child.sibling = parent.child;
+            if (parent.child != InvalidHandle)
+                _nodes[parent.child].prev = b;
+            parent.child = b;
+            return a;
+        }
+
+        // Unlink a non-root node together with its subtree
+        void detach(Handle h) {
+            auto &node = _nodes[h];
+            if (_nodes[node.prev].child == h)
+                _nodes[node.prev].child = node.sibling;
+            else
+                _nodes[node.prev].sibling = node.sibling;
+
+            if (node.sibling != InvalidHandle)
+                _nodes[node.sibling].prev = node.prev;
+            node.prev = node.sibling = InvalidHandle;
+        }
+
+        // Unlink a node alone, its children are merged back into the heap
+        void take(Handle h) {
+            if (h == _root){
+                _root = InvalidHandle;
+            } else {
+                detach(h);
+            }
+
+            auto &node = _nodes[h];
+            Handle children = merge_pairs(node.child);
+            node.child = InvalidHandle;
+            _root = meld(_root, children);
+        }
+
+        // Standard two-pass merge of a sibling list: pair up left to right, then fold right to left
+        Handle merge_pairs(Handle first) {
+            if (first == InvalidHandle)
+                return InvalidHandle;
+
+            _scratch.clear();
+            while (first != InvalidHandle){
+                Handle a = first, b = _nodes[a].sibling;
+                first = b != InvalidHandle ? _nodes[b].sibling : InvalidHandle;
+
+                _nodes[a].prev = _nodes[a].sibling = InvalidHandle;
+                if (b != InvalidHandle)
+                    _nodes[b].prev = _nodes[b].sibling = InvalidHandle;
+                _scratch.push_back(meld(a, b));
+            }
+
+            Handle result = _scratch.back();
+            for (size_t i = _scratch.size() - 1; i-- > 0; ){
+                result = meld(_scratch[i], result);
+            }
+            return result;
+        }
+
+        std::vector<Node> _nodes;
+        std::vector<Handle> _scratch;
+        Handle _root = InvalidHandle;
+        Handle _free = InvalidHandle;
+        uint64_t _seq = 0;
+        size_t _size = 0;
+        size_t _total_weight = 0;
+    };
+
+}   // namespace scheduler
+}   // namespace efair
+
+#endif //EFAIR_RUN_QUEUE_H
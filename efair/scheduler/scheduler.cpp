@@ -2,7 +2,13 @@
 // Created by Qianlin Liang on 3/21/23.
 //
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <tvm/runtime/registry.h>
 #include "scheduler/scheduler.h"
 
 namespace efair {
@@ -79,185 +85,1569 @@ namespace scheduler {
     }
 
     EFairScheduler::EFairScheduler(MicroSeconds total_quantum_size, double alpha, tvm::Device device) :
+            EFairScheduler(total_quantum_size, alpha, std::vector<tvm::Device>{device}) {}
+
+    EFairScheduler::EFairScheduler(MicroSeconds total_quantum_size, double alpha,
+                                   const std::vector<tvm::Device> &devices) :
             total_quantum_size(total_quantum_size),
             alpha(alpha),
-            dev(device),
             model_cnt(0),
             task_cnt(0),
             entity_cnt(0),
-            _shutdown(true) {}
+            _shutdown(true),
+            task_history(65536) {
+        if (devices.empty())
+            throw std::runtime_error("The scheduler needs at least one device");
+
+        // Frequency scaling applies to GPUs, CPU-only schedulers run without it and need no root
+        bool first_gpu = true;
+        for (size_t i = 0; i < devices.size(); i++){
+            dispatchers.emplace_back(new Dispatcher(i, devices[i], total_quantum_size, alpha));
+            if (devices[i].device_type != kDLCPU && first_gpu){
+                dispatchers.back()->fc.reset(new util::FrequencyController);
+                dispatchers.back()->fc->get_frequency(dispatchers.back()->cur_freq);
+                first_gpu = false;
+            }
+        }
+    }
+
+    Status
+    EFairScheduler::load_model(const std::string model_path, const std::string profile_path, const EntityID eid,
+                               const std::string freq, ModelID &mid) {
+        return load_model(model_path, profile_path, eid, freq, 0, mid);
+    }
+
+    Status EFairScheduler::load_model_with_latency_target(const std::string model_path, const std::string profile_path,
+                                                          const EntityID eid, const MicroSeconds latency_target,
+                                                          ModelID &mid) {
+        if (latency_target == 0)
+            return Status::Fail;
+        return load_model(model_path, profile_path, eid, "", latency_target, mid);
+    }
+
+    Status
+    EFairScheduler::load_model(const std::string model_path, const std::string profile_path, const EntityID eid,
+                               const std::string freq, const MicroSeconds latency_target, ModelID &mid) {
+        auto *entity = entities.find(eid);
+        if (entity == nullptr)
+            return Status::NotFound;
+        if (latency_target > 0 && entity->relative_deadline > 0){
+            LOG(ERROR) << "Real-time entity <" << eid << "> is admitted at a fixed frequency, not a latency target";
+            return Status::Fail;
+        }
+
+        // Entities loading the same model share its library, profile and instances. The model is loaded on the
+        // device of the entity now, other devices open it when they first run it.
+        auto &home = *dispatchers[entity->dispatcher.load()];
+        std::shared_ptr<executor::ExecutorPool> executors;
+        RETURN_STATUS(executor::ModelCache::global().open(model_path, profile_path, home.dev, executors_per_model,
+                                                          executors))
+        // Until the model is registered, every failure below hands the pool back
+        ScopeGuard close_on_failure([&](){ executor::ModelCache::global().close(executors); });
+
+        ModelID issued_mid;
+        {
+            std::unique_lock<std::mutex> lock(model_pool_lock);
+            issued_mid = model_cnt;
+            model_cnt++;
+        }
+
+        std::shared_ptr<Model> m(new Model);
+        m->mid = issued_mid;
+        m->eid = eid;
+        m->freq = freq;
+        m->latency_target = latency_target;
+        m->model_path = model_path;
+        m->profile_path = profile_path;
+        m->num_live_tasks = 0;
+        m->retiring = false;
+        m->device_executors.resize(dispatchers.size());
+        m->device_executors[home.index] = executors;
+        m->executors = executors;
+
+        auto *prototype = m->executors->get_prototype();
+        RETURN_STATUS(prototype->get_num_kernels(m->num_kernels))
+        RETURN_STATUS(prototype->get_frequencies(m->frequencies))
+        if (latency_target > 0){
+            // Start at the fastest frequency, the dispatcher plans the model before it runs its first task
+            MicroSeconds fastest_time = std::numeric_limits<MicroSeconds>::max();
+            for (FreqIdx f = 0; f < m->frequencies.size(); f++){
+                MicroSeconds exec_time;
+                MicroJoule energy;
+                RETURN_STATUS(prototype->get_kernel_range_cost(0, m->num_kernels, f, exec_time, energy))
+                if (exec_time < fastest_time){
+                    fastest_time = exec_time;
+                    m->freq = m->frequencies[f];
+                }
+            }
+        }
+        RETURN_STATUS(prototype->get_freq_index(m->freq, m->freq_idx))
+        RETURN_STATUS(prototype->get_gpu_power(m->freq, m->power))
+        RETURN_STATUS(prototype->get_max_gpu_power(m->max_power))
+
+        m->rt_bandwidth = 0;
+        if (entity->relative_deadline > 0 && admit_realtime_model(home, entity, m.get()) != Status::Succeed)
+            return Status::Fail;
+
+        entity->max_power = entity->max_power < m->max_power ? m->max_power : entity->max_power;
+
+        LOG(INFO) << "Loaded model ID <" << issued_mid << "> " << prototype->model_name << " with max power "
+                  << m->max_power << " mWatt";
+        LOG(INFO) << "Model " << issued_mid << " execution frequency " << m->freq << " power " << m->power;
+
+        models.insert(m.get());
+        {
+            std::unique_lock<std::mutex> lock(model_pool_lock);
+            model_pool.insert({issued_mid, std::move(m)});
+        }
+        close_on_failure.dismiss();
+        mid = issued_mid;
+
+        RETURN_STATUS(get_entity_avg_power(eid, entity->avg_power));
+        LOG(INFO) << "Entity " << eid << " current average power " << entity->avg_power;
+        update_entity_slice(entity);
+
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_model_frequency(const ModelID mid, std::string &freq) {
+        // Planned frequencies change under the model pool lock
+        std::unique_lock<std::mutex> lock(model_pool_lock);
+        auto it = model_pool.find(mid);
+        if (it == model_pool.end())
+            return Status::NotFound;
+
+        freq = it->second->freq;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::add_batch_variant(const ModelID mid, size_t batch_size, const std::string model_path,
+                                             const std::string profile_path) {
+        auto *model = models.find(mid);
+        if (model == nullptr)
+            return Status::NotFound;
+        if (batch_size < 2)
+            return Status::Fail;
+
+        // Like the model itself, the variant is loaded on the device of the entity now and opened elsewhere later
+        auto *entity = entities.find(model->eid);
+        auto &home = *dispatchers[entity->dispatcher.load()];
+        std::unique_ptr<ModelVariant> v(new ModelVariant);
+        v->batch_size = batch_size;
+        v->model_path = model_path;
+        v->profile_path = profile_path;
+        RETURN_STATUS(executor::ModelCache::global().open(model_path, profile_path, home.dev, executors_per_model,
+                                                          v->executors))
+        v->device_executors.resize(dispatchers.size());
+        v->device_executors[home.index] = v->executors;
+
+        // Every output is batch_size slices of the model's, and every frequency the model may run at is profiled.
+        // Inputs are checked the same way when a batch is bound.
+        auto check = [&]() -> Status {
+            auto *prototype = model->executors->get_prototype();
+            auto *batched = v->executors->get_prototype();
+            size_t num_outputs, num_batched_outputs;
+            RETURN_STATUS(prototype->get_num_outputs(num_outputs))
+            RETURN_STATUS(batched->get_num_outputs(num_batched_outputs))
+            if (num_outputs != num_batched_outputs)
+                return Status::Fail;
+            for (size_t i = 0; i < num_outputs; i++){
+                size_t size, batched_size;
+                RETURN_STATUS(prototype->get_output_size(i, size))
+                RETURN_STATUS(batched->get_output_size(i, batched_size))
+                if (batched_size != size * batch_size)
+                    return Status::Fail;
+            }
+
+            RETURN_STATUS(batched->get_num_kernels(v->num_kernels))
+            v->freq_map.resize(model->frequencies.size());
+            for (FreqIdx f = 0; f < model->frequencies.size(); f++){
+                RETURN_STATUS(batched->get_freq_index(model->frequencies[f], v->freq_map[f]))
+            }
+            return Status::Succeed;
+        };
+        if (check() != Status::Succeed){
+            LOG(ERROR) << "Model " << model_path << " is not a batch " << batch_size << " variant of model <" << mid
+                       << ">";
+            executor::ModelCache::global().close(v->executors);
+            return Status::Fail;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(model->executors_lock);
+            auto it = model->variants.begin();
+            while (it != model->variants.end() && (*it)->batch_size < batch_size)
+                it++;
+            if (it != model->variants.end() && (*it)->batch_size == batch_size){
+                LOG(ERROR) << "Model <" << mid << "> already has a batch " << batch_size << " variant";
+                lock.unlock();
+                executor::ModelCache::global().close(v->executors);
+                return Status::Fail;
+            }
+            model->variants.insert(it, std::move(v));
+        }
+
+        LOG(INFO) << "Model <" << mid << "> runs batches of " << batch_size << " on " << model_path;
+        return Status::Succeed;
+    }
+
+    void EFairScheduler::plan_frequencies(Dispatcher &d) {
+        std::unique_lock<std::mutex> pool_lock(model_pool_lock);
+        std::unique_lock<std::mutex> tree_lock(d.run_queue_lock);
+
+        // Shares are planned as if every fair entity with a model on this device were runnable, so that targets
+        // still hold when they all are and plans do not change each time an entity goes idle
+        SliceSolver solver(total_quantum_size, alpha);
+        std::unordered_map<EntityID, std::pair<MilliWatt, size_t>> entity_power;   // power sum and number of models
+        for (const auto &[mid, m] : model_pool){
+            auto *entity = entities.find(m->eid);
+            if (entity == nullptr || entity->dispatcher.load() != d.index || entity->relative_deadline > 0)
+                continue;
+
+            entity_power[m->eid].first += m->power;
+            entity_power[m->eid].second++;
+            if (!solver.contains(m->eid))
+                solver.add(m->eid, entity->weight, entity->avg_power);
+        }
+
+        for (const auto &[mid, m] : model_pool){
+            auto *entity = entities.find(m->eid);
+            if (m->latency_target == 0 || entity == nullptr || !solver.contains(m->eid))
+                continue;
+
+            auto *prototype = m->executors->get_prototype();
+            auto &[power_sum, num_models] = entity_power[m->eid];
+            FreqIdx best = m->freq_idx;
+            MilliWatt best_power = m->power;
+            MicroJoule best_energy = std::numeric_limits<MicroJoule>::max();
+            MicroSeconds best_latency = std::numeric_limits<MicroSeconds>::max();
+            bool feasible = false;
+
+            for (FreqIdx f = 0; f < m->frequencies.size(); f++){
+                MicroSeconds exec_time;
+                MicroJoule energy;
+                MilliWatt power;
+                if (prototype->get_kernel_range_cost(0, m->num_kernels, f, exec_time, energy) != Status::Succeed ||
+                    prototype->get_gpu_power(m->frequencies[f], power) != Status::Succeed)
+                    continue;
+
+                // A task runs for the slice of the entity in every round of the total quantum and waits in between
+                MilliWatt avg_power = (power_sum - m->power + power) / num_models;
+                solver.update(m->eid, entity->weight, avg_power);
+                MicroSeconds slice = std::max<MicroSeconds>(solver.get_slice(entity->weight, avg_power), 1);
+                MicroSeconds latency = exec_time;
+                if (slice < total_quantum_size)
+                    latency += (exec_time + slice - 1) / slice * (total_quantum_size - slice);
+
+                // The least energy among frequencies meeting the target, or the least latency if none does
+                bool meets = latency <= m->latency_target;
+                if ((meets && (!feasible || energy < best_energy)) ||
+                    (!meets && !feasible && latency < best_latency)){
+                    best = f;
+                    best_power = power;
+                    best_energy = energy;
+                    best_latency = latency;
+                    feasible = meets;
+                }
+            }
+
+            if (best != m->freq_idx){
+                power_sum = power_sum - m->power + best_power;
+                m->freq_idx = best;
+                m->freq = m->frequencies[best];
+                m->power = best_power;
+
+                entity->avg_power = power_sum / num_models;
+                if (entity->rq_handle != RunQueue<ScheduleEntity *>::InvalidHandle)
+                    d.slice_solver.update(entity->eid, entity->weight, entity->avg_power);
+
+                LOG(INFO) << "Model <" << mid << "> runs at frequency " << m->freq << " for latency target "
+                          << m->latency_target << " µs, planned latency " << best_latency << " µs, energy "
+                          << best_energy << " µJ" << (feasible ? "" : ", the target cannot be met");
+            }
+            solver.update(m->eid, entity->weight, power_sum / num_models);
+        }
+    }
+
+    Status EFairScheduler::unload_model(const ModelID mid) {
+        std::shared_ptr<Model> model;
+        {
+            std::unique_lock<std::mutex> lock(model_pool_lock);
+            auto it = model_pool.find(mid);
+            if (it == model_pool.end())
+                return Status::NotFound;
+            model = it->second;
+        }
+
+        {
+            // new_task counts tasks under the same lock, so none can slip in between the check and the removal
+            std::unique_lock<std::mutex> lock(model->task_lock);
+            if (model->retiring)
+                return Status::NotFound;
+            if (model->num_live_tasks > 0){
+                LOG(ERROR) << "Cannot unload model <" << mid << ">, " << model->num_live_tasks
+                           << " of its tasks are not finished";
+                return Status::Fail;
+            }
+            model->retiring = true;
+        }
+
+        models.remove(mid);
+        {
+            std::unique_lock<std::mutex> lock(model_pool_lock);
+            model_pool.erase(mid);
+            retired_models.push_back(model);
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(model->input_lock);
+            for (auto &[key, staged] : model->pending_inputs){
+                model->executors->get_prototype()->release_staging_buffer(key, std::move(staged));
+            }
+            model->pending_inputs.clear();
+        }
+        {
+            std::unique_lock<std::mutex> lock(model->executors_lock);
+            for (auto &pool : model->device_executors){
+                if (pool != nullptr)
+                    executor::ModelCache::global().close(pool);
+                pool.reset();
+            }
+            for (auto &variant : model->variants){
+                for (auto &pool : variant->device_executors){
+                    if (pool != nullptr)
+                        executor::ModelCache::global().close(pool);
+                    pool.reset();
+                }
+                if (variant->executors.use_count() == 1)
+                    variant->executors->evict();
+            }
+        }
+
+        // The retired model keeps its pool object alive, but once nothing else uses the pool its instances go
+        if (model->executors.use_count() == 1)
+            model->executors->evict();
+
+        auto *entity = entities.find(model->eid);
+        if (model->rt_bandwidth > 0){
+            auto &home = *dispatchers[entity->dispatcher.load()];
+            std::unique_lock<std::mutex> tree_lock(home.run_queue_lock);
+            home.rt_bandwidth -= model->rt_bandwidth;
+        }
+
+        MilliWatt max_power = 0;
+        {
+            std::unique_lock<std::mutex> lock(model_pool_lock);
+            for (const auto &[other_mid, other] : model_pool){
+                if (other->eid == model->eid && other->max_power > max_power)
+                    max_power = other->max_power;
+            }
+        }
+        entity->max_power = max_power;
+        RETURN_STATUS(get_entity_avg_power(model->eid, entity->avg_power))
+        update_entity_slice(entity);
+
+        LOG(INFO) << "Unloaded model ID <" << mid << ">";
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_model_memory_budget(size_t budget) {
+        // The cache is shared by every scheduler in the process
+        executor::ModelCache::global().set_memory_budget(budget);
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::create_entity(Priority priority, EntityID &eid) {
+        if (priority_map.find(priority) == priority_map.end()) {
+            LOG(ERROR) << "Cannot find priority level " << priority;
+            return Status::NotFound;
+        }
+
+        size_t weight = priority_map.at(priority);
+        EntityID issued_eid;
+        size_t home = 0;
+        {
+            std::unique_lock<std::mutex> lock(sched_entities_lock);
+            issued_eid = entity_cnt;
+            entity_cnt++;
+
+            // The device owning the fewest entities, the first of them on a tie
+            for (size_t i = 1; i < dispatchers.size(); i++){
+                if (dispatchers[i]->num_entities.load() < dispatchers[home]->num_entities.load())
+                    home = i;
+            }
+            dispatchers[home]->num_entities.fetch_add(1);
+        }
+
+        std::shared_ptr<ScheduleEntity> entity(new ScheduleEntity);
+        entity->eid = issued_eid;
+        entity->weight = weight;
+        entity->max_power = 0;
+        entity->avg_power = 0;
+        entity->runtime = 0;
+        entity->sched_slice = 0;
+        entity->carry = 0;
+        entity->energy_tokens = 0;
+        entity->rq_handle = RunQueue<ScheduleEntity *>::InvalidHandle;
+        entity->freq_handle = RunQueue<ScheduleEntity *>::InvalidHandle;
+        entity->dispatcher = home;
+        entity->relative_deadline = 0;
+        entity->period = 0;
+
+        LOG(INFO) << "Created schedule entity ID <" << issued_eid << "> with priority " << priority << " on device "
+                  << entity->dispatcher.load();
+
+        entities.insert(entity.get());
+        {
+            std::unique_lock<std::mutex> lock(sched_entities_lock);
+            sched_entities.insert({issued_eid, std::move(entity)});
+        }
+        eid = issued_eid;
+
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::create_realtime_entity(MicroSeconds relative_deadline, MicroSeconds period, EntityID &eid) {
+        if (relative_deadline == 0)
+            return Status::Fail;
+
+        // Without models the entity has no tasks yet, so the class can be set once it is registered
+        RETURN_STATUS(create_entity(0, eid))
+        auto *entity = entities.find(eid);
+        entity->relative_deadline = relative_deadline;
+        entity->period = period > 0 ? period : relative_deadline;
+
+        LOG(INFO) << "Entity <" << eid << "> is real-time with deadline " << entity->relative_deadline
+                  << " µs and period " << entity->period << " µs";
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::admit_realtime_model(Dispatcher &d, ScheduleEntity *entity, Model *model) {
+        // A task runs every kernel of the model, so its profiled cost bounds its service time
+        MicroSeconds exec_time;
+        MicroJoule energy;
+        auto *prototype = model->executors->get_prototype();
+        if (prototype->get_kernel_range_cost(0, model->num_kernels, model->freq_idx, exec_time, energy) !=
+            Status::Succeed){
+            LOG(ERROR) << "Cannot admit model for real-time entity <" << entity->eid << ">, no kernel profile";
+            return Status::Fail;
+        }
+
+        if (exec_time > entity->relative_deadline){
+            LOG(ERROR) << "Cannot admit model for real-time entity <" << entity->eid << ">, profiled time "
+                       << exec_time << " µs exceeds the deadline of " << entity->relative_deadline << " µs";
+            return Status::Fail;
+        }
+
+        double bandwidth = static_cast<double>(exec_time) / entity->period;
+        std::unique_lock<std::mutex> tree_lock(d.run_queue_lock);
+        if (d.rt_bandwidth + bandwidth > max_rt_bandwidth){
+            LOG(ERROR) << "Cannot admit model for real-time entity <" << entity->eid << ">, it needs " << bandwidth
+                       << " of device " << d.index << " which has " << max_rt_bandwidth - d.rt_bandwidth << " left";
+            return Status::Fail;
+        }
+
+        d.rt_bandwidth += bandwidth;
+        model->rt_bandwidth = bandwidth;
+        LOG(INFO) << "Admitted real-time entity <" << entity->eid << "> model with profiled time " << exec_time
+                  << " µs, device " << d.index << " real-time bandwidth " << d.rt_bandwidth;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_realtime_bandwidth(double max_bandwidth) {
+        // The fair classes always keep part of each window, and models already admitted stay admitted
+        if (max_bandwidth <= 0 || max_bandwidth >= 1)
+            return Status::Fail;
+
+        max_rt_bandwidth = max_bandwidth;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_deadline_stats(const EntityID eid, size_t &num_tasks, size_t &num_misses) {
+        auto *entity = entities.find(eid);
+        if (entity == nullptr || entity->relative_deadline == 0)
+            return Status::NotFound;
+
+        num_tasks = entity->num_deadline_tasks.load();
+        num_misses = entity->num_deadline_misses.load();
+        return Status::Succeed;
+    }
+
+    Status
+    EFairScheduler::set_input(const ModelID &mid, const std::string &key, const void *input_data, size_t size) {
+        auto *model = models.find(mid);
+        if (model == nullptr)
+            return Status::NotFound;
+        auto *prototype = model->executors->get_prototype();
+
+        size_t input_size;
+        RETURN_STATUS(prototype->get_input_size(key, input_size))
+        if (size > input_size){
+            LOG(ERROR) << "Copy input bytes fail, expect input size " << input_size << " but get " << size;
+            return Status::Fail;
+        }
+
+        // Copy into a staging buffer so that the caller's buffer can be reused before the task runs. Like
+        // Executor::set_input, a shorter input is zero padded.
+        tvm::runtime::NDArray staged;
+        RETURN_STATUS(prototype->acquire_staging_buffer(key, staged))
+        auto *staged_data = static_cast<uint8_t *>(staged->data);
+        std::memcpy(staged_data, input_data, size);
+        std::memset(staged_data + size, 0, input_size - size);
+
+        std::unique_lock<std::mutex> lock(model->input_lock);
+        for (auto &[pending_key, pending] : model->pending_inputs){
+            if (pending_key == key){
+                prototype->release_staging_buffer(key, std::move(pending));
+                pending = std::move(staged);
+                return Status::Succeed;
+            }
+        }
+
+        model->pending_inputs.emplace_back(key, std::move(staged));
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_executor_instances(size_t num_instances) {
+        if (num_instances == 0)
+            return Status::Fail;
+
+        // Applies to models loaded afterwards
+        executors_per_model = num_instances;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_dispatch_mode(DispatchMode mode) {
+        if (!_shutdown.load())
+            return Status::Fail;
+
+        dispatch_mode = mode;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_vruntime_mode(VRuntimeMode mode) {
+        if (!_shutdown.load())
+            return Status::Fail;
+
+        vruntime_mode = mode;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_vruntime_stats(const EntityID eid, VRuntime &time_share, VRuntime &energy_share,
+                                              VRuntime &charged) {
+        auto *entity = entities.find(eid);
+        if (entity == nullptr || entity->relative_deadline > 0)
+            return Status::NotFound;
+
+        // Charges are added under the run queue lock of the owner, which only changes under that lock too
+        auto *d = dispatchers[entity->dispatcher.load()].get();
+        std::unique_lock<std::mutex> tree_lock(d->run_queue_lock);
+        while (entity->dispatcher.load() != d->index){
+            tree_lock.unlock();
+            d = dispatchers[entity->dispatcher.load()].get();
+            tree_lock = std::unique_lock<std::mutex>(d->run_queue_lock);
+        }
+        time_share = entity->time_share;
+        energy_share = entity->energy_share;
+        charged = entity->charged;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_quantum_fit(QuantumFit mode) {
+        if (!_shutdown.load())
+            return Status::Fail;
+
+        quantum_fit = mode;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_overrun_stats(size_t device, size_t &num_overruns, MicroSeconds &overrun_time,
+                                             MicroSeconds &max_overrun, size_t &num_yields) {
+        if (device >= dispatchers.size())
+            return Status::NotFound;
+
+        auto &d = *dispatchers[device];
+        num_overruns = d.num_overruns.load();
+        overrun_time = d.overrun_time.load();
+        max_overrun = d.max_overrun.load();
+        num_yields = d.num_yields.load();
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_batch_delay(MicroSeconds max_delay) {
+        if (!_shutdown.load())
+            return Status::Fail;
+
+        max_batch_delay = max_delay;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_batching_stats(size_t device, size_t &num_batches, size_t &num_batched_tasks) {
+        if (device >= dispatchers.size())
+            return Status::NotFound;
+
+        num_batches = dispatchers[device]->num_batches.load();
+        num_batched_tasks = dispatchers[device]->num_batched_tasks.load();
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_input_staging(bool enabled) {
+        if (!_shutdown.load())
+            return Status::Fail;
+
+        // The stagers start and stop with the dispatchers
+        input_staging = enabled;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_staging_stats(size_t device, size_t &num_staged, size_t &num_waits) {
+        if (device >= dispatchers.size())
+            return Status::NotFound;
+
+        num_staged = dispatchers[device]->num_staged.load();
+        num_waits = dispatchers[device]->num_stage_waits.load();
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_kernel_timing(bool enabled) {
+        if (!_shutdown.load())
+            return Status::Fail;
+
+        kernel_timing = enabled;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_profile_correction(double ewma_alpha, double deviation_threshold) {
+        if (ewma_alpha < 0 || ewma_alpha > 1 || deviation_threshold <= 0 || !_shutdown.load())
+            return Status::Fail;
+
+        this->ewma_alpha = ewma_alpha;
+        this->deviation_threshold = deviation_threshold;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::save_profiles(const std::string &dir) {
+        std::unique_lock<std::mutex> lock(model_pool_lock);
+
+        for (const auto &[mid, model] : model_pool){
+            auto prototype = model->executors->get_prototype();
+            std::string path = dir + "/" + prototype->model_name + "_" + std::to_string(mid) + "_profile.bin";
+            RETURN_STATUS(prototype->save_profile(path))
+        }
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_task_history(size_t capacity, const std::string &spill_path) {
+        RETURN_STATUS(task_history.set_capacity(capacity))
+        return task_history.set_spill_file(spill_path);
+    }
+
+    Status EFairScheduler::set_unwaited_task_limit(size_t max_unwaited) {
+        {
+            std::unique_lock<std::mutex> lock(unwaited_lock);
+            max_unwaited_tasks = max_unwaited;
+        }
+        reclaim_unwaited();
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_task_stats(size_t &num_live, size_t &num_reclaimed) {
+        num_live = tasks.size();
+        num_reclaimed = this->num_reclaimed.load();
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_cpu_threads(size_t threads_per_device) {
+        if (!_shutdown.load())
+            return Status::Fail;
+
+        // Applied by each CPU dispatcher to its own thread pool when it starts
+        cpu_threads = threads_per_device;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_tracing(bool enabled) {
+        tracer.set_enabled(enabled);
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::export_trace(const std::string &path) {
+        return tracer.export_chrome_trace(path);
+    }
+
+    Status EFairScheduler::set_hot_path_logging(size_t every_n) {
+        if (!_shutdown.load())
+            return Status::Fail;
+
+        // Per task and per quantum lines are logged for one in every_n of them, 0 turns them off
+        log_every_n = every_n;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_dispatcher_stats(size_t device, size_t &num_quanta, size_t &num_steals) {
+        if (device >= dispatchers.size())
+            return Status::NotFound;
+
+        num_quanta = dispatchers[device]->num_quanta.load();
+        num_steals = dispatchers[device]->num_steals.load();
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_frequency_grouping(VRuntime max_lag) {
+        if (max_lag < 0 || !_shutdown.load())
+            return Status::Fail;
+
+        // 0 runs entities strictly by vruntime, otherwise an entity at the current frequency may go first while it
+        // is at most max_lag behind the earliest one, each quantum being about 1
+        max_freq_lag = max_lag;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::set_devfreq_dir(size_t device, const std::string &devfreq_dir) {
+        if (device >= dispatchers.size() || dispatchers[device]->dev.device_type == kDLCPU || !_shutdown.load())
+            return Status::Fail;
+
+        auto &d = *dispatchers[device];
+        if (d.fc != nullptr)
+            d.fc->shutdown();
+        d.fc.reset(new util::FrequencyController(devfreq_dir));
+        d.fc->get_frequency(d.cur_freq);
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_frequency_stats(size_t &num_switches, MicroSeconds &switch_time,
+                                               double &switches_per_second, size_t &num_switches_avoided) {
+        num_switches = 0;
+        switch_time = 0;
+        num_switches_avoided = 0;
+        for (const auto &d : dispatchers){
+            if (d->fc != nullptr){
+                size_t applied_switches;
+                MicroSeconds device_switch_time;
+                RETURN_STATUS(d->fc->get_switch_stats(applied_switches, device_switch_time))
+                switch_time += device_switch_time;
+            }
+            num_switches += d->num_switches.load();
+            num_switches_avoided += d->num_switches_avoided.load();
+        }
+
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start_t).count();
+        switches_per_second = elapsed > 0 ? num_switches / elapsed : 0;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::get_executor_pool(Model *model, ModelVariant *variant, const Dispatcher &d,
+                                             std::shared_ptr<executor::ExecutorPool> &pool) {
+        std::unique_lock<std::mutex> lock(model->executors_lock);
+        auto &device_pool = variant != nullptr ? variant->device_executors[d.index] : model->device_executors[d.index];
+        if (device_pool == nullptr){
+            const auto &model_path = variant != nullptr ? variant->model_path : model->model_path;
+            const auto &profile_path = variant != nullptr ? variant->profile_path : model->profile_path;
+            RETURN_STATUS(executor::ModelCache::global().open(model_path, profile_path, d.dev, executors_per_model,
+                                                              device_pool))
+            LOG(INFO) << "Opened model <" << model->mid << "> " << model_path << " on device " << d.index;
+        }
+
+        pool = device_pool;
+        return Status::Succeed;
+    }
+
+    Status EFairScheduler::bind_executor(Task *task, Model *model, Dispatcher &d) {
+        if (!claim_task(d, task)){
+            // The stager bound the task, its inputs are on the device once it is staged
+            if (task->input_stage.load() != InputStage::Staged){
+                d.num_stage_waits.fetch_add(1);
+                std::unique_lock<std::mutex> lock(task->lock);
+                task->cv.wait(lock, [task] { return task->input_stage.load() == InputStage::Staged; });
+            }
+            if (task->executor != nullptr){
+                task->executor->set_timing(kernel_timing);
+                task->executor->set_online_correction(ewma_alpha, deviation_threshold);
+                task->executor->reset_timing();
+            }
+            return task->stage_status;
+        }
+
+        RETURN_STATUS(get_executor_pool(model, task->variant, d, task->executor_pool))
+        RETURN_STATUS(executor::ModelCache::global().acquire(task->executor_pool, task->executor))
+        task->executor->set_timing(kernel_timing);
+        task->executor->set_online_correction(ewma_alpha, deviation_threshold);
+        task->executor->reset_timing();
+        if (task->variant != nullptr)
+            return bind_batch_inputs(task, model);
+
+        Status s = Status::Succeed;
+        for (const auto &input : task->borrowed_inputs){
+            if (task->executor->set_input_zero_copy(input.key, input.data, input.size) != Status::Succeed)
+                s = Status::Fail;
+        }
+
+        for (auto &[key, staged] : task->staged_inputs){
+            if (task->executor->set_input(key, staged) != Status::Succeed)
+                s = Status::Fail;
+            model->executors->get_prototype()->release_staging_buffer(key, std::move(staged));
+        }
+
+        task->borrowed_inputs.clear();
+        task->staged_inputs.clear();
+        return s;
+    }
+
+    bool EFairScheduler::claim_task(Dispatcher &d, Task *task) {
+        if (!task->stage_requested){
+            auto stage = task->input_stage.load();
+            if (stage == InputStage::Staging || stage == InputStage::Staged)
+                return false;
+            task->input_stage.store(InputStage::Bound);
+            return true;
+        }
+
+        // A task still in the stage queue is unstaged and taken back from it, the stager only takes it under the lock
+        task->stage_requested = false;
+        task->entity->num_staged.fetch_sub(1);
+        std::unique_lock<std::mutex> lock(d.stage_lock);
+        if (task->input_stage.load() != InputStage::Unstaged)
+            return false;
+
+        d.stage_queue.erase(std::find(d.stage_queue.begin(), d.stage_queue.end(), task));
+        task->input_stage.store(InputStage::Bound);
+        return true;
+    }
+
+    void EFairScheduler::request_staging(Dispatcher &d, Task *task) {
+        if (task->stage_requested || task->input_stage.load() != InputStage::Unstaged ||
+            task->status != TaskState::Submitted || (task->borrowed_inputs.empty() && task->staged_inputs.empty()))
+            return;
+
+        // Batches gather their inputs when they are formed
+        {
+            std::unique_lock<std::mutex> lock(task->model->executors_lock);
+            if (!task->model->variants.empty())
+                return;
+        }
+
+        // The entity is not stolen while the task is out, so that it starts on the device it was staged for
+        task->stage_requested = true;
+        task->entity->num_staged.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(d.stage_lock);
+            d.stage_queue.push_back(task);
+        }
+        d.stage_cv.notify_one();
+    }
+
+    void EFairScheduler::stage_inputs(Dispatcher &d) {
+        // Copies go on a stream of their own, so they overlap with the kernels running on the executor streams
+        auto *device_api = tvm::runtime::DeviceAPI::Get(d.dev);
+        TVMStreamHandle stream = device_api->CreateStream(d.dev);
+
+        while (true){
+            Task *task;
+            {
+                std::unique_lock<std::mutex> lock(d.stage_lock);
+                d.stage_cv.wait(lock, [this, &d] { return !d.stage_queue.empty() || _shutdown.load(); });
+                if (_shutdown.load())
+                    break;
+
+                task = d.stage_queue.front();
+                d.stage_queue.pop_front();
+                task->input_stage.store(InputStage::Staging);
+            }
 
-    Status
-    EFairScheduler::load_model(const std::string model_path, const std::string profile_path, const EntityID eid,
-                               const std::string freq, ModelID &mid) {
+            task->stage_status = stage_task(d, task, stream);
+            d.num_staged.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lock(task->lock);
+                task->input_stage.store(InputStage::Staged);
+                task->cv.notify_all();
+            }
+        }
 
-        std::shared_ptr<executor::Executor> executor(new executor::Executor(model_path, profile_path, dev));
-        ModelID issued_mid;
-        {
-            std::unique_lock<std::mutex> lock(model_pool_lock);
-            issued_mid = model_cnt;
-            model_cnt++;
+        if (stream != nullptr)
+            device_api->FreeStream(d.dev, stream);
+    }
+
+    Status EFairScheduler::stage_task(Dispatcher &d, Task *task, TVMStreamHandle stream) {
+        RETURN_STATUS(get_executor_pool(task->model, nullptr, d, task->executor_pool))
+        RETURN_STATUS(executor::ModelCache::global().acquire(task->executor_pool, task->executor))
+
+        Status s = Status::Succeed;
+        for (const auto &input : task->borrowed_inputs){
+            if (task->executor->stage_input(input.key, input.data, input.size, stream) != Status::Succeed)
+                s = Status::Fail;
+        }
+        for (const auto &[key, staged] : task->staged_inputs){
+            if (task->executor->stage_input(key, staged, stream) != Status::Succeed)
+                s = Status::Fail;
         }
 
-        std::shared_ptr<Model> m(new Model);
-        m->mid = issued_mid;
-        m->eid = eid;
-        m->freq = freq;
-        m->executor = std::move(executor);
-        RETURN_STATUS(m->executor->get_gpu_power(m->freq, m->power))
-        RETURN_STATUS(m->executor->get_max_gpu_power(m->max_power))
-        RETURN_STATUS(m->executor->get_num_kernels(m->num_kernels))
+        // Staging buffers are reused once the copies out of them are done
+        tvm::runtime::DeviceAPI::Get(d.dev)->StreamSync(d.dev, stream);
+        for (auto &[key, staged] : task->staged_inputs){
+            task->model->executors->get_prototype()->release_staging_buffer(key, std::move(staged));
+        }
 
-        sched_entities[eid]->max_power =
-                sched_entities[eid]->max_power < m->max_power ? m->max_power : sched_entities[eid]->max_power;
+        task->borrowed_inputs.clear();
+        task->staged_inputs.clear();
+        return s;
+    }
 
-        LOG(INFO) << "Loaded model ID <" << issued_mid << "> " << m->executor->model_name << " with max power "
-                  << m->max_power << " mWatt";
-        LOG(INFO) << "Model " << issued_mid << " execution frequency " << m->freq << " power " << m->power;
+    Status EFairScheduler::bind_batch_inputs(Task *task, Model *model) {
+        // The input of the i-th task of the batch is copied into slice i of the batched input. Every task of the
+        // batch gives the same inputs, so each slice of a batched input is written.
+        auto *prototype = model->executors->get_prototype();
+        auto *batched_prototype = task->variant->executors->get_prototype();
+        std::vector<std::pair<std::string, tvm::runtime::NDArray>> batched;
+        auto batched_input = [&](const std::string &key, size_t size) -> uint8_t * {
+            for (auto &[batched_key, buffer] : batched){
+                if (batched_key == key)
+                    return static_cast<uint8_t *>(buffer->data);
+            }
 
-        model_pool.insert({issued_mid, std::move(m)});
-        mid = issued_mid;
+            size_t batched_size;
+            tvm::runtime::NDArray buffer;
+            if (batched_prototype->get_input_size(key, batched_size) != Status::Succeed ||
+                batched_size != size * task->variant->batch_size ||
+                batched_prototype->acquire_staging_buffer(key, buffer) != Status::Succeed)
+                return nullptr;
+            batched.emplace_back(key, std::move(buffer));
+            return static_cast<uint8_t *>(batched.back().second->data);
+        };
+
+        Status s = Status::Succeed;
+        for (size_t i = 0; i <= task->batch.size(); i++){
+            Task *member = i == 0 ? task : task->batch[i - 1];
+            for (const auto &input : member->borrowed_inputs){
+                auto *slices = batched_input(input.key, input.size);
+                if (slices != nullptr)
+                    std::memcpy(slices + i * input.size, input.data, input.size);
+                else
+                    s = Status::Fail;
+            }
 
-        RETURN_STATUS(get_entity_avg_power(eid, sched_entities[eid]->avg_power));
-        LOG(INFO) << "Entity " << eid << " current average power " << sched_entities[eid]->avg_power;
+            for (auto &[key, staged] : member->staged_inputs){
+                size_t size;
+                auto *slices = prototype->get_input_size(key, size) == Status::Succeed ? batched_input(key, size) :
+                               nullptr;
+                if (slices != nullptr)
+                    std::memcpy(slices + i * size, staged->data, size);
+                else
+                    s = Status::Fail;
+                prototype->release_staging_buffer(key, std::move(staged));
+            }
 
-        return Status::Succeed;
+            member->borrowed_inputs.clear();
+            member->staged_inputs.clear();
+        }
+
+        for (auto &[key, buffer] : batched){
+            if (task->executor->set_input(key, buffer) != Status::Succeed)
+                s = Status::Fail;
+            batched_prototype->release_staging_buffer(key, std::move(buffer));
+        }
+        return s;
     }
 
-    Status EFairScheduler::compute_entity_schedule_slices() {
-        auto num_entities = rb_tree.size();
-        if (num_entities == 0)
-            return Status::Succeed;
+    Status EFairScheduler::copy_outputs(Task *task) {
+        Status s = Status::Succeed;
+        if (task->variant == nullptr){
+            for (const auto &output : task->outputs){
+                if (task->executor->get_output(output.idx, output.data, output.size) != Status::Succeed)
+                    s = Status::Fail;
+            }
+            return s;
+        }
+
+        // Slice i of each batched output belongs to the i-th task of the batch, outputs are read back once
+        size_t num_outputs;
+        RETURN_STATUS(task->executor->get_num_outputs(num_outputs))
+        std::vector<const DLTensor *> views(num_outputs, nullptr);
+        for (size_t i = 0; i <= task->batch.size(); i++){
+            Task *member = i == 0 ? task : task->batch[i - 1];
+            for (const auto &output : member->outputs){
+                if (output.idx >= num_outputs ||
+                    (views[output.idx] == nullptr &&
+                     task->executor->get_output_view(output.idx, views[output.idx]) != Status::Succeed)){
+                    s = Status::Fail;
+                    continue;
+                }
+
+                const auto *view = views[output.idx];
+                std::memcpy(output.data, static_cast<const uint8_t *>(view->data) + view->byte_offset + i * output.size,
+                            output.size);
+            }
+        }
+        return s;
+    }
 
-        std::multimap<MicroJoule, std::shared_ptr<ScheduleEntity>> energy_profile;
-        MicroSeconds remain_slices = total_quantum_size;
+    bool EFairScheduler::same_input_keys(const Task *a, const Task *b) {
+        auto keys = [](const Task *task) {
+            std::vector<std::string> keys;
+            for (const auto &input : task->borrowed_inputs){
+                keys.push_back(input.key);
+            }
+            for (const auto &[key, staged] : task->staged_inputs){
+                keys.push_back(key);
+            }
+            std::sort(keys.begin(), keys.end());
+            return keys;
+        };
+        return keys(a) == keys(b);
+    }
+
+    bool EFairScheduler::hold_for_batch(const ScheduleEntity *entity, const Task *task,
+                                        std::chrono::steady_clock::time_point &wait_until) {
+        if (max_batch_delay == 0)
+            return false;
 
-        for (const auto & [vruntime, entity] : rb_tree){
-            double fraction = static_cast<double>(entity->weight) / total_weight;
-            auto w = static_cast<double>(priority_map.at(0)) / entity->weight;
+        wait_until = task->submit_t + std::chrono::microseconds(max_batch_delay);
+        if (std::chrono::steady_clock::now() >= wait_until)
+            return false;
 
-            entity->sched_slice = static_cast<MicroJoule>(fraction * alpha * total_quantum_size);
-            MicroJoule energy_consumption = entity->avg_power * 1e-3 * entity->sched_slice * w;
-            energy_profile.insert({energy_consumption, entity});
-            remain_slices -= entity->sched_slice;
+        size_t largest;
+        {
+            std::unique_lock<std::mutex> lock(task->model->executors_lock);
+            if (task->model->variants.empty())
+                return false;
+            largest = task->model->variants.back()->batch_size;
         }
 
-        while (remain_slices > 0){
-            auto amount = remain_slices > min_sched_unit ? min_sched_unit : remain_slices;
-            auto min_entity_it = energy_profile.begin();
-            auto min_entity = min_entity_it->second;
-            auto w = static_cast<double>(priority_map.at(0)) / min_entity->weight;
+        size_t num_queued = 0;
+        for (const auto *queued : entity->fcfs_queue){
+            auto stage = queued->input_stage.load();
+            if (num_queued == largest || queued->model != task->model || queued->status != TaskState::Submitted ||
+                !same_input_keys(task, queued) || queued->stage_requested || stage == InputStage::Staging ||
+                stage == InputStage::Staged)
+                break;
+            num_queued++;
+        }
+        return num_queued < largest;
+    }
 
-            min_entity->sched_slice += amount;
-            MicroJoule energy_consumption = min_entity->avg_power * 1e-3 * min_entity->sched_slice * w;
+    void EFairScheduler::form_batch(Dispatcher &d, ScheduleEntity *entity, Task *task) {
+        // Tasks of the same model queued right behind the task join it on the largest variant there are enough
+        // of them for, so that the entity still runs its tasks in order. Tasks the stager has bound run alone, and
+        // so do tasks giving other inputs than the first, which would leave slices of the batch as last written.
+        // Tasks are only claimed once the variant is known, so that tasks left out of the batch can still be staged
+        std::vector<size_t> batch_sizes;
+        {
+            std::unique_lock<std::mutex> lock(task->model->executors_lock);
+            for (auto &v : task->model->variants){
+                batch_sizes.push_back(v->batch_size);
+            }
+        }
+        if (batch_sizes.empty())
+            return;
+
+        size_t num_eligible = 0;
+        for (auto *queued : entity->fcfs_queue){
+            auto stage = queued->input_stage.load();
+            if (num_eligible == batch_sizes.back() || queued->model != task->model ||
+                queued->status != TaskState::Submitted || !same_input_keys(task, queued) ||
+                stage == InputStage::Staging || stage == InputStage::Staged)
+                break;
+            num_eligible++;
+        }
 
-            energy_profile.erase(min_entity_it);
-            energy_profile.insert({energy_consumption, min_entity});
-            remain_slices -= amount;
+        // The stager may take a task it was handed meanwhile, which leaves a smaller batch and unclaims the rest
+        auto largest_fitting = [&](size_t num_tasks) {
+            size_t batch_size = 0;
+            for (auto size : batch_sizes){
+                if (size <= num_tasks)
+                    batch_size = size;
+            }
+            return batch_size;
+        };
+        size_t batch_size = largest_fitting(num_eligible);
+        size_t num_claimed = 0;
+        while (num_claimed < batch_size && claim_task(d, entity->fcfs_queue[num_claimed])){
+            num_claimed++;
+        }
+        if (num_claimed < batch_size){
+            batch_size = largest_fitting(num_claimed);
+            for (size_t i = std::max<size_t>(batch_size, 1); i < num_claimed; i++){
+                entity->fcfs_queue[i]->input_stage.store(InputStage::Unstaged);
+            }
         }
 
-        return Status::Succeed;
+        ModelVariant *variant = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(task->model->executors_lock);
+            for (auto &v : task->model->variants){
+                if (v->batch_size == batch_size)
+                    variant = v.get();
+            }
+        }
+        if (variant == nullptr)
+            return;
+
+        auto first = entity->fcfs_queue.begin() + 1;
+        auto last = entity->fcfs_queue.begin() + variant->batch_size;
+        task->variant = variant;
+        task->batch.assign(first, last);
+        entity->fcfs_queue.erase(first, last);
+
+        auto now = std::chrono::steady_clock::now();
+        for (auto *member : task->batch){
+            member->start_t = now;
+            member->status = TaskState::Started;
+            tracer.record(util::TaskStart, member->tid, d.index);
+        }
+        d.num_batches.fetch_add(1);
+        d.num_batched_tasks.fetch_add(variant->batch_size);
     }
 
-    Status EFairScheduler::create_entity(Priority priority, EntityID &eid) {
-        if (priority_map.find(priority) == priority_map.end()) {
-            LOG(ERROR) << "Cannot find priority level " << priority;
-            return Status::NotFound;
+    void EFairScheduler::finish_task(Task *task, bool realtime) {
+        task->end_t = std::chrono::steady_clock::now();
+
+        tracer.record(util::TaskFinish, task->tid, task->service_time);
+        if (log_every_n > 0 && task->tid % log_every_n == 0){
+            auto response_time = std::chrono::duration_cast<std::chrono::microseconds>(
+                    task->end_t - task->start_t).count();
+            LOG(INFO) << "Finished task <" << task->tid << "> in " << response_time << " µs";
+            if (kernel_timing)
+                LOG(INFO) << "Task <" << task->tid << "> measured " << task->measured_time
+                          << " µs, profiled " << task->service_time << " µs";
+        }
+
+        task_history.add({task->tid, task->eid, task->mid, task->submit_t, task->start_t, task->end_t,
+                          task->service_time, task->energy_used, task->measured_time});
+        if (realtime){
+            task->entity->num_deadline_tasks.fetch_add(1);
+            if (task->end_t > task->deadline)
+                task->entity->num_deadline_misses.fetch_add(1);
         }
 
-        size_t weight = priority_map.at(priority);
-        EntityID issued_eid;
         {
-            std::unique_lock<std::mutex> lock(sched_entities_lock);
-            issued_eid = entity_cnt;
-            entity_cnt++;
+            std::unique_lock<std::mutex> lock(task->model->task_lock);
+            task->model->num_live_tasks--;
+        }
+        {
+            std::unique_lock<std::mutex> lock(unwaited_lock);
+            unwaited_tasks.emplace_back(task, task->tid.load());
         }
 
-        std::shared_ptr<ScheduleEntity> entity(new ScheduleEntity);
-        entity->eid = issued_eid;
-        entity->weight = weight;
-        entity->max_power = 0;
-        entity->avg_power = 0;
-        entity->runtime = 0;
-        entity->sched_slice = 0;
+        // wait_task may recycle the task as soon as it sees it finished, so it is not touched after this
+        {
+            std::unique_lock<std::mutex> lock(task->lock);
+            task->status = TaskState::Finished;
+            task->cv.notify_all();
+        }
+        reclaim_unwaited();
+    }
 
-        LOG(INFO) << "Created schedule entity ID <" << issued_eid << "> with priority " << priority;
+    bool EFairScheduler::consume_task(Task *task, TaskID tid, TaskRecord *record) {
+        {
+            // The slot may have been recycled for a newer task, or another waiter or the reclaimer got here first
+            std::unique_lock<std::mutex> lock(task->lock);
+            if (task->tid != tid || task->status != TaskState::Finished || task->consumed)
+                return false;
+
+            task->consumed = true;
+            if (record != nullptr)
+                *record = {task->tid, task->eid, task->mid, task->submit_t, task->start_t, task->end_t,
+                           task->service_time, task->energy_used, task->measured_time};
+        }
 
-        sched_entities.insert({issued_eid, std::move(entity)});
-        eid = issued_eid;
+        tasks.remove(tid);
+        task_slab.release(task);
+        return true;
+    }
 
-        return Status::Succeed;
+    void EFairScheduler::reclaim_unwaited() {
+        std::vector<std::pair<Task *, TaskID>> expired;
+        {
+            std::unique_lock<std::mutex> lock(unwaited_lock);
+            while (unwaited_tasks.size() > max_unwaited_tasks){
+                expired.push_back(unwaited_tasks.front());
+                unwaited_tasks.pop_front();
+            }
+        }
+
+        // Most of these have been waited on already, the rest only live on in the task history
+        for (const auto &[task, tid] : expired){
+            if (consume_task(task, tid, nullptr))
+                num_reclaimed.fetch_add(1);
+        }
     }
 
-    Status
-    EFairScheduler::set_input(const ModelID &mid, const std::string &key, const void *input_data, size_t size) {
-        RETURN_STATUS(model_pool[mid]->executor->set_input(key, input_data, size))
-        return Status::Succeed;
+    void EFairScheduler::release_executor(Task *task) {
+        executor::ModelCache::global().release(task->executor_pool, task->executor);
+        task->executor.reset();
+        task->executor_pool.reset();
     }
 
     Status EFairScheduler::set_entity_priority(const EntityID eid, const Priority priority) {
-        if (sched_entities.find(eid) == sched_entities.end() || priority_map.find(priority) == priority_map.end())
+        auto *entity = entities.find(eid);
+        if (entity == nullptr || priority_map.find(priority) == priority_map.end())
             return Status::NotFound;
-        sched_entities[eid]->weight = priority_map.at(priority);
+        entity->weight = priority_map.at(priority);
+        update_entity_slice(entity);
         return Status::Succeed;
     }
 
     Status EFairScheduler::wait_task(const TaskID &tid) {
-        std::shared_ptr<Task> task = task_pool[tid];
+        TaskRecord record;
+        return wait_task(tid, record);
+    }
 
-        std::unique_lock<std::mutex> lock(task->lock);
-        task->cv.wait(lock, [task] { return task->status == TaskState::Finished; });
+    Status EFairScheduler::wait_task(const TaskID &tid, TaskRecord &record) {
+        Task *task;
+        if (get_task(tid, task) == Status::Succeed){
+            {
+                std::unique_lock<std::mutex> lock(task->lock);
+                task->cv.wait(lock, [task, tid] { return task->tid != tid || task->status == TaskState::Finished; });
+            }
 
-        return Status::Succeed;
+            // The scheduler is done with a finished task, so its completion is consumed here and the task recycled
+            if (consume_task(task, tid, &record))
+                return Status::Succeed;
+        }
+
+        // Consumed by another waiter or reclaimed, the record outlives the task in the history
+        return task_history.find(tid, record);
     }
 
     Status EFairScheduler::new_task(const ModelID mid, TaskID &tid) {
-        TaskID issued_tid;
+        return new_task(mid, {}, tid);
+    }
+
+    Status EFairScheduler::new_task(const ModelID mid, const std::vector<TaskInput> &inputs, TaskID &tid) {
+        return new_task(mid, inputs, {}, tid);
+    }
+
+    Status EFairScheduler::new_task(const ModelID mid, const std::vector<TaskInput> &inputs,
+                                    const std::vector<TaskOutput> &outputs, TaskID &tid) {
+        auto *model = models.find(mid);
+        if (model == nullptr)
+            return Status::NotFound;
+
+        size_t input_size;
+        for (const auto &input : inputs){
+            RETURN_STATUS(model->executors->get_prototype()->get_input_size(input.key, input_size))
+            if (input.size != input_size){
+                LOG(ERROR) << "Input " << input.key << " expects " << input_size << " bytes but get " << input.size;
+                return Status::Fail;
+            }
+        }
+
+        size_t output_size;
+        for (const auto &output : outputs){
+            RETURN_STATUS(model->executors->get_prototype()->get_output_size(output.idx, output_size))
+            if (output.size != output_size){
+                LOG(ERROR) << "Output " << output.idx << " has " << output_size << " bytes but get " << output.size;
+                return Status::Fail;
+            }
+        }
+
         {
-            std::unique_lock<std::mutex> lock(task_pool_lock);
-            issued_tid = task_cnt;
-            task_cnt++;
+            std::unique_lock<std::mutex> lock(model->task_lock);
+            if (model->retiring)
+                return Status::NotFound;
+            model->num_live_tasks++;
         }
-        auto target_entity_id = model_pool[mid]->eid;
-        std::shared_ptr<Task> task(new Task);
+
+        TaskID issued_tid = task_cnt.fetch_add(1);
+        Task *task = task_slab.acquire();
         task->submit_t = std::chrono::steady_clock::now();
-        task->status = TaskState::Submitted;
-        task->eid = target_entity_id;
+        {
+            // A waiter that looked the previous occupant up may still be checking this task under its lock
+            std::unique_lock<std::mutex> lock(task->lock);
+            task->tid = issued_tid;
+            task->status = TaskState::Submitted;
+            task->consumed = false;
+        }
+        task->eid = model->eid;
+        task->entity = entities.find(model->eid);
+        task->deadline = task->submit_t + std::chrono::microseconds(task->entity->relative_deadline);
+        task->model = model;
         task->mid = mid;
-        task->tid = issued_tid;
         task->energy_used = 0;
         task->service_time = 0;
+        task->measured_time = 0;
         task->kernel_idx = 0;
+        task->executor.reset();
+        task->borrowed_inputs = inputs;
+        task->outputs = outputs;
+        task->variant = nullptr;
+        task->batch.clear();
+        task->input_stage.store(InputStage::Unstaged);
+        task->stage_requested = false;
 
         {
-            std::unique_lock<std::mutex> lock(sched_entities[target_entity_id]->lock);
-            sched_entities[target_entity_id]->fcfs_queue.push_back(task);
+            std::unique_lock<std::mutex> lock(model->input_lock);
+            task->staged_inputs = std::move(model->pending_inputs);
+            model->pending_inputs.clear();
+        }
 
-            if (sched_entities[target_entity_id]->fcfs_queue.size() == 1) {
-                std::unique_lock<std::mutex> tree_lock(rb_tree_lock);
-                if (rb_tree.size() == 0) {
-                    sched_entities[target_entity_id]->vruntime = 0;
-                } else {
-                    auto tree_item = rb_tree.begin();
-                    sched_entities[target_entity_id]->vruntime = tree_item->first;
+        // Registered before it is queued so that a task finishing right away can still be waited on
+        tasks.insert(task);
+        tid = issued_tid;
+        tracer.record(util::TaskSubmit, issued_tid, model->eid);
+
+        // The dispatcher owning the entity queues the task, so submitting never contends with scheduling. A steal
+        // waits for submitters that read the old owner, so the task is in that queue when the steal takes it.
+        auto *entity = task->entity;
+        entity->num_submitting.fetch_add(1);
+        auto &d = *dispatchers[entity->dispatcher.load()];
+        bool was_empty = d.submissions.push(task);
+        entity->num_submitting.fetch_sub(1);
+        if (was_empty)
+            wake_dispatcher(d);
+        return Status::Succeed;
+    }
+
+    void EFairScheduler::drain_submissions(Dispatcher &d) {
+        if (d.submissions.empty() && !d.has_handed_back.load())
+            return;
+
+        {
+            // Drained under the lock, so a steal finds each task either still queued or already with its entity
+            std::unique_lock<std::mutex> tree_lock(d.run_queue_lock);
+            Task *task = take_submissions(d);
+            while (task != nullptr){
+                Task *next = task->next;
+                auto *entity = task->entity;
+                entity->fcfs_queue.push_back(task);
+                if (entity->rq_handle == RunQueue<ScheduleEntity *>::InvalidHandle){
+                    // Start at the current minimum so that a waking entity neither starves others nor is starved
+                    entity->vruntime = d.run_queue.get_min_vruntime();
+                    enqueue_entity(d, entity);
                 }
+                task = next;
+            }
+        }
+
+        // A waiting fair entity next to other work is left for an idle device to take
+        if (is_stealable(d))
+            wake_idle_peer(d);
+    }
+
+    EFairScheduler::Task* EFairScheduler::take_submissions(Dispatcher &d) {
+        // Tasks handed back by a steal were queued before anything still in the queue
+        Task *task = d.submissions.drain();
+        if (d.handed_back == nullptr)
+            return task;
+
+        Task *first = d.handed_back, *last = first;
+        while (last->next != nullptr)
+            last = last->next;
+        last->next = task;
+        d.handed_back = nullptr;
+        d.has_handed_back.store(false);
+        return first;
+    }
+
+    bool EFairScheduler::can_steal(const Dispatcher &d) const {
+        for (const auto &other : dispatchers){
+            if (can_steal_from(d, *other))
+                return true;
+        }
+        return false;
+    }
 
-                rb_tree.insert({sched_entities[target_entity_id]->vruntime, sched_entities[target_entity_id]});
-                get_total_weight(total_weight);
-                compute_entity_schedule_slices();
+    bool EFairScheduler::steal_entity(Dispatcher &d) {
+        Dispatcher *victim = nullptr;
+        size_t most_runnable = 0;
+        for (const auto &other : dispatchers){
+            auto num_runnable = other->num_runnable.load();
+            if (can_steal_from(d, *other) && num_runnable > most_runnable){
+                victim = other.get();
+                most_runnable = num_runnable;
+            }
+        }
+        if (victim == nullptr)
+            return false;
+
+        // Take the waiting entity that would run next on the victim, the one being dispatched there stays. So do
+        // entities whose head task already holds an executor of the victim's device, with its activations there;
+        // binding only happens while an entity is current, so under the lock the head task cannot be bound.
+        ScheduleEntity *entity = nullptr;
+        VRuntime lag;
+        {
+            std::unique_lock<std::mutex> tree_lock(victim->run_queue_lock);
+            VRuntime earliest = 0;
+            victim->run_queue.for_each([&](ScheduleEntity *e, VRuntime vruntime, size_t weight) {
+                if (e == victim->current || e->num_staged.load() > 0 || e->fcfs_queue.front()->executor != nullptr)
+                    return;
+                if (entity == nullptr || vruntime < earliest){
+                    entity = e;
+                    earliest = vruntime;
+                }
+            });
+            if (entity == nullptr)
+                return false;
+
+            lag = entity->vruntime - victim->run_queue.get_min_vruntime();
+            dequeue_entity(*victim, entity);
+            entity->dispatcher.store(d.index);
+            victim->num_entities.fetch_sub(1);
+            d.num_entities.fetch_add(1);
+
+            // Tasks of the entity still queued at the victim go ahead of any submitted here from now on, once the
+            // submitters that read the old owner are done pushing. The others go back to the victim in order.
+            while (entity->num_submitting.load() > 0)
+                std::this_thread::yield();
+            Task *task = take_submissions(*victim);
+            Task **handed_back = &victim->handed_back;
+            while (task != nullptr){
+                Task *next = task->next;
+                if (task->entity == entity){
+                    entity->fcfs_queue.push_back(task);
+                } else {
+                    task->next = nullptr;
+                    *handed_back = task;
+                    handed_back = &task->next;
+                }
+                task = next;
             }
+            if (victim->handed_back != nullptr)
+                victim->has_handed_back.store(true);
         }
+        if (victim->has_handed_back.load())
+            wake_dispatcher(*victim);
 
-        task_pool.insert({issued_tid, task});
-        tid = issued_tid;
-        return Status::Succeed;
+        // vruntime only compares within a queue, so the entity keeps its lag behind the minimum rather than its value
+        {
+            std::unique_lock<std::mutex> tree_lock(d.run_queue_lock);
+            entity->vruntime = d.run_queue.get_min_vruntime() + lag;
+            enqueue_entity(d, entity);
+        }
+
+        // Both devices have a different set of entities sharing them now
+        victim->replan.store(true);
+        d.replan.store(true);
+        d.num_steals.fetch_add(1);
+        LOG(INFO) << "Device " << d.index << " took entity <" << entity->eid << "> from device " << victim->index;
+        return true;
     }
 
-    Status EFairScheduler::get_task(const TaskID tid, std::shared_ptr<Task> &ret_task) {
-        if (task_pool.find(tid) == task_pool.end())
-            return Status::NotFound;
+    Status EFairScheduler::get_task(const TaskID tid, Task *&ret_task) {
+        ret_task = tasks.find(tid);
+        return ret_task != nullptr ? Status::Succeed : Status::NotFound;
+    }
+
+    void EFairScheduler::enqueue_entity(Dispatcher &d, ScheduleEntity *entity) {
+        if (entity->relative_deadline > 0){
+            auto key = get_deadline_key(entity->fcfs_queue.front());
+            entity->rq_handle = d.edf_queue.insert(entity, key, entity->weight);
+            d.num_runnable.fetch_add(1);
+            tracer.record(util::EntityEnqueue, entity->eid, d.index);
+            return;
+        }
+
+        entity->rq_handle = d.run_queue.insert(entity, entity->vruntime, entity->weight);
+        entity->freq_class = entity->fcfs_queue.front()->model->freq;
+        entity->freq_handle = d.freq_queues[entity->freq_class].insert(entity, entity->vruntime, entity->weight);
+        d.slice_solver.add(entity->eid, entity->weight, entity->avg_power);
+        d.num_runnable.fetch_add(1);
+        d.num_stealable.fetch_add(1);
+        tracer.record(util::EntityEnqueue, entity->eid, d.index);
+    }
+
+    void EFairScheduler::dequeue_entity(Dispatcher &d, ScheduleEntity *entity) {
+        if (entity->relative_deadline > 0){
+            d.edf_queue.remove(entity->rq_handle);
+            d.num_runnable.fetch_sub(1);
+            entity->rq_handle = RunQueue<ScheduleEntity *>::InvalidHandle;
+            tracer.record(util::EntityDequeue, entity->eid, d.index);
+            return;
+        }
+
+        d.run_queue.remove(entity->rq_handle);
+        d.freq_queues[entity->freq_class].remove(entity->freq_handle);
+        d.slice_solver.remove(entity->eid);
+        d.num_runnable.fetch_sub(1);
+        d.num_stealable.fetch_sub(1);
+        entity->rq_handle = RunQueue<ScheduleEntity *>::InvalidHandle;
+        entity->freq_handle = RunQueue<ScheduleEntity *>::InvalidHandle;
+        tracer.record(util::EntityDequeue, entity->eid, d.index);
+    }
+
+    void EFairScheduler::requeue_entity(Dispatcher &d, ScheduleEntity *entity) {
+        if (entity->relative_deadline > 0){
+            d.edf_queue.update(entity->rq_handle, get_deadline_key(entity->fcfs_queue.front()));
+            return;
+        }
+
+        d.run_queue.update(entity->rq_handle, entity->vruntime);
+
+        // The next task may belong to a model running at another frequency
+        auto &freq = entity->fcfs_queue.front()->model->freq;
+        if (freq == entity->freq_class){
+            d.freq_queues[freq].update(entity->freq_handle, entity->vruntime);
+        } else {
+            d.freq_queues[entity->freq_class].remove(entity->freq_handle);
+            entity->freq_class = freq;
+            entity->freq_handle = d.freq_queues[freq].insert(entity, entity->vruntime, entity->weight);
+        }
+    }
+
+    EFairScheduler::ScheduleEntity* EFairScheduler::pick_entity(Dispatcher &d) {
+        auto *next = d.run_queue.get(d.run_queue.top());
+        if (max_freq_lag <= 0 || d.cur_freq.empty() || next->freq_class == d.cur_freq)
+            return next;
 
-        ret_task = task_pool.at(tid);
+        // Running an entity at the current frequency first saves a switch, as long as it is not too far behind
+        auto it = d.freq_queues.find(d.cur_freq);
+        if (it == d.freq_queues.end() || it->second.empty())
+            return next;
+
+        auto h = it->second.top();
+        if (it->second.get_vruntime(h) > d.run_queue.get_min_vruntime() + max_freq_lag)
+            return next;
+
+        d.grouped_pick = true;
+        return it->second.get(h);
+    }
+
+    VRuntime EFairScheduler::get_deadline_key(const Task *task) const {
+        // Microseconds from the start of the scheduler, so that deadlines order like vruntimes in a RunQueue
+        return std::chrono::duration<VRuntime, std::micro>(task->deadline - run_start_t).count();
+    }
+
+    void EFairScheduler::refill_rt_budget(Dispatcher &d) {
+        // Real-time entities may use up to max_rt_bandwidth of every window of the total quantum size
+        auto now = std::chrono::steady_clock::now();
+        if (now - d.rt_window_start >= std::chrono::microseconds(total_quantum_size)){
+            d.rt_window_start = now;
+            d.rt_budget = static_cast<MicroSeconds>(max_rt_bandwidth * total_quantum_size);
+        }
+    }
+
+    void EFairScheduler::update_entity_slice(ScheduleEntity *entity) {
+        // Real-time entities are ordered by deadline and take no part in the slices
+        if (entity->relative_deadline > 0)
+            return;
+
+        // The owner can only change under the run queue lock of the current owner, so check again once it is held
+        auto owner = entity->dispatcher.load();
+        std::unique_lock<std::mutex> tree_lock(dispatchers[owner]->run_queue_lock);
+        while (entity->dispatcher.load() != owner){
+            tree_lock.unlock();
+            owner = entity->dispatcher.load();
+            tree_lock = std::unique_lock<std::mutex>(dispatchers[owner]->run_queue_lock);
+        }
+
+        // Idle entities are added with their current weight and power when they become runnable
+        auto &d = *dispatchers[owner];
+        d.replan.store(true);
+        if (entity->rq_handle == RunQueue<ScheduleEntity *>::InvalidHandle)
+            return;
+
+        d.run_queue.update_weight(entity->rq_handle, entity->weight);
+        d.slice_solver.update(entity->eid, entity->weight, entity->avg_power);
+    }
+
+    Status EFairScheduler::get_task_timestamps(const TaskID tid,
+                                               std::vector<std::chrono::steady_clock::time_point> &timestamps) {
+        Task *task;
+        if (get_task(tid, task) == Status::Succeed)
+            return task->get_timestamp(timestamps);
+
+        TaskRecord record;
+        RETURN_STATUS(task_history.find(tid, record))
+        timestamps = {record.submit_t, record.start_t, record.end_t};
         return Status::Succeed;
     }
 
@@ -265,6 +1655,7 @@ namespace scheduler {
         MilliWatt power_sum = 0;
         size_t cnt = 0;
 
+        std::unique_lock<std::mutex> lock(model_pool_lock);
         for (const auto &[mid, model]: model_pool){
             if (model->eid == eid){
                 power_sum += model->power;
@@ -272,96 +1663,229 @@ namespace scheduler {
             }
         }
 
-        ret_avg_power = power_sum / cnt;
+        ret_avg_power = cnt > 0 ? power_sum / cnt : 0;
         return Status::Succeed;
     }
 
-    Status EFairScheduler::get_total_weight(size_t &ret_weight) {
-        ret_weight = 0;
+    void EFairScheduler::loop_body(Dispatcher &d) {
+        drain_submissions(d);
+        if (d.replan.exchange(false))
+            plan_frequencies(d);
+        // An idle device takes an entity from any device with more than one runnable, a busy one evens out with a
+        // device that has two more runnable than it
+        if (can_steal(d))
+            steal_entity(d);
+        if (d.num_runnable.load() == 0) return;
+        auto start_t = std::chrono::steady_clock::now();
 
-        for (const auto &[key, entity]: rb_tree) {
-            ret_weight += entity->weight;
+        // Other dispatchers never take the current entity, so it stays here while the queue is unlocked
+        ScheduleEntity *cur_entity = nullptr;
+        bool realtime = false, throttled = false;
+        refill_rt_budget(d);
+        {
+            std::unique_lock<std::mutex> tree_lock(d.run_queue_lock);
+            d.grouped_pick = false;
+            if (!d.edf_queue.empty() && d.rt_budget > 0){
+                // The real-time entity with the earliest deadline runs one task, within what is left of the budget
+                cur_entity = d.edf_queue.get(d.edf_queue.top());
+                cur_entity->sched_slice = d.rt_budget;
+                realtime = true;
+            } else if (!d.run_queue.empty()){
+                cur_entity = pick_entity(d);
+                cur_entity->sched_slice = d.slice_solver.get_slice(cur_entity->weight, cur_entity->avg_power);
+            }
+            throttled = !d.edf_queue.empty() && d.rt_budget == 0;
+            d.current = cur_entity;
+            if (cur_entity != nullptr && !realtime)
+                d.num_stealable.fetch_sub(1);
         }
-        return Status::Succeed;
-    }
 
-    void EFairScheduler::loop_body() {
-        if (rb_tree.empty()) return;
-//        std::unique_lock<std::mutex> tree_lock(rb_tree_lock);
-        auto start_t = std::chrono::steady_clock::now();
+        if (cur_entity == nullptr){
+            // Only real-time entities out of budget are runnable, wait for the window in short steps so that
+            // new tasks of fair entities are still picked up
+            if (throttled){
+                auto window_end = d.rt_window_start + std::chrono::microseconds(total_quantum_size);
+                std::this_thread::sleep_until(std::min(window_end, std::chrono::steady_clock::now() +
+                                                                   std::chrono::microseconds(max_idle_spin)));
+            }
+            return;
+        }
 
-        std::multimap<VRuntime, std::shared_ptr<ScheduleEntity>>::iterator cur_entity_it;
-        {
-            std::unique_lock<std::mutex> tree_lock(rb_tree_lock);
-            cur_entity_it = rb_tree.begin();
+        // A partial batch at the head of the only runnable entity waits for more tasks before a quantum is opened,
+        // in short steps so that the tasks completing the batch, and tasks of other entities, are picked up.
+        // Real-time entities are admitted one task at a time, so only fair entities run batches.
+        std::chrono::steady_clock::time_point hold_until;
+        if (!realtime && d.num_runnable.load() == 1 && cur_entity->fcfs_queue.front()->status == TaskState::Submitted &&
+            hold_for_batch(cur_entity, cur_entity->fcfs_queue.front(), hold_until)){
+            {
+                std::unique_lock<std::mutex> tree_lock(d.run_queue_lock);
+                d.current = nullptr;
+                d.num_stealable.fetch_add(1);
+            }
+            std::this_thread::sleep_until(std::min(hold_until, std::chrono::steady_clock::now() +
+                                                               std::chrono::microseconds(max_idle_spin)));
+            return;
         }
+        tracer.record(util::QuantumStart, cur_entity->eid, d.index);
 
-        auto cur_entity = cur_entity_it->second;
         MicroSeconds time_meter = 0;
         MicroJoule energy_meter = 0;
 
 //        LOG(INFO) << "Choose entity " << cur_entity->eid << "candidates:";
-//        for (const auto & [e_vruntime, e] : rb_tree){
+//        for (const auto & [e_vruntime, e] : run_queue){
 //            LOG(INFO) << "EID " << e->eid << " vruntime: " << e_vruntime;
 //         }
 
-//        double fraction = static_cast<double>(cur_entity->weight) / total_weight;
-//        MicroSeconds quantum_size = static_cast<MicroSeconds>(fraction * total_quantum_size);
-//        MicroJoule bucket_size = alpha * quantum_size * cur_entity->max_power * 1e-3;
         MicroSeconds quantum_size = cur_entity->sched_slice;
 
-//        LOG(INFO) << "Quantum size " << quantum_size << " Bucket size " << bucket_size << " fraction: " << fraction;
+        // An entity running at its maximum power uses up a refill after alpha of the slice, one running at lower
+        // frequencies is only charged for time. What a quantum leaves in the bucket is kept for later ones, up to a
+        // second refill. Without power figures there is no bucket.
+        MicroJoule bucket_size = 0;
+        MicroJoule energy_tokens = 0;
+        if (vruntime_mode == VRuntimeMode::Hybrid && !realtime){
+            bucket_size = static_cast<MicroJoule>(alpha * quantum_size * cur_entity->max_power * 1e-3);
+            cur_entity->energy_tokens = std::min(cur_entity->energy_tokens + bucket_size, 2 * bucket_size);
+            energy_tokens = cur_entity->energy_tokens;
+        }
+
+        // Overrun borrowed earlier is paid back, leaving at least half of the slice for progress
+        if (quantum_fit == QuantumFit::Borrow && !realtime){
+            MicroSeconds repay = std::min(cur_entity->carry, quantum_size / 2);
+            quantum_size -= repay;
+            cur_entity->carry -= repay;
+        }
 
         MicroJoule energy_used;
         MicroSeconds time_used;
-        std::string cur_freq;
 
-        Model *model;
+        Model *model = nullptr;
+        std::shared_ptr<executor::Executor> executor;
+        bool holding = false;
 
-        while (!cur_entity->fcfs_queue.empty() && time_meter < quantum_size) {
+        while (!cur_entity->fcfs_queue.empty() && time_meter < quantum_size &&
+               (bucket_size == 0 || energy_meter < energy_tokens)) {
 //            auto debug_start_t = std::chrono::steady_clock::now();
             auto task = cur_entity->fcfs_queue.front();
 
+            model = task->model;
+
             if (task->status == TaskState::Submitted) {
+                // A partial batch behind tasks run in this quantum ends it, and waits like one at its start
+                if (!realtime){
+                    if (time_meter > 0 && d.num_runnable.load() == 1 && hold_for_batch(cur_entity, task, hold_until)){
+                        holding = true;
+                        break;
+                    }
+                    form_batch(d, cur_entity, task);
+                }
                 task->start_t = std::chrono::steady_clock::now();
                 task->status = TaskState::Started;
+                ASSERT_STATUS(bind_executor(task, model, d));
+                tracer.record(util::TaskStart, task->tid, d.index);
+            }
+
+            // The inputs of the next task go to the device while this one runs
+            if (input_staging && cur_entity->fcfs_queue.size() > 1)
+                request_staging(d, cur_entity->fcfs_queue[1]);
+
+            executor = task->executor;
+            FreqIdx freq_idx = model->freq_idx;
+            size_t num_kernels = model->num_kernels;
+            if (task->variant != nullptr){
+                freq_idx = task->variant->freq_map[model->freq_idx];
+                num_kernels = task->variant->num_kernels;
+            }
+
+            KernelIdx end = task->kernel_idx + 1;
+            if (dispatch_mode == DispatchMode::KernelRange) {
+                // The run ends at the last kernel that fits the remaining quantum, so preemption stays at kernel
+                // boundaries while the call and accounting happen once per run
+                MicroSeconds budget = quantum_size - time_meter;
+                if (bucket_size > 0 && model->power > 0)
+                    budget = std::min(budget, static_cast<MicroSeconds>((energy_tokens - energy_meter) * 1e3 /
+                                                                        model->power));
+                end = executor->fit_kernel_range(task->kernel_idx, freq_idx, budget);
+            }
+
+            // The profile tells whether the run would end past the quantum before it is dispatched
+            if (quantum_fit == QuantumFit::Yield && time_meter > 0){
+                MicroSeconds predicted_time;
+                MicroJoule predicted_energy;
+                if (executor->get_kernel_range_cost(task->kernel_idx, end, freq_idx, predicted_time,
+                                                    predicted_energy) == Status::Succeed &&
+                    time_meter + predicted_time > quantum_size){
+                    d.num_yields.fetch_add(1);
+                    break;
+                }
             }
 
-            model = model_pool[task->mid].get();
-            ASSERT_STATUS(fc.get_frequency(cur_freq));
-            if (cur_freq != model->freq) {
-//                auto chfreq_start_t = std::chrono::steady_clock::now();
-                fc.set_cur_frequency(model->freq);
-//                auto chfreq_dur = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - chfreq_start_t).count();
-//                LOG(INFO) << "Change frequency takes " << chfreq_dur << " µs";
+            if (d.cur_freq != model->freq) {
+                if (d.fc != nullptr){
+//                    auto chfreq_start_t = std::chrono::steady_clock::now();
+                    d.fc->set_cur_frequency(model->freq);
+                    tracer.record(util::FrequencyChange, std::strtoull(model->freq.c_str(), nullptr, 10));
+//                    auto chfreq_dur = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - chfreq_start_t).count();
+//                    LOG(INFO) << "Change frequency takes " << chfreq_dur << " µs";
+                }
+                if (!d.cur_freq.empty())
+                    d.num_switches.fetch_add(1);
+                d.cur_freq = model->freq;
+            } else if (d.grouped_pick) {
+                // The earliest entity would have changed the frequency here
+                d.num_switches_avoided.fetch_add(1);
             }
+            d.grouped_pick = false;
 
-            model->executor->execute_kernel(task->kernel_idx, model->freq, time_used, energy_used);
+            if (dispatch_mode == DispatchMode::KernelRange) {
+                executor->execute_kernel_range(task->kernel_idx, end, freq_idx, time_used, energy_used);
+                tracer.record(util::KernelDispatch, task->tid, static_cast<uint64_t>(task->kernel_idx) << 32 | end);
+                task->kernel_idx = end;
+            } else {
+                executor->execute_kernel(task->kernel_idx, freq_idx, time_used, energy_used);
+                tracer.record(util::KernelDispatch, task->tid, static_cast<uint64_t>(task->kernel_idx) << 32 | end);
+                task->kernel_idx = end;
+            }
 
             time_meter += time_used;
             energy_meter += energy_used;
-            task->kernel_idx += 1;
             task->service_time += time_used;
             task->energy_used += energy_used;
 
-            if (task->kernel_idx == model->num_kernels) {
-                model->executor->sync();
-                task->end_t = std::chrono::steady_clock::now();
-                task->status = TaskState::Finished;
-
-                MicroSeconds response_time;
-                ASSERT_STATUS(task->get_response_time(response_time));
-                LOG(INFO) << "Finished task <" << task->tid << "> in " << response_time << " µs";
-
-                {
-                    std::unique_lock<std::mutex> lock(cur_entity->lock);
-                    cur_entity->fcfs_queue.pop_front();
+            if (task->kernel_idx == num_kernels) {
+                executor->sync();
+                if (kernel_timing) {
+                    MicroSeconds profiled_time;
+                    executor->get_timing(task->measured_time, profiled_time);
+                }
+                if (copy_outputs(task) != Status::Succeed)
+                    LOG(ERROR) << "Cannot copy the outputs of task <" << task->tid << ">";
+                release_executor(task);
+                cur_entity->fcfs_queue.pop_front();
+
+                // The profile prices the batch as a whole, so every task of it is charged an equal share
+                auto batch = std::move(task->batch);
+                task->batch.clear();
+                if (!batch.empty()){
+                    auto batch_size = batch.size() + 1;
+                    for (auto *member : batch){
+                        member->service_time = task->service_time / batch_size;
+                        member->energy_used = task->energy_used / batch_size;
+                        member->measured_time = task->measured_time / batch_size;
+                    }
+                    task->service_time -= batch.size() * (task->service_time / batch_size);
+                    task->energy_used -= batch.size() * (task->energy_used / batch_size);
+                    task->measured_time -= batch.size() * (task->measured_time / batch_size);
                 }
 
-                {
-                    std::unique_lock<std::mutex> lock(task->lock);
-                    task->cv.notify_all();
+                finish_task(task, realtime);
+                for (auto *member : batch){
+                    finish_task(member, realtime);
                 }
+
+                // The next deadline may belong to another real-time entity
+                if (realtime)
+                    break;
             }
 
 //            LOG(INFO) << "Energy meter " << energy_meter << "/" << bucket_size << " Time meter: " << time_meter << "/" << quantum_size;
@@ -372,129 +1896,255 @@ namespace scheduler {
 
         }
 
-        if (model != nullptr){
-            model->executor->sync();
+        if (executor != nullptr){
+            executor->sync();
+        }
+        if (realtime)
+            d.rt_budget = time_meter < d.rt_budget ? d.rt_budget - time_meter : 0;
+        if (bucket_size > 0)
+            cur_entity->energy_tokens = energy_meter < energy_tokens ? energy_tokens - energy_meter : 0;
+
+        if (time_meter > quantum_size){
+            MicroSeconds overrun = time_meter - quantum_size;
+            d.num_overruns.fetch_add(1);
+            d.overrun_time.fetch_add(overrun);
+            if (overrun > d.max_overrun.load())
+                d.max_overrun.store(overrun);
+            if (quantum_fit == QuantumFit::Borrow && !realtime)
+                cur_entity->carry += overrun;
         }
 
         {
-            std::unique_lock<std::mutex> tree_lock(rb_tree_lock);
-            std::unique_lock<std::mutex> lock(cur_entity->lock);
+            std::unique_lock<std::mutex> tree_lock(d.run_queue_lock);
+            d.current = nullptr;
+            if (!realtime)
+                d.num_stealable.fetch_add(1);
 
-            rb_tree.erase(cur_entity_it);
             if (!cur_entity->fcfs_queue.empty()) {
-//                auto norm_time_meter = static_cast<double>(time_meter) / quantum_size;
-//                auto norm_energy_meter = static_cast<double>(energy_meter) / bucket_size;
-//                auto norm_vruntime = norm_time_meter < norm_energy_meter ? norm_energy_meter : norm_time_meter;
-
-                cur_entity->vruntime += static_cast<double>(time_meter) / quantum_size;
+                // Against the full slice and one refill, so that the part of the quantum paid back is not charged
+                // twice and energy saved up earlier is charged when it is spent
+                auto norm_time_meter = static_cast<double>(time_meter) / cur_entity->sched_slice;
+                auto norm_energy_meter = bucket_size > 0 ? static_cast<double>(energy_meter) / bucket_size : 0;
+                if (!realtime){
+                    auto charge = std::max(norm_time_meter, norm_energy_meter);
+                    cur_entity->vruntime += charge;
+                    cur_entity->time_share += norm_time_meter;
+                    cur_entity->energy_share += norm_energy_meter;
+                    cur_entity->charged += charge;
+                }
 
-                rb_tree.insert({cur_entity->vruntime, cur_entity});
+                requeue_entity(d, cur_entity);
             } else {
-                get_total_weight(total_weight);
-                compute_entity_schedule_slices();
+                dequeue_entity(d, cur_entity);
             }
         }
+        auto quantum = d.num_quanta.fetch_add(1);
 
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
                 std::chrono::steady_clock::now() - start_t).count();
         cur_entity->runtime += duration;
-        LOG(INFO) << "Entity <" << cur_entity->eid << "> runtime: " << cur_entity->runtime << " µs "
-                  << "Time used this quantum: " << duration << " µs "<< "Frequency: " << model->freq;
-
+        tracer.record(util::QuantumEnd, cur_entity->eid, duration);
+        if (log_every_n > 0 && quantum % log_every_n == 0)
+            LOG(INFO) << "Device " << d.index << " entity <" << cur_entity->eid << "> runtime: "
+                      << cur_entity->runtime << " µs " << "Time used this quantum: " << duration << " µs "
+                      << "Frequency: " << d.cur_freq;
+
+        // Steps are short so that the tasks completing the batch, and tasks of other entities, are picked up
+        if (holding)
+            std::this_thread::sleep_until(std::min(hold_until, std::chrono::steady_clock::now() +
+                                                               std::chrono::microseconds(max_idle_spin)));
     }
 
     Status EFairScheduler::run() {
-        if (scheduler_thread.get() != nullptr) {
+        if (!_shutdown.load()) {
             LOG(ERROR) << "The scheduler has ran.";
             return Status::Fail;
         }
 
         this->_shutdown.store(false);
-        scheduler_thread.reset(new std::thread([this] {
-            while (true) {
-                this->loop_body();
-                if (this->_shutdown.load()) return;
-            }
-        }));
+        run_start_t = std::chrono::steady_clock::now();
+        for (auto &dispatcher : dispatchers){
+            auto &d = *dispatcher;
+            d.thread.reset(new std::thread([this, &d] {
+                tracer.set_thread_name("dispatcher " + std::to_string(d.index));
+
+                // TVM thread pools belong to the calling thread, so each CPU device gets its own group of workers
+                auto *config_threadpool = tvm::runtime::Registry::Get("runtime.config_threadpool");
+                if (cpu_threads > 0 && d.dev.device_type == kDLCPU && config_threadpool != nullptr)
+                    (*config_threadpool)(1, static_cast<int>(cpu_threads));
+
+                while (true) {
+                    this->wait_for_work(d);
+                    if (this->_shutdown.load()) return;
+                    this->loop_body(d);
+                }
+            }));
+
+            if (input_staging)
+                d.stager.reset(new std::thread([this, &d] {
+                    tracer.set_thread_name("stager " + std::to_string(d.index));
+                    this->stage_inputs(d);
+                }));
+        }
 
-        LOG(INFO) << "Scheduler started";
+        LOG(INFO) << "Scheduler started on " << dispatchers.size() << " devices";
         return Status::Succeed;
     }
 
-    Status EFairScheduler::shutdown() {
-        _shutdown.store(true);
+    Status EFairScheduler::set_idle_mode(IdleMode mode, MicroSeconds max_spin) {
+        if (!_shutdown.load())
+            return Status::Fail;
 
-        LOG(INFO) << "Stopping scheduler...";
-        fc.shutdown();
-        scheduler_thread->join();
+        idle_mode = mode;
+        max_idle_spin = max_spin;
+        for (auto &d : dispatchers){
+            d->idle_spin = max_spin;
+        }
+        return Status::Succeed;
+    }
 
-        LOG(INFO) << "Scheduler has stopped.";
+    Status EFairScheduler::get_idle_stats(size_t device, size_t &num_parks, bool &parked) {
+        if (device >= dispatchers.size())
+            return Status::NotFound;
+
+        num_parks = dispatchers[device]->num_parks.load();
+        parked = dispatchers[device]->parked.load();
         return Status::Succeed;
     }
 
-    Status EFairScheduler::summary_task_by_model() {
-        std::unique_lock<std::mutex> t_lock(task_pool_lock);
+    void EFairScheduler::wait_for_work(Dispatcher &d) {
+        if (has_work(d) || idle_mode == IdleMode::BusyPoll)
+            return;
+
+        // Work tends to arrive in bursts, so spin a while before paying for a sleep and a wakeup. The spin doubles
+        // when it catches work and halves when it runs out, within [max_idle_spin / 16, max_idle_spin].
+        auto spin_end = std::chrono::steady_clock::now() + std::chrono::microseconds(d.idle_spin);
+        while (std::chrono::steady_clock::now() < spin_end){
+            if (has_work(d) || can_steal(d) || _shutdown.load()){
+                d.idle_spin = std::min(d.idle_spin * 2 + 1, max_idle_spin);
+                return;
+            }
+            std::this_thread::yield();
+        }
+        d.idle_spin = std::max(d.idle_spin / 2, max_idle_spin / 16);
+
+        // parked is set before the last check so that new_task and busy peers either see it or their work is seen
+        std::unique_lock<std::mutex> lock(d.idle_lock);
+        d.parked.store(true);
+        d.num_parks++;
+        d.idle_cv.wait(lock, [this, &d] { return has_work(d) || can_steal(d) || _shutdown.load(); });
+        d.parked.store(false);
+    }
 
-        std::map<ModelID, MicroSeconds> time_stat;
-        std::map<ModelID, MicroJoule> energy_stat;
+    void EFairScheduler::wake_dispatcher(Dispatcher &d) {
+        if (!d.parked.load())
+            return;
 
-        for (auto const & [tid, task] : task_pool){
-            if (task->status != TaskState::Finished)
-                continue;
+        std::unique_lock<std::mutex> lock(d.idle_lock);
+        d.idle_cv.notify_one();
+    }
 
-            if (time_stat.find(task->mid) == time_stat.end())
-                time_stat.insert({task->mid, task->service_time});
-            else
-                time_stat[task->mid] += task->service_time;
+    void EFairScheduler::wake_idle_peer(const Dispatcher &d) {
+        for (auto &other : dispatchers){
+            if (other.get() != &d && other->parked.load()){
+                wake_dispatcher(*other);
+                return;
+            }
+        }
+    }
 
-            if (energy_stat.find(task->mid) == energy_stat.end())
-                energy_stat.insert({task->mid, task->energy_used});
-            else
-                energy_stat[task->mid] += task->energy_used;
+    Status EFairScheduler::shutdown() {
+        _shutdown.store(true);
+        for (auto &d : dispatchers){
+            std::unique_lock<std::mutex> lock(d->idle_lock);
+            d->idle_cv.notify_one();
         }
 
-        LOG(INFO) << "Time usage: ";
-        for (const auto & [mid, t] : time_stat){
-            LOG(INFO) << "Model# " << mid << ": " << t << " µs\t Frequency " << model_pool[mid]->freq;
+        LOG(INFO) << "Stopping scheduler...";
+        bool frequency_control = false;
+        for (auto &d : dispatchers){
+            if (d->thread != nullptr)
+                d->thread->join();
+            d->thread.reset();
+            frequency_control = frequency_control || d->fc != nullptr;
+
+            {
+                std::unique_lock<std::mutex> lock(d->stage_lock);
+                d->stage_cv.notify_all();
+            }
+            if (d->stager != nullptr)
+                d->stager->join();
+            d->stager.reset();
         }
 
-        LOG(INFO) << "Energy usage: ";
-        for (const auto & [mid, e] : energy_stat){
-            LOG(INFO) << "Model# " << mid << ": " << e << " µJ\t Frequency " << model_pool[mid]->freq;
+        if (frequency_control){
+            size_t num_switches, num_avoided;
+            MicroSeconds switch_time;
+            double switches_per_second;
+            get_frequency_stats(num_switches, switch_time, switches_per_second, num_avoided);
+            LOG(INFO) << "Frequency switches: " << num_switches << " (" << switches_per_second << "/s), "
+                      << switch_time << " µs switching, " << num_avoided << " avoided by grouping";
+            for (auto &d : dispatchers){
+                if (d->fc != nullptr)
+                    d->fc->shutdown();
+            }
+        }
+
+        for (size_t i = 0; i < dispatchers.size(); i++){
+            size_t num_overruns, num_yields;
+            MicroSeconds overrun_time, max_overrun;
+            get_overrun_stats(i, num_overruns, overrun_time, max_overrun, num_yields);
+            LOG(INFO) << "Device " << i << " overran " << num_overruns << " of " << dispatchers[i]->num_quanta.load()
+                      << " quanta by " << overrun_time << " µs in total, " << max_overrun << " µs at most, "
+                      << num_yields << " quanta ended early";
+        }
+
+        for (size_t i = 0; i < dispatchers.size(); i++){
+            if (input_staging)
+                LOG(INFO) << "Device " << i << " staged the inputs of " << dispatchers[i]->num_staged.load()
+                          << " tasks ahead, " << dispatchers[i]->num_stage_waits.load()
+                          << " of them were still being staged when they started";
+            auto num_batches = dispatchers[i]->num_batches.load();
+            if (num_batches > 0)
+                LOG(INFO) << "Device " << i << " ran " << dispatchers[i]->num_batched_tasks.load() << " tasks in "
+                          << num_batches << " batches";
         }
 
+        entities.for_each([](ScheduleEntity *entity) {
+            if (entity->relative_deadline > 0)
+                LOG(INFO) << "Real-time entity <" << entity->eid << "> missed " << entity->num_deadline_misses.load()
+                          << " of " << entity->num_deadline_tasks.load() << " deadlines";
+        });
+
+        LOG(INFO) << "Scheduler has stopped.";
         return Status::Succeed;
     }
 
-    Status EFairScheduler::export_task_data(const std::string &path) {
-        std::ofstream out_file(path);
+    Status EFairScheduler::summary_task_by_model() {
+        // Totals are kept as tasks finish, so this does not depend on how many tasks have run
+        auto totals = task_history.get_model_totals();
 
-        if (!out_file.is_open()){
-            LOG(ERROR) << "Cannot save task data to file " << path;
-            exit(1);
-        }
+        std::unique_lock<std::mutex> lock(model_pool_lock);
+        auto freq_of = [this](ModelID mid) {
+            auto it = model_pool.find(mid);
+            return it != model_pool.end() ? it->second->freq : std::string("unloaded");
+        };
 
-        // Find the minimum start time
-        auto min_time = std::chrono::steady_clock::now();
-        for (const auto & [tid, task]: task_pool){
-            if (task->status == TaskState::Finished && task->start_t < min_time){
-                min_time = task->start_t;
-            }
+        LOG(INFO) << "Time usage: ";
+        for (const auto & [mid, t] : totals){
+            LOG(INFO) << "Model# " << mid << ": " << t.service_time << " µs\t Frequency " << freq_of(mid);
         }
 
-        out_file << "task_id,entity_id,model_id,start_t,end_t,service_time,energy_used\n";
-
-        for (const auto & [tid, task]: task_pool){
-            if (task->status == TaskState::Finished){
-                out_file << task->tid << "," << task->eid << "," << task->mid << "," <<
-                std::chrono::duration_cast<std::chrono::microseconds>(task->start_t-min_time).count() << "," <<
-                std::chrono::duration_cast<std::chrono::microseconds>(task->end_t-min_time).count() << "," <<
-                task->service_time << "," << task->energy_used << "\n";
-            }
+        LOG(INFO) << "Energy usage: ";
+        for (const auto & [mid, t] : totals){
+            LOG(INFO) << "Model# " << mid << ": " << t.energy_used << " µJ\t Frequency " << freq_of(mid);
         }
-        out_file.close();
 
         return Status::Succeed;
     }
+
+    Status EFairScheduler::export_task_data(const std::string &path) {
+        return task_history.export_csv(path);
+    }
 }   // namespace scheduler
 }   // namespace efair
\ No newline at end of file
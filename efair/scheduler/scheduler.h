@@ -7,16 +7,27 @@
 
 #include <vector>
 #include <list>
+#include <deque>
 #include <string>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <thread>
 #include <map>
 #include <tvm/runtime/device_api.h>
 
 #include "executor/executor.h"
+#include "executor/executor_pool.h"
+#include "executor/model_cache.h"
+#include "scheduler/registry.h"
+#include "scheduler/run_queue.h"
+#include "scheduler/slice_solver.h"
+#include "scheduler/submission_queue.h"
+#include "scheduler/task_history.h"
 #include "util/chfreq.h"
+#include "util/object_slab.h"
+#include "util/trace.h"
 #include "util/common.h"
 
 namespace efair {
@@ -30,37 +41,172 @@ namespace scheduler {
             Finished
         };
 
+        // BusyPoll keeps polling the run queue while idle, SpinThenPark polls briefly and then sleeps until woken
+        enum IdleMode {
+            BusyPoll,
+            SpinThenPark
+        };
+
+        // PerKernel dispatches one kernel per call, KernelRange dispatches the longest run that fits the quantum
+        enum DispatchMode {
+            PerKernel,
+            KernelRange
+        };
+
+        // What happens to a kernel run that the profile says would end past the quantum. Overrun dispatches it anyway,
+        // Yield ends the quantum before it unless nothing has run yet, Borrow dispatches it and takes the overrun out
+        // of the next quantum of the entity, up to half of it each time.
+        enum QuantumFit {
+            Overrun,
+            Yield,
+            Borrow
+        };
+
+        // TimeSlice advances vruntime by the share of the slice used. Hybrid also gives each entity an energy bucket,
+        // refilled by alpha * slice * max_power every quantum and holding up to twice that, ends the quantum when
+        // either runs out and advances vruntime by the larger of the time and energy shares.
+        enum VRuntimeMode {
+            TimeSlice,
+            Hybrid
+        };
+
+        // Input of a task that is read in place when the task starts, data must stay valid until wait_task returns
+        struct TaskInput {
+            std::string key;
+            const void *data;
+            size_t size;
+        };
+
+        // Buffer that output idx of a task is copied into when the task finishes, valid until wait_task returns
+        struct TaskOutput {
+            size_t idx;
+            void *data;
+            size_t size;
+        };
+
         EFairScheduler(MicroSeconds total_quantum_size, double alpha, tvm::Device device);
+        // One dispatcher thread, run queue and quantum per device, entities are spread over them when created
+        EFairScheduler(MicroSeconds total_quantum_size, double alpha, const std::vector<tvm::Device> &devices);
         ~EFairScheduler() = default;
 
         Status load_model(const std::string model_path, const std::string profile_path, const EntityID eid,
                           const std::string freq, ModelID &mid);
+        // Instead of a fixed frequency, the model runs at the frequency with the least energy per task among those
+        // meeting latency_target given the share of the device the entity gets, re-planned as the shares change
+        Status load_model_with_latency_target(const std::string model_path, const std::string profile_path,
+                                              const EntityID eid, const MicroSeconds latency_target, ModelID &mid);
+        Status get_model_frequency(const ModelID mid, std::string &freq);
+        // The same model compiled for batch_size inputs at once, with inputs and outputs batch_size times as large.
+        // Queued tasks of the model are then run together on the largest variant there are enough of them for.
+        Status add_batch_variant(const ModelID mid, size_t batch_size, const std::string model_path,
+                                 const std::string profile_path);
+        Status unload_model(const ModelID mid);
+        Status set_model_memory_budget(size_t budget);
         Status create_entity(Priority priority, EntityID &eid);
+        // Entity of the real-time class, each task must finish within relative_deadline of its submission. Tasks
+        // arrive at most once per period, which defaults to the deadline, and the models loaded for the entity are
+        // admitted only if their profiled cost meets the deadline and fits the real-time bandwidth of the device.
+        Status create_realtime_entity(MicroSeconds relative_deadline, MicroSeconds period, EntityID &eid);
+        Status set_realtime_bandwidth(double max_bandwidth);
+        Status get_deadline_stats(const EntityID eid, size_t &num_tasks, size_t &num_misses);
         Status set_input(const ModelID &mid, const std::string &key, const void *input_data, size_t size);
         Status set_entity_priority(const EntityID eid, const Priority priority);
+        // Only one waiter consumes a task. Other waiters, and waiters of a reclaimed task, get its record from the
+        // task history instead, or NotFound once the history has let it go.
         Status wait_task(const TaskID &tid);
+        Status wait_task(const TaskID &tid, TaskRecord &record);
         Status new_task(const ModelID mid, TaskID &tid);
+        Status new_task(const ModelID mid, const std::vector<TaskInput> &inputs, TaskID &tid);
+        Status new_task(const ModelID mid, const std::vector<TaskInput> &inputs, const std::vector<TaskOutput> &outputs,
+                        TaskID &tid);
+        Status set_executor_instances(size_t num_instances);
+        // The dispatchers read the scheduling settings below without a lock, so setting them fails while running
+        Status set_dispatch_mode(DispatchMode mode);
+        Status set_vruntime_mode(VRuntimeMode mode);
+        // Shares of the slice and of the bucket refill used by the quanta of a fair entity, and the vruntime charged
+        Status get_vruntime_stats(const EntityID eid, VRuntime &time_share, VRuntime &energy_share, VRuntime &charged);
+        Status set_quantum_fit(QuantumFit mode);
+        Status get_overrun_stats(size_t device, size_t &num_overruns, MicroSeconds &overrun_time,
+                                 MicroSeconds &max_overrun, size_t &num_yields);
+        // A partial batch at the head of the only runnable entity waits up to max_delay from its first submission
+        Status set_batch_delay(MicroSeconds max_delay);
+        Status get_batching_stats(size_t device, size_t &num_batches, size_t &num_batched_tasks);
+        // Each device gets a worker that copies the inputs of the next task of the running entity to the device, on
+        // a stream of its own, while the current task runs. The two tasks hold two instances of the model.
+        Status set_input_staging(bool enabled);
+        Status get_staging_stats(size_t device, size_t &num_staged, size_t &num_waits);
+        Status set_kernel_timing(bool enabled);
+        Status set_idle_mode(IdleMode mode, MicroSeconds max_spin);
+        Status get_idle_stats(size_t device, size_t &num_parks, bool &parked);
+        Status set_profile_correction(double ewma_alpha, double deviation_threshold);
+        Status save_profiles(const std::string &dir);
+        Status set_task_history(size_t capacity, const std::string &spill_path);
+        // Finished tasks nobody waits on are reclaimed, oldest first, once more than max_unwaited are held
+        Status set_unwaited_task_limit(size_t max_unwaited);
+        Status get_task_stats(size_t &num_live, size_t &num_reclaimed);
+        Status set_cpu_threads(size_t threads_per_device);
+        size_t get_num_devices() const { return dispatchers.size(); }
+        Status get_dispatcher_stats(size_t device, size_t &num_quanta, size_t &num_steals);
+        Status set_frequency_grouping(VRuntime max_lag);
+        // Each GPU device has its own frequency; the first one defaults to DEVFREQ_DIR, others have none until set
+        Status set_devfreq_dir(size_t device, const std::string &devfreq_dir);
+        Status set_tracing(bool enabled);
+        Status export_trace(const std::string &path);
+        Status set_hot_path_logging(size_t every_n);
+        // Switches are the frequency changes dispatchers asked for, avoided ones are quanta that grouping ran at the
+        // current frequency when the earliest entity would have changed it. Switch time is spent by controllers.
+        Status get_frequency_stats(size_t &num_switches, MicroSeconds &switch_time, double &switches_per_second,
+                                   size_t &num_switches_avoided);
+        Status get_task_timestamps(const TaskID tid, std::vector<std::chrono::steady_clock::time_point> &timestamps);
         Status summary_task_by_model();
         Status export_task_data(const std::string &path);
         Status run();
         Status shutdown();
 
     private:
+        struct Model;
+        struct ModelVariant;
+        struct ScheduleEntity;
+
+        // Who binds the executor of a task: the stager, which is Staging and then Staged it, or the dispatcher
+        enum InputStage {
+            Unstaged,
+            Staging,
+            Staged,
+            Bound
+        };
 
+        // Tasks are recycled through task_slab once wait_task has consumed their completion
         struct Task {
             friend EFairScheduler;
         private:
             ModelID mid;
             EntityID eid;
-            TaskID tid;
+            std::atomic<TaskID> tid;                        // read by registry lookups while the slot is recycled
             KernelIdx kernel_idx;
-            TaskState status;
+            std::atomic<TaskState> status;
+            Model *model;
+            ScheduleEntity *entity;
+            Task *next;                                     // link in the submission queue
+            std::shared_ptr<executor::Executor> executor;   // instance bound when the task starts
+            std::shared_ptr<executor::ExecutorPool> executor_pool;
+            std::vector<TaskInput> borrowed_inputs;
+            std::vector<std::pair<std::string, tvm::runtime::NDArray>> staged_inputs;
+            std::vector<TaskOutput> outputs;
+            ModelVariant *variant;                          // batched variant the task runs on, if any
+            std::vector<Task *> batch;                      // tasks running with it on the variant, in slice order
+            std::atomic<InputStage> input_stage;
+            bool stage_requested;                           // handed to the stager, dispatcher thread only
+            Status stage_status;
+            bool consumed;                                  // completion taken by a waiter or reclaimed, under lock
             std::mutex lock;
             std::condition_variable cv;
 
             std::chrono::steady_clock::time_point submit_t, start_t, end_t;
+            std::chrono::steady_clock::time_point deadline;  // real-time class only
             efair::MicroSeconds service_time;   // service time from profile
             efair::MicroJoule energy_used;      // energy usage from profile
+            efair::MicroSeconds measured_time;  // service time measured on the executor stream, if timing is on
 
         public:
             bool is_finished() const;
@@ -74,10 +220,44 @@ namespace scheduler {
             ModelID mid;
             EntityID eid;
             std::string freq;
-            std::shared_ptr<executor::Executor> executor;
+            FreqIdx freq_idx;
+            std::string model_path;
+            std::string profile_path;
+            std::shared_ptr<executor::ExecutorPool> executors;   // shared through the model cache, for metadata
             size_t num_kernels;
+
+            // Pool per device, opened through the model cache the first time the model runs there
+            std::mutex executors_lock;
+            std::vector<std::shared_ptr<executor::ExecutorPool>> device_executors;
+
+            // Inputs staged by set_input, consumed by the next task of this model
+            std::mutex input_lock;
+            std::vector<std::pair<std::string, tvm::runtime::NDArray>> pending_inputs;
             MilliWatt max_power;
             MilliWatt power;
+            MicroSeconds latency_target;                    // 0 for a fixed frequency
+            std::vector<std::string> frequencies;           // profiled frequencies, by FreqIdx
+            double rt_bandwidth;                            // share of the device admitted for it, real-time only
+
+            // Batched variants by increasing batch size, under executors_lock
+            std::vector<std::unique_ptr<ModelVariant>> variants;
+
+            // Unfinished tasks, and whether unload_model took the model away; new_task checks both under task_lock
+            std::mutex task_lock;
+            size_t num_live_tasks;
+            bool retiring;
+        };
+
+        struct ModelVariant {
+            friend EFairScheduler;
+        private:
+            size_t batch_size;
+            std::string model_path;
+            std::string profile_path;
+            std::shared_ptr<executor::ExecutorPool> executors;
+            std::vector<std::shared_ptr<executor::ExecutorPool>> device_executors;
+            size_t num_kernels;
+            std::vector<FreqIdx> freq_map;                  // FreqIdx in its profile, by FreqIdx of the model
         };
 
         struct ScheduleEntity {
@@ -86,44 +266,206 @@ namespace scheduler {
             EntityID eid;
             VRuntime vruntime;
             size_t weight;
-            std::mutex lock;
-            std::list<std::shared_ptr<Task>> fcfs_queue;
+            std::deque<Task *> fcfs_queue;                  // scheduler thread only
             MilliWatt max_power;
             MilliWatt avg_power;
             MicroSeconds runtime;
             MicroSeconds sched_slice;
+            MicroSeconds carry;                             // overrun still to be taken out of later quanta
+            MicroJoule energy_tokens;                       // left in the bucket of Hybrid mode
+            VRuntime time_share = 0;                        // totals of charged quanta, under the run queue lock
+            VRuntime energy_share = 0;
+            VRuntime charged = 0;
+            RunQueue<ScheduleEntity *>::Handle rq_handle;   // valid while runnable, into edf_queue if real-time
+            RunQueue<ScheduleEntity *>::Handle freq_handle; // in the queue of freq_class, while runnable
+            std::string freq_class;                         // frequency of the model of the next task
+            std::atomic<size_t> dispatcher;                 // owning dispatcher, changes under its run queue lock
+            std::atomic<size_t> num_staged{0};              // tasks handed to the stager, not stolen meanwhile
+            std::atomic<size_t> num_submitting{0};          // submitters between reading the owner and pushing
+
+            // Real-time class, relative_deadline is 0 for fair entities. Real-time entities stay on their device.
+            MicroSeconds relative_deadline;
+            MicroSeconds period;
+            std::atomic<size_t> num_deadline_tasks{0};
+            std::atomic<size_t> num_deadline_misses{0};
+        };
+
+        // Per-device scheduling state. Entity queues are only touched by the thread of the owning dispatcher.
+        // Fairness is kept per device, like per-CPU run queues in CFS: each device has its own vruntime clock,
+        // slices and quantum. Across devices, only the number of runnable entities is balanced: new entities go to
+        // the device owning the fewest, and a device pulls an entity with its lag behind the minimum from one that
+        // has at least two more runnable. Shares are not compared across devices.
+        struct Dispatcher {
+            Dispatcher(size_t index, tvm::Device dev, MicroSeconds total_quantum_size, double alpha) :
+                    index(index), dev(dev), slice_solver(total_quantum_size, alpha) {}
+
+            size_t index;
+            tvm::Device dev;
+            std::unique_ptr<std::thread> thread;
+            std::unique_ptr<util::FrequencyController> fc;  // GPU devices with a devfreq directory only
+
+            // New tasks, moved to their entities by the dispatcher thread at the start of each quantum. A steal
+            // takes the queue too, and hands back the tasks of the entities that stay in handed_back, under the
+            // run queue lock, to be moved ahead of anything submitted since.
+            SubmissionQueue<Task, &Task::next> submissions;
+            Task *handed_back = nullptr;
+            std::atomic_bool has_handed_back{false};
+            std::atomic<size_t> num_entities{0};            // owned, runnable or not, for placing new entities
+
+            std::mutex run_queue_lock;
+            RunQueue<ScheduleEntity *> run_queue;
+            std::unordered_map<std::string, RunQueue<ScheduleEntity *>> freq_queues;   // runnable entities by frequency
+            SliceSolver slice_solver;
+            ScheduleEntity *current = nullptr;              // entity being dispatched, never stolen
+
+            // Runnable real-time entities by the absolute deadline of their next task, run ahead of run_queue while
+            // the real-time budget of the current window lasts. rt_bandwidth is the admitted share of the device.
+            RunQueue<ScheduleEntity *> edf_queue;
+            double rt_bandwidth = 0;
+            MicroSeconds rt_budget = 0;                     // dispatcher thread only
+            std::chrono::steady_clock::time_point rt_window_start;
+
+            // Idle protocol, num_runnable mirrors the run queue sizes so that it can be polled without the lock.
+            // num_stealable counts the fair entities among them other than the current one, since real-time
+            // entities and the entity being dispatched stay on the device.
+            std::mutex idle_lock;
+            std::condition_variable idle_cv;
+            std::atomic_bool parked{false};
+            std::atomic<size_t> num_runnable{0};
+            std::atomic<size_t> num_stealable{0};
+            MicroSeconds idle_spin = 200;
+            std::atomic<size_t> num_parks{0};
+
+            std::atomic<size_t> num_quanta{0};
+            std::atomic<size_t> num_steals{0};
+            // Frequency the device was last set to, tracked without a controller too so that grouping works on any
+            // device; grouped_pick marks a quantum picked for running at it ahead of the earliest entity
+            std::string cur_freq;                           // dispatcher thread only
+            bool grouped_pick = false;
+            std::atomic<size_t> num_switches{0};
+            std::atomic<size_t> num_switches_avoided{0};
+
+            // Quanta whose profiled time ended past the slice, by how much in total and at most, and early ends
+            std::atomic<size_t> num_overruns{0};
+            std::atomic<MicroSeconds> overrun_time{0};
+            std::atomic<MicroSeconds> max_overrun{0};
+            std::atomic<size_t> num_yields{0};
+
+            std::atomic<size_t> num_batches{0};
+            std::atomic<size_t> num_batched_tasks{0};
+
+            // Tasks waiting for the stager of this device, which takes them in order
+            std::unique_ptr<std::thread> stager;
+            std::mutex stage_lock;
+            std::condition_variable stage_cv;
+            std::deque<Task *> stage_queue;
+            std::atomic<size_t> num_staged{0};
+            std::atomic<size_t> num_stage_waits{0};        // tasks started before the stager was done with them
+
+            // Frequencies of models with a latency target are planned again before the next quantum
+            std::atomic_bool replan{false};
         };
 
-        void loop_body(void);
-        Status get_total_weight(size_t &ret_weight);
+        Status load_model(const std::string model_path, const std::string profile_path, const EntityID eid,
+                          const std::string freq, const MicroSeconds latency_target, ModelID &mid);
+        void plan_frequencies(Dispatcher &d);
+        void loop_body(Dispatcher &d);
+        void wait_for_work(Dispatcher &d);
+        void drain_submissions(Dispatcher &d);
+        Task* take_submissions(Dispatcher &d);
+        bool has_work(const Dispatcher &d) const {
+            return d.num_runnable.load() > 0 || !d.submissions.empty() || d.has_handed_back.load();
+        }
+        bool is_stealable(const Dispatcher &d) const {
+            return d.num_stealable.load() > 0 && d.num_runnable.load() > 1;
+        }
+        // Whether d may take an entity from victim, which needs two more runnable so the pull never bounces back
+        bool can_steal_from(const Dispatcher &d, const Dispatcher &victim) const {
+            return &victim != &d && is_stealable(victim) && victim.num_runnable.load() > d.num_runnable.load() + 1;
+        }
+        bool can_steal(const Dispatcher &d) const;
+        bool steal_entity(Dispatcher &d);
+        void enqueue_entity(Dispatcher &d, ScheduleEntity *entity);
+        void dequeue_entity(Dispatcher &d, ScheduleEntity *entity);
+        void requeue_entity(Dispatcher &d, ScheduleEntity *entity);
+        ScheduleEntity* pick_entity(Dispatcher &d);
+        Status admit_realtime_model(Dispatcher &d, ScheduleEntity *entity, Model *model);
+        VRuntime get_deadline_key(const Task *task) const;
+        void refill_rt_budget(Dispatcher &d);
+        void wake_dispatcher(Dispatcher &d);
+        void wake_idle_peer(const Dispatcher &d);
         Status get_entity_avg_power(EntityID eid, MilliWatt &ret_avg_power);
-        Status compute_entity_schedule_slices();
+        void update_entity_slice(ScheduleEntity *entity);
+        Status get_task(const TaskID tid, Task *&ret_task);
+        Status get_executor_pool(Model *model, ModelVariant *variant, const Dispatcher &d,
+                                 std::shared_ptr<executor::ExecutorPool> &pool);
+        Status bind_executor(Task *task, Model *model, Dispatcher &d);
+        bool claim_task(Dispatcher &d, Task *task);
+        void request_staging(Dispatcher &d, Task *task);
+        void stage_inputs(Dispatcher &d);
+        Status stage_task(Dispatcher &d, Task *task, TVMStreamHandle stream);
+        Status bind_batch_inputs(Task *task, Model *model);
+        void release_executor(Task *task);
+        static bool same_input_keys(const Task *a, const Task *b);
+        bool hold_for_batch(const ScheduleEntity *entity, const Task *task,
+                            std::chrono::steady_clock::time_point &wait_until);
+        void form_batch(Dispatcher &d, ScheduleEntity *entity, Task *task);
+        Status copy_outputs(Task *task);
+        void finish_task(Task *task, bool realtime);
+        bool consume_task(Task *task, TaskID tid, TaskRecord *record);
+        void reclaim_unwaited();
 
         // attributes
-        std::mutex task_pool_lock, sched_entities_lock, model_pool_lock, rb_tree_lock;
+        std::mutex sched_entities_lock, model_pool_lock;
         ModelID model_cnt;
-        TaskID task_cnt;
+        std::atomic<TaskID> task_cnt;
         EntityID entity_cnt;
-        std::unique_ptr<std::thread> scheduler_thread;
         std::atomic_bool _shutdown;
-        std::multimap<VRuntime, std::shared_ptr<ScheduleEntity>> rb_tree;
-        size_t total_weight;
-        MicroSeconds min_sched_unit = 1000;
+        std::vector<std::unique_ptr<Dispatcher>> dispatchers;
+
+        IdleMode idle_mode = IdleMode::SpinThenPark;
+        MicroSeconds max_idle_spin = 200;
+        size_t cpu_threads = 0;
+        VRuntime max_freq_lag = 0;
+        double max_rt_bandwidth = 0.5;
+        size_t log_every_n = 0;
+        util::Tracer &tracer = util::Tracer::global();
+        std::chrono::steady_clock::time_point run_start_t;
+        size_t executors_per_model = 1;
+        DispatchMode dispatch_mode = DispatchMode::PerKernel;
+        VRuntimeMode vruntime_mode = VRuntimeMode::TimeSlice;
+        QuantumFit quantum_fit = QuantumFit::Overrun;
+        MicroSeconds max_batch_delay = 0;
+        bool input_staging = false;
+        bool kernel_timing = false;
+        double ewma_alpha = 0;
+        double deviation_threshold = 0.5;
 
         MicroSeconds total_quantum_size;
         double alpha;
 
-        tvm::Device dev;
+
+        // The maps own models and entities and are only used under their locks, lookups go through the registries.
+        // Unloaded models are kept in retired_models because a lookup racing with the unload may still return them.
         std::unordered_map<ModelID, std::shared_ptr<Model>> model_pool;
+        std::vector<std::shared_ptr<Model>> retired_models;
         std::unordered_map<EntityID, std::shared_ptr<ScheduleEntity>> sched_entities;
-        std::unordered_map<TaskID, std::shared_ptr<Task>> task_pool;
+        ConcurrentRegistry<Model, &Model::mid> models;
+        ConcurrentRegistry<ScheduleEntity, &ScheduleEntity::eid> entities;
 
-        util::FrequencyController fc;
+        // Tasks that are submitted or finished but not yet waited on, finished ones move to task_history
+        ConcurrentRegistry<Task, &Task::tid> tasks;
+        util::ObjectSlab<Task> task_slab;
+        TaskHistory task_history;
 
-        static const std::unordered_map<Priority, size_t> priority_map;
+        // Finished tasks in finishing order, including ones since waited on, bounded by max_unwaited_tasks
+        std::mutex unwaited_lock;
+        std::deque<std::pair<Task *, TaskID>> unwaited_tasks;
+        size_t max_unwaited_tasks = 4096;
+        std::atomic<size_t> num_reclaimed{0};
 
-    public:
-        Status get_task(const TaskID tid, std::shared_ptr<Task> &ret_task);
+
+        static const std::unordered_map<Priority, size_t> priority_map;
     };
 
 }   // namespace scheduler
@@ -0,0 +1,87 @@
+//
+// Created by Qianlin Liang on 4/21/23.
+//
+
+#include <algorithm>
+
+#include "scheduler/slice_solver.h"
+
+namespace efair {
+namespace scheduler {
+
+    SliceSolver::SliceSolver(MicroSeconds total_quantum_size, double alpha) :
+            total_quantum_size(total_quantum_size), alpha(alpha) {}
+
+    void SliceSolver::add(EntityID eid, size_t weight, MilliWatt power) {
+        insert(eid, weight, power);
+        solve();
+    }
+
+    void SliceSolver::remove(EntityID eid) {
+        if (erase(eid))
+            solve();
+    }
+
+    void SliceSolver::update(EntityID eid, size_t weight, MilliWatt power) {
+        erase(eid);
+        insert(eid, weight, power);
+        solve();
+    }
+
+    void SliceSolver::insert(EntityID eid, size_t weight, MilliWatt power) {
+        Entry entry{power, weight, eid};
+        entities[eid] = entry;
+        total_weight += weight;
+
+        if (power == 0)
+            num_zero_power++;
+        else
+            by_power.insert(std::lower_bound(by_power.begin(), by_power.end(), entry), entry);
+    }
+
+    bool SliceSolver::erase(EntityID eid) {
+        auto it = entities.find(eid);
+        if (it == entities.end())
+            return false;
+
+        const auto &entry = it->second;
+        total_weight -= entry.weight;
+
+        if (entry.power == 0)
+            num_zero_power--;
+        else
+            by_power.erase(std::lower_bound(by_power.begin(), by_power.end(), entry));
+
+        entities.erase(it);
+        return true;
+    }
+
+    MicroSeconds SliceSolver::get_slice(size_t weight, MilliWatt power) const {
+        if (num_zero_power > 0){
+            double extra = power == 0 ? (1 - alpha) * total_quantum_size / num_zero_power : 0;
+            return static_cast<MicroSeconds>(weight * base + extra);
+        }
+
+        return static_cast<MicroSeconds>(weight * std::max(base, level / power));
+    }
+
+    void SliceSolver::solve() {
+        base = total_weight > 0 ? alpha * total_quantum_size / total_weight : 0;
+        level = 0;
+        if (num_zero_power > 0 || by_power.empty())
+            return;
+
+        // Raise the lowest powered entities one by one until the level stops short of the next entity's base share
+        double rest_weight = total_weight, weight_per_power = 0;
+        for (size_t m = 0; m < by_power.size(); m++){
+            rest_weight -= by_power[m].weight;
+            weight_per_power += static_cast<double>(by_power[m].weight) / by_power[m].power;
+            level = (total_quantum_size - base * rest_weight) / weight_per_power;
+
+            if (m + 1 == by_power.size() || level <= base * by_power[m + 1].power)
+                break;
+        }
+    }
+
+}   // namespace scheduler
+}   // namespace efair
@@ -0,0 +1,77 @@
+//
+// Created by Qianlin Liang on 4/21/23.
+//
+
+#ifndef EFAIR_SLICE_SOLVER_H
+#define EFAIR_SLICE_SOLVER_H
+
+#include <vector>
+#include <unordered_map>
+
+#include "util/common.h"
+
+namespace efair {
+namespace scheduler {
+
+    /*
+     * Splits the quantum between runnable entities. Every entity first gets its weighted share of alpha * quantum;
+     * the remaining (1 - alpha) * quantum goes to the entities whose weighted energy, avg_power * slice / weight, is
+     * lowest, raising them to a common level. That level has a closed form once the entities are sorted by power, so
+     * the slice of entity i is
+     *
+     *   slice_i = weight_i * max(alpha * quantum / total_weight, level / power_i)
+     *
+     * and only the level and the total weight change when an entity joins or leaves. Entities drawing no power would
+     * absorb any amount at no energy cost, so when there are any they split the remainder equally instead.
+     *
+     * A join or leave is O(n), not O(log n): the entity goes into or out of a sorted vector, and the level is found
+     * again by scanning up to the first entity left at its base share. The base share moves with the total weight,
+     * so that cutoff can move anywhere. With the tens of entities a device runs, the contiguous scan costs less than
+     * keeping prefix sums in a balanced tree.
+     */
+    class SliceSolver {
+    public:
+        SliceSolver(MicroSeconds total_quantum_size, double alpha);
+        ~SliceSolver() = default;
+
+        void add(EntityID eid, size_t weight, MilliWatt power);
+        void remove(EntityID eid);
+        void update(EntityID eid, size_t weight, MilliWatt power);
+        bool contains(EntityID eid) const { return entities.find(eid) != entities.end(); }
+
+        MicroSeconds get_slice(size_t weight, MilliWatt power) const;
+        size_t size() const { return entities.size(); }
+
+    private:
+        struct Entry {
+            MilliWatt power;
+            size_t weight;
+            EntityID eid;
+
+            bool operator<(const Entry &other) const {
+                return power < other.power || (power == other.power && eid < other.eid);
+            }
+        };
+
+        void insert(EntityID eid, size_t weight, MilliWatt power);
+        bool erase(EntityID eid);
+        void solve();
+
+        MicroSeconds total_quantum_size;
+        double alpha;
+
+        // Entities drawing power, ascending by power
+        std::vector<Entry> by_power;
+        std::unordered_map<EntityID, Entry> entities;
+        size_t total_weight = 0;
+        size_t num_zero_power = 0;
+
+        // Solution: the base share per unit of weight and the common weighted energy level
+        double base = 0;
+        double level = 0;
+    };
+
+}   // namespace scheduler
+}   // namespace efair
+
+#endif //EFAIR_SLICE_SOLVER_H
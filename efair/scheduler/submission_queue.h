@@ -0,0 +1,59 @@
+//
+// Created by Qianlin Liang on 4/26/23.
+//
+
+#ifndef EFAIR_SUBMISSION_QUEUE_H
+#define EFAIR_SUBMISSION_QUEUE_H
+
+#include <atomic>
+
+namespace efair {
+namespace scheduler {
+
+    /*
+     * Lock-free multi-producer single-consumer queue threaded through the items themselves by their Next member.
+     * Producers push with a single compare-and-swap on the head; the consumer takes everything queued so far with one
+     * exchange and reverses it into submission order. The consumer never waits for a producer, and since it only ever
+     * takes the whole list there is no ABA hazard on the head.
+     */
+    template<typename T, T *T::*Next>
+    class SubmissionQueue {
+    public:
+        SubmissionQueue() = default;
+        SubmissionQueue(const SubmissionQueue &) = delete;
+        SubmissionQueue& operator=(const SubmissionQueue &) = delete;
+        ~SubmissionQueue() = default;
+
+        // Returns true if the queue was empty, which is when the consumer may need a wakeup
+        bool push(T *item) {
+            T *head = _head.load(std::memory_order_relaxed);
+            do {
+                item->*Next = head;
+            } while (!_head.compare_exchange_weak(head, item, std::memory_order_seq_cst,
+                                                  std::memory_order_relaxed));
+            return head == nullptr;
+        }
+
+        // Everything pushed so far, oldest first and linked by Next, or nullptr. Consumer only.
+        T* drain() {
+            T *item = _head.exchange(nullptr, std::memory_order_acquire);
+            T *ordered = nullptr;
+            while (item != nullptr){
+                T *next = item->*Next;
+                item->*Next = ordered;
+                ordered = item;
+                item = next;
+            }
+            return ordered;
+        }
+
+        bool empty() const { return _head.load() == nullptr; }
+
+    private:
+        std::atomic<T *> _head{nullptr};
+    };
+
+}   // namespace scheduler
+}   // namespace efair
+
+#endif //EFAIR_SUBMISSION_QUEUE_H
@@ -0,0 +1,172 @@
+//
+// Created by Qianlin Liang on 4/25/23.
+//
+
+#include <cstdio>
+#include <stdexcept>
+
+#include "scheduler/task_history.h"
+
+namespace efair {
+namespace scheduler {
+
+    static long long to_us(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+    }
+
+    TaskHistory::TaskHistory(size_t capacity) : capacity(capacity) {
+        if (capacity == 0)
+            throw std::runtime_error("Task history needs room for at least one task");
+        ring.reserve(capacity);
+    }
+
+    Status TaskHistory::set_capacity(size_t capacity) {
+        if (capacity == 0)
+            return Status::Fail;
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        // Oldest first, so that whatever does not fit goes out the same way as on add
+        std::vector<TaskRecord> ordered;
+        ordered.reserve(capacity);
+        for (size_t i = 0; i < ring.size(); i++){
+            auto &record = ring[(head + i) % ring.size()];
+            if (ring.size() - i > capacity)
+                spill(record);
+            else
+                ordered.push_back(record);
+        }
+
+        ring.swap(ordered);
+        ring.reserve(capacity);
+        this->capacity = capacity;
+        head = 0;
+
+        index.clear();
+        for (size_t i = 0; i < ring.size(); i++){
+            index[ring[i].tid] = i;
+        }
+        return Status::Succeed;
+    }
+
+    Status TaskHistory::set_spill_file(const std::string &path) {
+        std::unique_lock<std::mutex> guard(lock);
+
+        spill_file.close();
+        spill_path.clear();
+        num_spilled = 0;
+        if (path.empty())
+            return Status::Succeed;
+
+        spill_file.open(path, std::ios::trunc);
+        if (!spill_file.is_open()){
+            LOG(ERROR) << "Cannot open task spill file " << path;
+            return Status::Fail;
+        }
+
+        spill_path = path;
+        return Status::Succeed;
+    }
+
+    void TaskHistory::add(const TaskRecord &record) {
+        std::unique_lock<std::mutex> guard(lock);
+
+        auto &totals = model_totals[record.mid];
+        totals.num_tasks++;
+        totals.service_time += record.service_time;
+        totals.energy_used += record.energy_used;
+        if (record.start_t < min_start_t)
+            min_start_t = record.start_t;
+
+        if (ring.size() < capacity){
+            index[record.tid] = ring.size();
+            ring.push_back(record);
+            return;
+        }
+
+        spill(ring[head]);
+        index.erase(ring[head].tid);
+        ring[head] = record;
+        index[record.tid] = head;
+        head = (head + 1) % capacity;
+    }
+
+    Status TaskHistory::find(TaskID tid, TaskRecord &record) {
+        std::unique_lock<std::mutex> guard(lock);
+
+        auto it = index.find(tid);
+        if (it == index.end())
+            return Status::NotFound;
+
+        record = ring[it->second];
+        return Status::Succeed;
+    }
+
+    std::map<ModelID, TaskHistory::ModelTotals> TaskHistory::get_model_totals() {
+        std::unique_lock<std::mutex> guard(lock);
+        return model_totals;
+    }
+
+    size_t TaskHistory::get_num_dropped() {
+        std::unique_lock<std::mutex> guard(lock);
+        return num_dropped;
+    }
+
+    Status TaskHistory::export_csv(const std::string &path) {
+        std::unique_lock<std::mutex> guard(lock);
+
+        std::ofstream out_file(path);
+        if (!out_file.is_open()){
+            LOG(ERROR) << "Cannot save task data to file " << path;
+            return Status::Fail;
+        }
+
+        if (num_dropped > 0)
+            LOG(WARNING) << num_dropped << " oldest tasks were dropped from the history and are not exported";
+
+        auto min_t = to_us(min_start_t);
+        out_file << "task_id,entity_id,model_id,start_t,end_t,service_time,energy_used,measured_time\n";
+
+        if (num_spilled > 0){
+            spill_file.flush();
+            std::ifstream in_file(spill_path);
+            std::string line;
+            while (std::getline(in_file, line)){
+                unsigned long long tid, eid, mid, service_time, energy_used, measured_time;
+                long long submit_t, start_t, end_t;
+                if (std::sscanf(line.c_str(), "%llu,%llu,%llu,%lld,%lld,%lld,%llu,%llu,%llu", &tid, &eid, &mid,
+                                &submit_t, &start_t, &end_t, &service_time, &energy_used, &measured_time) != 9){
+                    LOG(ERROR) << "Malformed line in task spill file " << spill_path << ": " << line;
+                    return Status::Fail;
+                }
+
+                out_file << tid << "," << eid << "," << mid << "," << start_t - min_t << "," << end_t - min_t << ","
+                         << service_time << "," << energy_used << "," << measured_time << "\n";
+            }
+        }
+
+        for (size_t i = 0; i < ring.size(); i++){
+            auto &record = ring[(head + i) % ring.size()];
+            out_file << record.tid << "," << record.eid << "," << record.mid << "," << to_us(record.start_t) - min_t
+                     << "," << to_us(record.end_t) - min_t << "," << record.service_time << "," << record.energy_used
+                     << "," << record.measured_time << "\n";
+        }
+        out_file.close();
+
+        return Status::Succeed;
+    }
+
+    void TaskHistory::spill(const TaskRecord &record) {
+        if (!spill_file.is_open()){
+            num_dropped++;
+            return;
+        }
+
+        spill_file << record.tid << "," << record.eid << "," << record.mid << "," << to_us(record.submit_t) << ","
+                   << to_us(record.start_t) << "," << to_us(record.end_t) << "," << record.service_time << ","
+                   << record.energy_used << "," << record.measured_time << "\n";
+        num_spilled++;
+    }
+
+}   // namespace scheduler
+}   // namespace efair
@@ -0,0 +1,80 @@
+//
+// Created by Qianlin Liang on 4/25/23.
+//
+
+#ifndef EFAIR_TASK_HISTORY_H
+#define EFAIR_TASK_HISTORY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <fstream>
+
+#include "util/common.h"
+
+namespace efair {
+namespace scheduler {
+
+    // What is kept of a task after it finishes
+    struct TaskRecord {
+        TaskID tid;
+        EntityID eid;
+        ModelID mid;
+        std::chrono::steady_clock::time_point submit_t, start_t, end_t;
+        MicroSeconds service_time;
+        MicroJoule energy_used;
+        MicroSeconds measured_time;
+    };
+
+    /*
+     * Finished tasks in a ring of fixed capacity. When the ring is full the oldest record is appended to the spill
+     * file if there is one and dropped otherwise, so memory stays flat however long the scheduler runs. Per model
+     * totals cover every record ever added, including spilled and dropped ones.
+     */
+    class TaskHistory {
+    public:
+        struct ModelTotals {
+            size_t num_tasks = 0;
+            MicroSeconds service_time = 0;
+            MicroJoule energy_used = 0;
+        };
+
+        explicit TaskHistory(size_t capacity);
+        ~TaskHistory() = default;
+
+        Status set_capacity(size_t capacity);
+        Status set_spill_file(const std::string &path);
+
+        void add(const TaskRecord &record);
+        Status find(TaskID tid, TaskRecord &record);
+        std::map<ModelID, ModelTotals> get_model_totals();
+        size_t get_num_dropped();
+
+        // CSV of spilled and resident records, times in µs from the earliest start
+        Status export_csv(const std::string &path);
+
+    private:
+        void spill(const TaskRecord &record);
+
+        std::mutex lock;
+        std::vector<TaskRecord> ring;
+        size_t capacity;
+        size_t head = 0;    // oldest record once the ring is full
+        std::unordered_map<TaskID, size_t> index;     // slot of each resident record
+
+        std::string spill_path;
+        std::ofstream spill_file;
+        size_t num_spilled = 0;
+        size_t num_dropped = 0;
+
+        std::chrono::steady_clock::time_point min_start_t = std::chrono::steady_clock::time_point::max();
+        std::map<ModelID, ModelTotals> model_totals;
+    };
+
+}   // namespace scheduler
+}   // namespace efair
+
+#endif //EFAIR_TASK_HISTORY_H
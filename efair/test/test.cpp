@@ -2,21 +2,42 @@
 // Created by ubuntu on 3/1/23.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <gtest/gtest.h>
 #include <tvm/runtime/device_api.h>
 #include <tvm/runtime/registry.h>
 
 #include "util/common.h"
+#include "util/object_slab.h"
+#include "util/trace.h"
 #include "executor/executor.h"
+#include "executor/executor_pool.h"
+#include "executor/model_cache.h"
+#include "scheduler/registry.h"
+#include "scheduler/run_queue.h"
+#include "scheduler/slice_solver.h"
+#include "scheduler/submission_queue.h"
+#include "scheduler/task_history.h"
 #include "scheduler/scheduler.h"
 
 #define ASSERT_SUCC(expr) ASSERT_TRUE(expr == efair::Status::Succeed)
 
 #define RESNET18_LIB_PATH MODEL_DIR "/resnet18/resnet18.so"
 #define RESNET18_PROFILE_PATH MODEL_DIR "/resnet18/resnet18_profile.json"
+// resnet18 compiled for batches of 2 is not among the sample models, tests running it are skipped without it
+#define RESNET18_B2_LIB_PATH MODEL_DIR "/resnet18/resnet18_b2.so"
+#define RESNET18_B2_PROFILE_PATH MODEL_DIR "/resnet18/resnet18_b2_profile.json"
 #define RESNET50_LIB_PATH MODEL_DIR "/resnet50/resnet50.so"
 #define RESNET50_PROFILE_PATH MODEL_DIR "/resnet50/resnet50_profile.json"
 #define CHIHUAHUA_IMAGE_FILEPATH SAMPLE_DIR "/image_chihuahua.bytes"
@@ -65,6 +86,43 @@ protected:
         scheduler = std::make_shared<efair::scheduler::EFairScheduler>(40000, 1.0, dev);
     }
 
+    // Loads a model for a new entity on the scheduler, a real-time one if relative_deadline is set
+    static void load_entity(efair::scheduler::EFairScheduler &s, const std::string &model_freq, efair::EntityID &eid,
+                            efair::ModelID &mid, const std::string &lib_path = RESNET18_LIB_PATH,
+                            const std::string &profile_path = RESNET18_PROFILE_PATH,
+                            efair::MicroSeconds relative_deadline = 0){
+        if (relative_deadline > 0){
+            ASSERT_SUCC(s.create_realtime_entity(relative_deadline, 0, eid));
+        } else {
+            ASSERT_SUCC(s.create_entity(0, eid));
+        }
+        ASSERT_SUCC(s.load_model(lib_path, profile_path, eid, model_freq, mid));
+    }
+
+    // Queues num_rounds tasks of every model, taking the models in turn
+    static void queue_rounds(efair::scheduler::EFairScheduler &s, const std::vector<efair::ModelID> &mids,
+                             size_t num_rounds, std::vector<efair::TaskID> &tids){
+        for (size_t i = 0; i < num_rounds; i++){
+            for (auto mid : mids){
+                efair::TaskID tid;
+                ASSERT_SUCC(s.new_task(mid, tid));
+                tids.push_back(tid);
+            }
+        }
+    }
+
+    // Queues num_rounds tasks of every model, runs them to completion and stops the scheduler
+    static void run_rounds(efair::scheduler::EFairScheduler &s, const std::vector<efair::ModelID> &mids,
+                           size_t num_rounds){
+        std::vector<efair::TaskID> tids;
+        ASSERT_NO_FATAL_FAILURE(queue_rounds(s, mids, num_rounds, tids));
+        ASSERT_SUCC(s.run());
+        for (auto tid : tids){
+            ASSERT_SUCC(s.wait_task(tid));
+        }
+        ASSERT_SUCC(s.shutdown());
+    }
+
     tvm::Device dev;
     std::shared_ptr<efair::scheduler::EFairScheduler> scheduler;
     std::string freq;
@@ -99,6 +157,622 @@ TEST_F(SchedulerTest, schedulerOperations){
 }
 
 
+TEST_F(SchedulerTest, concurrentRegistration){
+    const size_t num_clients = 4, num_tasks = 20;
+    ASSERT_SUCC(scheduler->run());
+
+    // Every client registers its own entity and model while the others already have inference traffic running
+    std::atomic<size_t> failures{0};
+    std::vector<std::thread> clients;
+    for (size_t c = 0; c < num_clients; c++){
+        clients.emplace_back([&] {
+            efair::EntityID eid;
+            efair::ModelID mid;
+            if (scheduler->create_entity(0, eid) != efair::Status::Succeed ||
+                scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid) !=
+                efair::Status::Succeed){
+                failures++;
+                return;
+            }
+
+            for (size_t i = 0; i < num_tasks; i++){
+                efair::TaskID tid;
+                if (scheduler->new_task(mid, tid) != efair::Status::Succeed ||
+                    scheduler->wait_task(tid) != efair::Status::Succeed)
+                    failures++;
+            }
+        });
+    }
+
+    for (auto &t : clients){
+        t.join();
+    }
+    ASSERT_EQ(failures.load(), 0);
+    ASSERT_SUCC(scheduler->shutdown());
+}
+
+TEST_F(SchedulerTest, unloadWhileSubmitting){
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_SUCC(scheduler->create_entity(0, eid));
+    ASSERT_SUCC(scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid));
+    ASSERT_SUCC(scheduler->run());
+
+    // The client keeps submitting until the model is gone, every task it got in has to run to completion
+    std::atomic<size_t> failures{0}, num_submitted{0};
+    std::thread client([&] {
+        while (true){
+            efair::TaskID tid;
+            auto status = scheduler->new_task(mid, tid);
+            if (status == efair::Status::NotFound)
+                return;
+            if (status != efair::Status::Succeed || scheduler->wait_task(tid) != efair::Status::Succeed)
+                failures++;
+            num_submitted++;
+        }
+    });
+
+    while (num_submitted.load() == 0){
+        std::this_thread::yield();
+    }
+    while (scheduler->unload_model(mid) != efair::Status::Succeed){
+        std::this_thread::yield();
+    }
+    client.join();
+
+    efair::TaskID tid;
+    ASSERT_EQ(failures.load(), 0);
+    ASSERT_EQ(scheduler->new_task(mid, tid), efair::Status::NotFound);
+    ASSERT_EQ(scheduler->unload_model(mid), efair::Status::NotFound);
+    ASSERT_SUCC(scheduler->shutdown());
+}
+
+TEST_F(SchedulerTest, waitTaskOnce){
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_SUCC(scheduler->create_entity(0, eid));
+    ASSERT_SUCC(scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid));
+    ASSERT_SUCC(scheduler->run());
+
+    // Several waiters of one task all see it finish, but only one of them recycles it
+    const size_t num_waiters = 4;
+    for (size_t i = 0; i < 10; i++){
+        efair::TaskID tid;
+        ASSERT_SUCC(scheduler->new_task(mid, tid));
+
+        std::vector<efair::scheduler::TaskRecord> records(num_waiters);
+        std::vector<efair::Status> statuses(num_waiters);
+        std::vector<std::thread> waiters;
+        for (size_t w = 0; w < num_waiters; w++){
+            waiters.emplace_back([&, w](){ statuses[w] = scheduler->wait_task(tid, records[w]); });
+        }
+        for (auto &waiter : waiters){
+            waiter.join();
+        }
+        for (size_t w = 0; w < num_waiters; w++){
+            ASSERT_SUCC(statuses[w]);
+            ASSERT_EQ(records[w].tid, tid);
+        }
+    }
+
+    size_t num_live, num_reclaimed;
+    ASSERT_SUCC(scheduler->get_task_stats(num_live, num_reclaimed));
+    ASSERT_EQ(num_live, 0);
+    ASSERT_EQ(num_reclaimed, 0);
+    ASSERT_SUCC(scheduler->shutdown());
+}
+
+TEST_F(SchedulerTest, unwaitedTasksReclaimed){
+    ASSERT_SUCC(scheduler->set_unwaited_task_limit(2));
+
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_SUCC(scheduler->create_entity(0, eid));
+    ASSERT_SUCC(scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid));
+
+    std::vector<efair::TaskID> tids(6);
+    for (auto &tid : tids){
+        ASSERT_SUCC(scheduler->new_task(mid, tid));
+    }
+    ASSERT_SUCC(scheduler->run());
+
+    // Tasks of one entity finish in order, so only the last two are still held when the last one is waited on
+    ASSERT_SUCC(scheduler->wait_task(tids.back()));
+    size_t num_live, num_reclaimed;
+    ASSERT_SUCC(scheduler->get_task_stats(num_live, num_reclaimed));
+    ASSERT_EQ(num_reclaimed, 4);
+    ASSERT_EQ(num_live, 1);
+
+    // Reclaimed tasks can still be waited on through the history
+    efair::scheduler::TaskRecord record;
+    ASSERT_SUCC(scheduler->wait_task(tids.front(), record));
+    ASSERT_EQ(record.tid, tids.front());
+    ASSERT_SUCC(scheduler->shutdown());
+}
+
+TEST_F(SchedulerTest, multiDeviceStealing){
+    // Two CPU devices, with both busy entities created on the first one
+    std::vector<tvm::Device> devices = {{kDLCPU, 0}, {kDLCPU, 1}};
+    efair::scheduler::EFairScheduler multi(40000, 1.0, devices);
+    ASSERT_SUCC(multi.set_cpu_threads(1));
+    ASSERT_EQ(multi.get_num_devices(), 2);
+    // Frequency control is per GPU device, CPU devices have none
+    ASSERT_EQ(multi.set_devfreq_dir(1, "/tmp"), efair::Status::Fail);
+
+    std::vector<efair::ModelID> mids;
+    for (size_t e = 0; e < 4; e++){
+        efair::EntityID eid;
+        ASSERT_SUCC(multi.create_entity(0, eid));
+        if (eid % 2 == 0){
+            efair::ModelID mid;
+            ASSERT_SUCC(multi.load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid));
+            mids.push_back(mid);
+        }
+    }
+    ASSERT_NO_FATAL_FAILURE(run_rounds(multi, mids, 10));
+
+    // The idle device takes one of the entities and runs it on its own executors
+    size_t num_quanta, num_steals;
+    ASSERT_SUCC(multi.get_dispatcher_stats(1, num_quanta, num_steals));
+    ASSERT_GT(num_steals, 0);
+    ASSERT_GT(num_quanta, 0);
+    ASSERT_SUCC(multi.get_dispatcher_stats(0, num_quanta, num_steals));
+    ASSERT_GT(num_quanta, 0);
+}
+
+TEST_F(SchedulerTest, busyDeviceBalances){
+    // Placement alternates, so with the odd entities busy the second device has three runnable to the first's one.
+    // The quantum fits a whole task in every slice, so waiting entities have not started their next task and can move
+    std::vector<tvm::Device> devices = {{kDLCPU, 0}, {kDLCPU, 1}};
+    efair::scheduler::EFairScheduler multi(200000, 1.0, devices);
+    ASSERT_SUCC(multi.set_cpu_threads(1));
+
+    std::vector<efair::ModelID> mids;
+    for (size_t e = 0; e < 6; e++){
+        efair::EntityID eid;
+        ASSERT_SUCC(multi.create_entity(0, eid));
+        if (eid == 0 || eid % 2 == 1){
+            efair::ModelID mid;
+            ASSERT_SUCC(multi.load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid));
+            mids.push_back(mid);
+        }
+    }
+
+    // One round at a time, so the second device always has entities waiting behind the one it runs
+    ASSERT_SUCC(multi.run());
+    for (size_t i = 0; i < 5; i++){
+        std::vector<efair::TaskID> tids;
+        ASSERT_NO_FATAL_FAILURE(queue_rounds(multi, mids, 1, tids));
+        for (auto tid : tids){
+            ASSERT_SUCC(multi.wait_task(tid));
+        }
+    }
+
+    // The first device is busy too, but still evens out the number of runnable entities
+    size_t num_quanta, num_steals;
+    ASSERT_SUCC(multi.get_dispatcher_stats(0, num_quanta, num_steals));
+    ASSERT_GT(num_steals, 0);
+
+    // Submitted together, so entities may move while some of their tasks are still on the way to the old owner
+    std::vector<efair::TaskID> tids;
+    ASSERT_NO_FATAL_FAILURE(queue_rounds(multi, mids, 10, tids));
+
+    // Each model still starts its tasks in the order they were submitted
+    std::unordered_map<efair::ModelID, std::chrono::steady_clock::time_point> last_start;
+    efair::scheduler::TaskRecord record;
+    for (auto tid : tids){
+        ASSERT_SUCC(multi.wait_task(tid, record));
+        auto it = last_start.find(record.mid);
+        if (it != last_start.end())
+            ASSERT_LE(it->second, record.start_t);
+        last_start[record.mid] = record.start_t;
+    }
+    ASSERT_SUCC(multi.shutdown());
+}
+
+TEST_F(SchedulerTest, realtimeNotStolen){
+    // Two real-time entities busy on the first device, which keeps them, so the second one has nothing to take
+    std::vector<tvm::Device> devices = {{kDLCPU, 0}, {kDLCPU, 1}};
+    efair::scheduler::EFairScheduler multi(40000, 1.0, devices);
+    ASSERT_SUCC(multi.set_cpu_threads(1));
+    ASSERT_SUCC(multi.set_idle_mode(efair::scheduler::EFairScheduler::SpinThenPark, 100));
+    ASSERT_SUCC(multi.set_realtime_bandwidth(0.5));
+
+    // An idle fair entity between them takes the second device's turn in placement
+    std::vector<efair::ModelID> mids(2);
+    efair::EntityID eid;
+    ASSERT_NO_FATAL_FAILURE(load_entity(multi, freq, eid, mids[0], RESNET18_LIB_PATH, RESNET18_PROFILE_PATH,
+                                        100000000));
+    ASSERT_SUCC(multi.create_entity(0, eid));
+    ASSERT_NO_FATAL_FAILURE(load_entity(multi, freq, eid, mids[1], RESNET18_LIB_PATH, RESNET18_PROFILE_PATH,
+                                        100000000));
+    std::vector<efair::TaskID> tids;
+    ASSERT_NO_FATAL_FAILURE(queue_rounds(multi, mids, 10, tids));
+    ASSERT_SUCC(multi.run());
+
+    // The second device parks while the first still runs, instead of polling for an entity it cannot take
+    size_t num_parks = 0;
+    bool parked = false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!parked && std::chrono::steady_clock::now() < deadline){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ASSERT_SUCC(multi.get_idle_stats(1, num_parks, parked));
+    }
+    auto parked_t = std::chrono::steady_clock::now();
+    ASSERT_TRUE(parked);
+
+    efair::scheduler::TaskRecord record;
+    for (auto tid : tids){
+        ASSERT_SUCC(multi.wait_task(tid, record));
+    }
+    ASSERT_SUCC(multi.shutdown());
+    ASSERT_GT(record.end_t, parked_t);
+
+    size_t num_quanta, num_steals;
+    ASSERT_SUCC(multi.get_dispatcher_stats(1, num_quanta, num_steals));
+    ASSERT_EQ(num_steals, 0);
+    ASSERT_EQ(num_quanta, 0);
+}
+
+TEST_F(SchedulerTest, parkAndWake){
+    ASSERT_SUCC(scheduler->set_idle_mode(efair::scheduler::EFairScheduler::SpinThenPark, 100));
+
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_SUCC(scheduler->create_entity(0, eid));
+    ASSERT_SUCC(scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid));
+    ASSERT_SUCC(scheduler->run());
+
+    // With nothing queued the dispatcher stops spinning and sleeps
+    auto wait_parked = [&](size_t min_parks){
+        size_t num_parks = 0;
+        bool parked = false;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!(parked && num_parks >= min_parks) && std::chrono::steady_clock::now() < deadline){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            scheduler->get_idle_stats(0, num_parks, parked);
+        }
+        return parked && num_parks >= min_parks;
+    };
+    ASSERT_TRUE(wait_parked(1));
+
+    size_t num_parks;
+    bool parked;
+    ASSERT_SUCC(scheduler->get_idle_stats(0, num_parks, parked));
+
+    // A new task wakes it, and once the task is done it parks again
+    efair::TaskID tid;
+    ASSERT_SUCC(scheduler->new_task(mid, tid));
+    ASSERT_SUCC(scheduler->wait_task(tid));
+    ASSERT_TRUE(wait_parked(num_parks + 1));
+
+    ASSERT_SUCC(scheduler->shutdown());
+    ASSERT_TRUE(scheduler->get_idle_stats(1, num_parks, parked) == efair::Status::NotFound);
+}
+
+TEST_F(SchedulerTest, frequencyGrouping){
+    // Two entities at one frequency and one at another, run without and with grouping on the same device
+    auto run = [&](efair::VRuntime max_lag, size_t &num_switches, size_t &num_avoided){
+        efair::scheduler::EFairScheduler grouped(40000, 1.0, dev);
+        ASSERT_SUCC(grouped.set_frequency_grouping(max_lag));
+
+        std::vector<efair::ModelID> mids;
+        for (const std::string &model_freq : {freq, std::string("522750000"), freq}){
+            efair::EntityID eid;
+            efair::ModelID mid;
+            ASSERT_NO_FATAL_FAILURE(load_entity(grouped, model_freq, eid, mid));
+            mids.push_back(mid);
+        }
+        ASSERT_NO_FATAL_FAILURE(run_rounds(grouped, mids, 5));
+
+        efair::MicroSeconds switch_time;
+        double switches_per_second;
+        ASSERT_SUCC(grouped.get_frequency_stats(num_switches, switch_time, switches_per_second, num_avoided));
+    };
+
+    size_t strict_switches, strict_avoided, grouped_switches, grouped_avoided;
+    run(0, strict_switches, strict_avoided);
+    run(10, grouped_switches, grouped_avoided);
+
+    // Strict vruntime order alternates between the frequencies, grouping runs the two entities back to back
+    ASSERT_EQ(strict_avoided, 0);
+    ASSERT_GT(strict_switches, 0);
+    ASSERT_GT(grouped_avoided, 0);
+    ASSERT_LT(grouped_switches, strict_switches);
+}
+
+TEST_F(SchedulerTest, hybridVruntime){
+    // With alpha 0.5 a refill lasts half a slice at maximum power. At the highest frequency resnet18 draws about the
+    // maximum and is energy-heavy, at 522.75 MHz it draws a third of it and is time-heavy.
+    efair::scheduler::EFairScheduler hybrid(40000, 0.5, dev);
+    ASSERT_SUCC(hybrid.set_vruntime_mode(efair::scheduler::EFairScheduler::Hybrid));
+
+    efair::EntityID energy_eid, time_eid;
+    std::vector<efair::ModelID> mids(2);
+    ASSERT_NO_FATAL_FAILURE(load_entity(hybrid, freq, energy_eid, mids[0]));
+    ASSERT_NO_FATAL_FAILURE(load_entity(hybrid, "522750000", time_eid, mids[1]));
+    ASSERT_NO_FATAL_FAILURE(run_rounds(hybrid, mids, 5));
+
+    // Each quantum is charged the larger share, so the time-heavy entity is charged exactly its time
+    efair::VRuntime time_share, energy_share, charged;
+    ASSERT_SUCC(hybrid.get_vruntime_stats(time_eid, time_share, energy_share, charged));
+    ASSERT_GT(time_share, 0);
+    ASSERT_LT(energy_share, time_share);
+    ASSERT_DOUBLE_EQ(charged, time_share);
+
+    // and the energy-heavy one more than its time, at least its energy
+    ASSERT_SUCC(hybrid.get_vruntime_stats(energy_eid, time_share, energy_share, charged));
+    ASSERT_GT(time_share, 0);
+    ASSERT_GT(energy_share, time_share);
+    ASSERT_GE(charged, energy_share);
+    ASSERT_LE(charged, time_share + energy_share);
+}
+
+TEST_F(SchedulerTest, quantumFitYield){
+    ASSERT_SUCC(scheduler->set_quantum_fit(efair::scheduler::EFairScheduler::Yield));
+
+    // Two entities share the quantum, so tasks of both have to be split across several slices
+    efair::EntityID eid;
+    std::vector<efair::ModelID> mids(2);
+    ASSERT_NO_FATAL_FAILURE(load_entity(*scheduler, freq, eid, mids[0]));
+    ASSERT_NO_FATAL_FAILURE(load_entity(*scheduler, freq, eid, mids[1], RESNET50_LIB_PATH, RESNET50_PROFILE_PATH));
+    ASSERT_NO_FATAL_FAILURE(run_rounds(*scheduler, mids, 5));
+
+    // Kernels are charged their profiled time, so no quantum ends past its slice
+    size_t num_overruns, num_yields;
+    efair::MicroSeconds overrun_time, max_overrun;
+    ASSERT_SUCC(scheduler->get_overrun_stats(0, num_overruns, overrun_time, max_overrun, num_yields));
+    ASSERT_EQ(num_overruns, 0);
+    ASSERT_EQ(overrun_time, 0);
+    ASSERT_GT(num_yields, 0);
+    ASSERT_TRUE(scheduler->get_overrun_stats(1, num_overruns, overrun_time, max_overrun, num_yields) ==
+                efair::Status::NotFound);
+}
+
+TEST_F(SchedulerTest, batchVariants){
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_SUCC(scheduler->create_entity(0, eid));
+    ASSERT_SUCC(scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid));
+
+    // A variant has to be a larger batch of the same model, with outputs that many times as large
+    ASSERT_TRUE(scheduler->add_batch_variant(mid + 1, 2, RESNET18_LIB_PATH, RESNET18_PROFILE_PATH) ==
+                efair::Status::NotFound);
+    ASSERT_TRUE(scheduler->add_batch_variant(mid, 1, RESNET18_LIB_PATH, RESNET18_PROFILE_PATH) ==
+                efair::Status::Fail);
+    ASSERT_TRUE(scheduler->add_batch_variant(mid, 2, RESNET50_LIB_PATH, RESNET50_PROFILE_PATH) ==
+                efair::Status::Fail);
+
+    // Outputs of tasks run alone are copied out too
+    std::vector<float> output(1000);
+    efair::TaskID tid;
+    ASSERT_TRUE(scheduler->new_task(mid, {}, {{0, output.data(), 10}}, tid) == efair::Status::Fail);
+    ASSERT_SUCC(scheduler->set_batch_delay(1000));
+    ASSERT_SUCC(scheduler->run());
+    ASSERT_SUCC(scheduler->new_task(mid, {}, {{0, output.data(), output.size() * sizeof(float)}}, tid));
+    ASSERT_SUCC(scheduler->wait_task(tid));
+    ASSERT_SUCC(scheduler->shutdown());
+
+    size_t num_batches, num_batched_tasks;
+    ASSERT_SUCC(scheduler->get_batching_stats(0, num_batches, num_batched_tasks));
+    ASSERT_EQ(num_batches, 0);
+}
+
+TEST_F(SchedulerTest, batchVariantRuns){
+    if (!std::ifstream(RESNET18_B2_LIB_PATH).good() || !std::ifstream(RESNET18_B2_PROFILE_PATH).good())
+        GTEST_SKIP() << "No batch 2 variant of resnet18 at " << RESNET18_B2_LIB_PATH;
+
+    std::ifstream input_file(CHIHUAHUA_IMAGE_FILEPATH, std::ios::binary);
+    std::vector<char> input((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
+
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_NO_FATAL_FAILURE(load_entity(*scheduler, freq, eid, mid));
+    ASSERT_SUCC(scheduler->add_batch_variant(mid, 2, RESNET18_B2_LIB_PATH, RESNET18_B2_PROFILE_PATH));
+
+    // The first four tasks run as two batches. The fifth gives no input, so it runs alone and so does the last,
+    // which would leave the fifth's slice of the batched input as the batch before wrote it.
+    std::vector<std::vector<float>> outputs(6, std::vector<float>(1000));
+    std::vector<efair::TaskID> tids;
+    for (size_t i = 0; i < outputs.size(); i++){
+        std::vector<efair::scheduler::EFairScheduler::TaskInput> inputs;
+        if (i != 4)
+            inputs.push_back({"input", input.data(), input.size()});
+        efair::TaskID tid;
+        ASSERT_SUCC(scheduler->new_task(mid, inputs, {{0, outputs[i].data(), outputs[i].size() * sizeof(float)}},
+                                        tid));
+        tids.push_back(tid);
+    }
+    ASSERT_SUCC(scheduler->run());
+    for (auto tid : tids){
+        ASSERT_SUCC(scheduler->wait_task(tid));
+    }
+    ASSERT_SUCC(scheduler->shutdown());
+
+    size_t num_batches, num_batched_tasks;
+    ASSERT_SUCC(scheduler->get_batching_stats(0, num_batches, num_batched_tasks));
+    ASSERT_EQ(num_batches, 2);
+    ASSERT_EQ(num_batched_tasks, 4);
+
+    // Every task gets its own slice of the batched output, the same as running alone
+    for (size_t i = 0; i < outputs.size(); i++){
+        if (i != 4)
+            ASSERT_EQ(std::max_element(outputs[i].begin(), outputs[i].end()) - outputs[i].begin(), 151);
+    }
+
+    // A lone task waits out the batch delay without opening quanta, then runs alone in one
+    efair::scheduler::EFairScheduler held(40000, 1.0, dev);
+    ASSERT_SUCC(held.set_batch_delay(20000));
+    ASSERT_NO_FATAL_FAILURE(load_entity(held, freq, eid, mid));
+    ASSERT_SUCC(held.add_batch_variant(mid, 2, RESNET18_B2_LIB_PATH, RESNET18_B2_PROFILE_PATH));
+    ASSERT_NO_FATAL_FAILURE(run_rounds(held, {mid}, 1));
+
+    size_t num_quanta, num_steals;
+    ASSERT_SUCC(held.get_dispatcher_stats(0, num_quanta, num_steals));
+    ASSERT_EQ(num_quanta, 1);
+    ASSERT_SUCC(held.get_batching_stats(0, num_batches, num_batched_tasks));
+    ASSERT_EQ(num_batches, 0);
+}
+
+TEST_F(SchedulerTest, batchLeavesRestUnclaimed){
+    if (!std::ifstream(RESNET18_B2_LIB_PATH).good() || !std::ifstream(RESNET18_B2_PROFILE_PATH).good())
+        GTEST_SKIP() << "No batch 2 variant of resnet18 at " << RESNET18_B2_LIB_PATH;
+
+    ASSERT_SUCC(scheduler->set_input_staging(true));
+    ASSERT_SUCC(scheduler->set_executor_instances(2));
+
+    std::ifstream input_file(CHIHUAHUA_IMAGE_FILEPATH, std::ios::binary);
+    std::vector<char> input((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
+
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_NO_FATAL_FAILURE(load_entity(*scheduler, freq, eid, mid));
+    ASSERT_SUCC(scheduler->add_batch_variant(mid, 2, RESNET18_B2_LIB_PATH, RESNET18_B2_PROFILE_PATH));
+
+    // Three tasks make one batch of two, the third is left to the stager while the batch runs
+    std::vector<std::vector<float>> outputs(3, std::vector<float>(1000));
+    std::vector<efair::TaskID> tids;
+    for (auto &output : outputs){
+        efair::TaskID tid;
+        ASSERT_SUCC(scheduler->new_task(mid, {{"input", input.data(), input.size()}},
+                                        {{0, output.data(), output.size() * sizeof(float)}}, tid));
+        tids.push_back(tid);
+    }
+    ASSERT_SUCC(scheduler->run());
+    for (auto tid : tids){
+        ASSERT_SUCC(scheduler->wait_task(tid));
+    }
+    ASSERT_SUCC(scheduler->shutdown());
+
+    size_t num_batches, num_batched_tasks, num_staged, num_waits;
+    ASSERT_SUCC(scheduler->get_batching_stats(0, num_batches, num_batched_tasks));
+    ASSERT_EQ(num_batches, 1);
+    ASSERT_EQ(num_batched_tasks, 2);
+    ASSERT_SUCC(scheduler->get_staging_stats(0, num_staged, num_waits));
+    ASSERT_EQ(num_staged, 1);
+    for (const auto &output : outputs){
+        ASSERT_EQ(std::max_element(output.begin(), output.end()) - output.begin(), 151);
+    }
+}
+
+TEST_F(SchedulerTest, inputStaging){
+    ASSERT_SUCC(scheduler->set_input_staging(true));
+    ASSERT_SUCC(scheduler->set_executor_instances(2));
+
+    std::ifstream input_file(CHIHUAHUA_IMAGE_FILEPATH, std::ios::binary);
+    std::vector<char> input((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
+
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_SUCC(scheduler->create_entity(0, eid));
+    ASSERT_SUCC(scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid));
+
+    // Queued up front, so that every task after the first is staged while the one before runs
+    std::vector<std::vector<float>> outputs(5, std::vector<float>(1000));
+    std::vector<efair::TaskID> tids;
+    for (auto &output : outputs){
+        efair::TaskID tid;
+        ASSERT_SUCC(scheduler->new_task(mid, {{"input", input.data(), input.size()}},
+                                        {{0, output.data(), output.size() * sizeof(float)}}, tid));
+        tids.push_back(tid);
+    }
+    ASSERT_SUCC(scheduler->run());
+
+    // The stagers start with the dispatchers
+    ASSERT_TRUE(scheduler->set_input_staging(false) == efair::Status::Fail);
+    for (auto tid : tids){
+        ASSERT_SUCC(scheduler->wait_task(tid));
+    }
+    ASSERT_SUCC(scheduler->shutdown());
+
+    // Staged inputs give the same result as inputs set when the task starts
+    for (const auto &output : outputs){
+        ASSERT_EQ(std::max_element(output.begin(), output.end()) - output.begin(), 151);
+    }
+
+    size_t num_staged, num_waits;
+    ASSERT_SUCC(scheduler->get_staging_stats(0, num_staged, num_waits));
+    ASSERT_GT(num_staged, 0);
+}
+
+TEST_F(SchedulerTest, latencyTargetFrequency){
+    // With a target any frequency meets, the model should run at the one using the least energy per task
+    efair::executor::Executor executor(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, dev);
+    size_t num_kernels;
+    std::vector<std::string> freqs;
+    ASSERT_SUCC(executor.get_num_kernels(num_kernels));
+    ASSERT_SUCC(executor.get_frequencies(freqs));
+    std::string efficient, fastest;
+    efair::MicroJoule least_energy = std::numeric_limits<efair::MicroJoule>::max();
+    efair::MicroSeconds least_time = std::numeric_limits<efair::MicroSeconds>::max();
+    for (efair::FreqIdx f = 0; f < freqs.size(); f++){
+        efair::MicroSeconds exec_time;
+        efair::MicroJoule energy;
+        ASSERT_SUCC(executor.get_kernel_range_cost(0, num_kernels, f, exec_time, energy));
+        if (energy < least_energy){
+            least_energy = energy;
+            efficient = freqs[f];
+        }
+        if (exec_time < least_time){
+            least_time = exec_time;
+            fastest = freqs[f];
+        }
+    }
+
+    efair::EntityID eid;
+    efair::ModelID relaxed_mid, strict_mid;
+    ASSERT_SUCC(scheduler->create_entity(0, eid));
+    ASSERT_SUCC(scheduler->load_model_with_latency_target(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, 1000000000,
+                                                          relaxed_mid));
+    ASSERT_SUCC(scheduler->create_entity(0, eid));
+    ASSERT_SUCC(scheduler->load_model_with_latency_target(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, 1,
+                                                          strict_mid));
+
+    // Plans are made by the dispatcher before it runs the next task
+    ASSERT_SUCC(scheduler->run());
+    for (auto mid : {relaxed_mid, strict_mid}){
+        efair::TaskID tid;
+        ASSERT_SUCC(scheduler->new_task(mid, tid));
+        ASSERT_SUCC(scheduler->wait_task(tid));
+    }
+    ASSERT_SUCC(scheduler->shutdown());
+
+    std::string model_freq;
+    ASSERT_SUCC(scheduler->get_model_frequency(relaxed_mid, model_freq));
+    ASSERT_EQ(model_freq, efficient);
+    ASSERT_SUCC(scheduler->get_model_frequency(strict_mid, model_freq));
+    ASSERT_EQ(model_freq, fastest);
+}
+
+TEST_F(SchedulerTest, realtimeAdmission){
+    ASSERT_TRUE(scheduler->set_realtime_bandwidth(1.0) == efair::Status::Fail);
+    ASSERT_SUCC(scheduler->set_realtime_bandwidth(0.5));
+
+    // No model finishes in 1 µs, and none runs back to back every 10 µs within half of the device
+    efair::EntityID eid;
+    efair::ModelID mid;
+    ASSERT_SUCC(scheduler->create_realtime_entity(1, 0, eid));
+    ASSERT_TRUE(scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid) ==
+                efair::Status::Fail);
+    ASSERT_SUCC(scheduler->create_realtime_entity(10000000, 10, eid));
+    ASSERT_TRUE(scheduler->load_model(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, eid, freq, mid) ==
+                efair::Status::Fail);
+
+    efair::EntityID rt_eid, fair_eid;
+    efair::ModelID rt_mid, fair_mid;
+    ASSERT_NO_FATAL_FAILURE(load_entity(*scheduler, freq, rt_eid, rt_mid, RESNET18_LIB_PATH, RESNET18_PROFILE_PATH,
+                                        10000000));
+    ASSERT_NO_FATAL_FAILURE(load_entity(*scheduler, freq, fair_eid, fair_mid, RESNET50_LIB_PATH,
+                                        RESNET50_PROFILE_PATH));
+    ASSERT_NO_FATAL_FAILURE(run_rounds(*scheduler, {rt_mid, fair_mid}, 5));
+
+    size_t num_tasks, num_misses;
+    ASSERT_SUCC(scheduler->get_deadline_stats(rt_eid, num_tasks, num_misses));
+    ASSERT_EQ(num_tasks, 5);
+    ASSERT_EQ(num_misses, 0);
+    ASSERT_TRUE(scheduler->get_deadline_stats(fair_eid, num_tasks, num_misses) == efair::Status::NotFound);
+}
+
 TEST_F(ExecutorTest, getNumKernels){
     size_t num_kernels;
     ASSERT_SUCC(resnet18_executor->get_num_kernels(num_kernels));
@@ -203,3 +877,652 @@ TEST_F(ExecutorTest, getKernelName){
     ASSERT_SUCC(resnet50_executor->get_kernel_name(5, kernel_name));
 }
 
+
+TEST_F(ExecutorTest, getOutputInfo){
+    size_t num_outputs;
+    tvm::runtime::ShapeTuple ret_shape;
+    DLDataType ret_dtype;
+
+    ASSERT_SUCC(resnet18_executor->get_num_outputs(num_outputs));
+    ASSERT_EQ(num_outputs, 1);
+    ASSERT_SUCC(resnet18_executor->get_output_shape(0, ret_shape));
+    ASSERT_EQ(ret_shape.size(), 2);
+    ASSERT_EQ(ret_shape[1], 1000);
+    ASSERT_SUCC(resnet18_executor->get_output_dtype(0, ret_dtype));
+    ASSERT_EQ(ret_dtype.code, kDLFloat);
+    ASSERT_TRUE(resnet18_executor->get_output_shape(1, ret_shape) != efair::Status::Succeed);
+}
+
+TEST_F(ExecutorTest, setInputShorter){
+    // A shorter input is accepted and zero padded, a longer one is rejected
+    ASSERT_TRUE(resnet18_executor->set_input("input", input_buffer, input_length + 1) == efair::Status::Fail);
+    ASSERT_SUCC(resnet18_executor->set_input("input", input_buffer, input_length / 2));
+    ASSERT_SUCC(resnet18_executor->set_input("input", input_buffer, input_length));
+    resnet18_executor->execute();
+
+    std::vector<float> ret_vector;
+    ASSERT_SUCC(resnet18_executor->get_output(0, ret_vector));
+    ASSERT_EQ(std::max_element(ret_vector.begin(), ret_vector.end()) - ret_vector.begin(), 151);
+}
+
+TEST_F(ExecutorTest, setInputZeroCopy){
+    ASSERT_TRUE(resnet18_executor->set_input_zero_copy("input", input_buffer, input_length - 1) != efair::Status::Succeed);
+    ASSERT_SUCC(resnet18_executor->set_input_zero_copy("input", input_buffer, input_length));
+    resnet18_executor->execute();
+
+    std::vector<float> ret_vector;
+    ASSERT_SUCC(resnet18_executor->get_output(0, ret_vector));
+    ASSERT_EQ(std::max_element(ret_vector.begin(), ret_vector.end()) - ret_vector.begin(), 151);
+}
+
+TEST_F(ExecutorTest, getOutputBulkAndReductions){
+    ASSERT_SUCC(resnet18_executor->set_input("input", input_buffer, input_length));
+    resnet18_executor->execute();
+
+    std::vector<float> ret_buffer(1000);
+    ASSERT_TRUE(resnet18_executor->get_output(0, ret_buffer.data(), 10) != efair::Status::Succeed);
+    ASSERT_SUCC(resnet18_executor->get_output(0, ret_buffer.data(), ret_buffer.size() * sizeof(float)));
+
+    const DLTensor *view;
+    ASSERT_SUCC(resnet18_executor->get_output_view(0, view));
+    ASSERT_EQ(view->shape[view->ndim - 1], 1000);
+    ASSERT_EQ(static_cast<const float *>(view->data)[151], ret_buffer[151]);
+
+    std::vector<int64_t> indices;
+    std::vector<float> values;
+    ASSERT_SUCC(resnet18_executor->get_host_output_argmax(0, indices));
+    ASSERT_EQ(indices.size(), 1);
+    ASSERT_EQ(indices[0], 151);
+
+    ASSERT_SUCC(resnet18_executor->get_host_output_topk(0, 5, indices, values));
+    ASSERT_EQ(indices.size(), 5);
+    ASSERT_EQ(indices[0], 151);
+    ASSERT_TRUE(std::is_sorted(values.rbegin(), values.rend()));
+}
+
+TEST_F(ExecutorTest, executorPoolInstances){
+    efair::executor::ExecutorPool pool(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, dev, 2);
+    ASSERT_EQ(pool.get_num_instances(), 2);
+
+    std::shared_ptr<efair::executor::Executor> e1, e2, e3;
+    ASSERT_SUCC(pool.acquire(e1));
+    ASSERT_SUCC(pool.acquire(e2));
+    ASSERT_NE(e1, e2);
+
+    // Instances keep their own inputs
+    std::vector<char> zeros(input_length, 0);
+    ASSERT_SUCC(e1->set_input_zero_copy("input", input_buffer, input_length));
+    ASSERT_SUCC(e2->set_input_zero_copy("input", zeros.data(), zeros.size()));
+    e1->execute();
+    e2->execute();
+
+    std::vector<int64_t> indices;
+    ASSERT_SUCC(e1->get_host_output_argmax(0, indices));
+    ASSERT_EQ(indices[0], 151);
+
+    // Whichever instance holds the weights, both compute with the same ones
+    ASSERT_SUCC(e2->set_input_zero_copy("input", input_buffer, input_length));
+    e2->execute();
+    ASSERT_SUCC(e2->get_host_output_argmax(0, indices));
+    ASSERT_EQ(indices[0], 151);
+
+    // Only instances with their own copy of the parameters count towards the footprint
+    size_t num_owning = 0;
+    for (const auto &e : {e1, e2})
+        num_owning += e->shares_params() ? 0 : 1;
+    ASSERT_EQ(pool.get_footprint(), num_owning * pool.get_instance_footprint());
+
+    // Exhausted pools grow on demand
+    ASSERT_SUCC(pool.acquire(e3));
+    ASSERT_EQ(pool.get_num_instances(), 3);
+
+    pool.release(e1);
+    pool.release(e2);
+    pool.release(e3);
+}
+
+TEST_F(ExecutorTest, modelCacheSharingAndEviction){
+    efair::executor::ModelCache cache;
+    std::shared_ptr<efair::executor::ExecutorPool> p1, p2, p3;
+
+    ASSERT_SUCC(cache.open(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, dev, 1, p1));
+    ASSERT_SUCC(cache.open(RESNET18_LIB_PATH, RESNET18_PROFILE_PATH, dev, 1, p2));
+    ASSERT_SUCC(cache.open(RESNET50_LIB_PATH, RESNET50_PROFILE_PATH, dev, 1, p3));
+    ASSERT_EQ(p1, p2);
+    ASSERT_EQ(cache.get_num_models(), 2);
+
+    // Room for one model only, resnet18 is the least recently used and idle
+    cache.set_memory_budget(p3->get_instance_footprint());
+    ASSERT_EQ(p1->get_footprint(), 0);
+    ASSERT_EQ(cache.get_memory_usage(), p3->get_footprint());
+
+    // Acquiring an evicted model reloads it and evicts the other one
+    std::shared_ptr<efair::executor::Executor> executor;
+    ASSERT_SUCC(cache.acquire(p1, executor));
+    ASSERT_TRUE(executor->is_loaded());
+    ASSERT_EQ(p3->get_footprint(), 0);
+
+    ASSERT_SUCC(executor->set_input("input", input_buffer, input_length));
+    executor->execute();
+    std::vector<int64_t> indices;
+    ASSERT_SUCC(executor->get_host_output_argmax(0, indices));
+    ASSERT_EQ(indices[0], 151);
+    cache.release(p1, executor);
+
+    cache.close(p1);
+    cache.close(p2);
+    cache.close(p3);
+}
+
+TEST_F(ExecutorTest, kernelTiming){
+    ASSERT_SUCC(resnet18_executor->set_input("input", input_buffer, input_length));
+    resnet18_executor->set_timing(true);
+
+    efair::FreqIdx freq_idx;
+    ASSERT_SUCC(resnet18_executor->get_freq_index("1300500000", freq_idx));
+
+    size_t num_kernels;
+    efair::MicroSeconds time_used, service_time = 0;
+    efair::MicroJoule energy_used;
+    ASSERT_SUCC(resnet18_executor->get_num_kernels(num_kernels));
+    for (size_t i = 0; i < num_kernels; i++){
+        resnet18_executor->execute_kernel(i, freq_idx, time_used, energy_used);
+        service_time += time_used;
+    }
+    resnet18_executor->sync();
+
+    efair::MicroSeconds measured_time, profiled_time;
+    resnet18_executor->get_timing(measured_time, profiled_time);
+    ASSERT_EQ(profiled_time, service_time);
+    ASSERT_GT(measured_time, 0);
+
+    std::vector<int64_t> indices;
+    ASSERT_SUCC(resnet18_executor->get_host_output_argmax(0, indices));
+    ASSERT_EQ(indices[0], 151);
+
+    resnet18_executor->reset_timing();
+    resnet18_executor->get_timing(measured_time, profiled_time);
+    ASSERT_EQ(measured_time, 0);
+}
+
+TEST(ProfileTest, binaryRoundTrip){
+    efair::executor::ModelProfile json_profile, binary_profile;
+    std::string binary_path = testing::TempDir() + "resnet18_profile.bin";
+
+    ASSERT_SUCC(json_profile.load(RESNET18_PROFILE_PATH));
+    ASSERT_SUCC(json_profile.save_binary(binary_path));
+    ASSERT_SUCC(binary_profile.load(binary_path));
+    std::remove(binary_path.c_str());
+
+    efair::FreqIdx freq_idx;
+    ASSERT_SUCC(binary_profile.get_freq_index("1300500000", freq_idx));
+    ASSERT_EQ(binary_profile.get_model_name(), "resnet18");
+    ASSERT_EQ(binary_profile.get_exec_time(freq_idx), 21406);
+    ASSERT_EQ(binary_profile.get_energy(freq_idx), 79973);
+    ASSERT_EQ(binary_profile.get_kernel_names(), json_profile.get_kernel_names());
+
+    size_t row;
+    ASSERT_SUCC(binary_profile.get_kernel_row("tvmgen_default_fused_nn_max_pool2d", row));
+    ASSERT_EQ(binary_profile.get_kernel_exec_time(row, freq_idx), 201);
+}
+
+TEST(ProfileTest, binaryRejectsBadLayout){
+    efair::executor::ModelProfile json_profile, binary_profile;
+    std::string binary_path = testing::TempDir() + "efair_profile_test.bin";
+    ASSERT_SUCC(json_profile.load(RESNET18_PROFILE_PATH));
+
+    // Cut off the end of the string table
+    ASSERT_SUCC(json_profile.save_binary(binary_path));
+    std::ifstream in_file(binary_path, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(in_file)), std::istreambuf_iterator<char>());
+    in_file.close();
+    std::ofstream(binary_path, std::ios::binary | std::ios::trunc).write(contents.data(), contents.size() - 1);
+    ASSERT_TRUE(binary_profile.load(binary_path) == efair::Status::Fail);
+
+    // Counts whose value table size overflows must not wrap around into a small, valid-looking layout
+    efair::executor::ProfileHeader header{};
+    std::memcpy(header.magic, PROFILE_BINARY_MAGIC, sizeof(header.magic));
+    header.version = PROFILE_BINARY_VERSION;
+    header.num_freqs = std::numeric_limits<uint32_t>::max();
+    header.num_kernels = std::numeric_limits<uint32_t>::max();
+    header.string_table_size = std::numeric_limits<uint64_t>::max();
+    std::ofstream(binary_path, std::ios::binary | std::ios::trunc)
+            .write(reinterpret_cast<const char *>(&header), sizeof(header));
+    ASSERT_TRUE(binary_profile.load(binary_path) == efair::Status::Fail);
+    std::remove(binary_path.c_str());
+}
+
+TEST(ProfileTest, kernelRangeCost){
+    efair::executor::ModelProfile profile;
+    efair::executor::KernelCostTable table;
+    ASSERT_SUCC(profile.load(RESNET18_PROFILE_PATH));
+    ASSERT_SUCC(table.build(profile, profile.get_kernel_names()));
+
+    efair::FreqIdx freq_idx;
+    ASSERT_SUCC(profile.get_freq_index("1300500000", freq_idx));
+
+    efair::MicroSeconds range_time, sum_time = 0;
+    efair::MicroJoule range_energy, sum_energy = 0;
+    for (efair::KernelIdx k = 3; k < 10; k++){
+        sum_time += table.get(k, freq_idx).exec_time;
+        sum_energy += table.get(k, freq_idx).energy;
+    }
+    table.get_range(3, 10, freq_idx, range_time, range_energy);
+    ASSERT_EQ(range_time, sum_time);
+    ASSERT_EQ(range_energy, sum_energy);
+
+    // Exactly the budget of [3, 10) fits up to 10, a zero budget still makes progress
+    ASSERT_EQ(table.fit_range(3, freq_idx, sum_time), 10);
+    ASSERT_GE(table.fit_range(3, freq_idx, 0), 4);
+    ASSERT_EQ(table.fit_range(0, freq_idx, 1ul << 40), table.get_num_kernels());
+}
+
+TEST(ProfileTest, onlineCorrection){
+    efair::executor::ModelProfile profile;
+    efair::executor::KernelCostTable table;
+    ASSERT_SUCC(profile.load(RESNET18_PROFILE_PATH));
+    ASSERT_SUCC(table.build(profile, profile.get_kernel_names()));
+
+    efair::FreqIdx freq_idx;
+    ASSERT_SUCC(profile.get_freq_index("1300500000", freq_idx));
+
+    efair::MicroSeconds estimated_time, corrected_time;
+    efair::MicroJoule energy;
+    table.get_range(0, 10, freq_idx, estimated_time, energy);
+
+    // Twice the estimate is flagged, and half of the gap is folded in
+    ASSERT_FALSE(table.observe(0, 10, freq_idx, 2 * estimated_time, 0.5, 0.5));
+    ASSERT_EQ(table.get_num_deviations(), 1);
+    table.refresh(freq_idx);
+    table.get_range(0, 10, freq_idx, corrected_time, energy);
+    ASSERT_NEAR(corrected_time, 1.5 * estimated_time, 10);
+
+    ASSERT_TRUE(table.observe(0, 10, freq_idx, corrected_time, 0.5, 0.5));
+    ASSERT_EQ(table.get_num_deviations(), 1);
+}
+
+TEST(ProfileTest, concurrentCorrection){
+    efair::executor::ModelProfile profile;
+    efair::executor::KernelCostTable table;
+    ASSERT_SUCC(profile.load(RESNET18_PROFILE_PATH));
+    ASSERT_SUCC(table.build(profile, profile.get_kernel_names()));
+
+    efair::FreqIdx freq_idx;
+    ASSERT_SUCC(profile.get_freq_index("1300500000", freq_idx));
+    efair::MicroSeconds tail_time;
+    efair::MicroJoule energy;
+    table.get_range(10, table.get_num_kernels(), freq_idx, tail_time, energy);
+    auto held = table.get_snapshot();
+    efair::MicroSeconds head_time;
+    held->get_range(0, 10, freq_idx, head_time, energy);
+
+    // Instances on other dispatchers keep charging from the table while one of them folds in measurements
+    std::atomic<bool> done{false};
+    std::thread corrector([&](){
+        for (int i = 0; i < 1000; i++){
+            table.observe(0, 10, freq_idx, 1000, 0.1, 0.5);
+            table.refresh(freq_idx);
+        }
+        done = true;
+    });
+
+    efair::MicroSeconds range_time;
+    while (!done){
+        table.get_range(0, table.get_num_kernels(), freq_idx, range_time, energy);
+        ASSERT_GT(range_time, 0);
+        ASSERT_LE(table.fit_range(0, freq_idx, range_time), table.get_num_kernels());
+    }
+    corrector.join();
+
+    // Only the first ten kernels were corrected
+    table.get_range(0, 10, freq_idx, range_time, energy);
+    ASSERT_NEAR(range_time, 1000, 10);
+    table.get_range(10, table.get_num_kernels(), freq_idx, range_time, energy);
+    ASSERT_EQ(range_time, tail_time);
+
+    // A snapshot held across refreshes keeps the costs it was taken with
+    held->get_range(0, 10, freq_idx, range_time, energy);
+    ASSERT_EQ(range_time, head_time);
+}
+
+TEST(RunQueueTest, orderAndWeight){
+    efair::scheduler::RunQueue<int> run_queue;
+    auto h0 = run_queue.insert(0, 2.0, 3);
+    auto h1 = run_queue.insert(1, 1.0, 5);
+    auto h2 = run_queue.insert(2, 1.0, 7);
+    ASSERT_EQ(run_queue.get_total_weight(), 15);
+    ASSERT_EQ(run_queue.get_min_vruntime(), 1.0);
+
+    // Ties go to the entity queued first
+    ASSERT_EQ(run_queue.get(run_queue.top()), 1);
+    run_queue.update(h1, 3.0);
+    ASSERT_EQ(run_queue.get(run_queue.top()), 2);
+    run_queue.update(h0, 0.5);
+    ASSERT_EQ(run_queue.get(run_queue.top()), 0);
+
+    // Handles stay valid across removals and reuse of freed slots
+    run_queue.remove(h0);
+    auto h3 = run_queue.insert(3, 4.0, 1);
+    run_queue.update_weight(h2, 2);
+    ASSERT_EQ(run_queue.get_total_weight(), 8);
+    ASSERT_EQ(run_queue.get(h1), 1);
+    ASSERT_EQ(run_queue.get(h3), 3);
+
+    std::vector<int> order;
+    while (!run_queue.empty()){
+        order.push_back(run_queue.get(run_queue.top()));
+        run_queue.remove(run_queue.top());
+    }
+    ASSERT_EQ(order, std::vector<int>({2, 1, 3}));
+    ASSERT_EQ(run_queue.get_total_weight(), 0);
+}
+
+TEST(SliceSolverTest, waterFilling){
+    efair::scheduler::SliceSolver solver(40000, 0.5);
+    solver.add(0, 1024, 100);
+    solver.add(1, 1024, 300);
+
+    // The remainder lifts the low power entity until both reach the same weighted energy
+    ASSERT_EQ(solver.get_slice(1024, 100), 30000);
+    ASSERT_EQ(solver.get_slice(1024, 300), 10000);
+
+    // Entities drawing no power take the whole remainder
+    solver.add(2, 2048, 0);
+    ASSERT_EQ(solver.get_slice(1024, 100), 5000);
+    ASSERT_EQ(solver.get_slice(2048, 0), 30000);
+
+    solver.remove(2);
+    solver.update(1, 3072, 300);
+    ASSERT_NEAR(solver.get_slice(1024, 100) + solver.get_slice(3072, 300), 40000, 1);
+}
+
+TEST(TaskHistoryTest, ringAndSpill){
+    auto spill_path = testing::TempDir() + "efair_task_spill.csv";
+    auto export_path = testing::TempDir() + "efair_tasks.csv";
+
+    efair::scheduler::TaskHistory history(4);
+    ASSERT_SUCC(history.set_spill_file(spill_path));
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (efair::TaskID tid = 0; tid < 10; tid++){
+        auto start_t = t0 + std::chrono::microseconds(100 * tid);
+        history.add({tid, 0, tid % 2, start_t, start_t, start_t + std::chrono::microseconds(50), 50, 10, 0});
+    }
+
+    // Only the newest records stay resident, the rest are in the spill file and totals cover all of them
+    efair::scheduler::TaskRecord record;
+    ASSERT_SUCC(history.find(9, record));
+    ASSERT_EQ(history.find(5, record), efair::Status::NotFound);
+    ASSERT_EQ(history.get_model_totals()[1].num_tasks, 5);
+    ASSERT_EQ(history.get_model_totals()[0].energy_used, 50);
+
+    ASSERT_SUCC(history.export_csv(export_path));
+    std::ifstream in_file(export_path);
+    std::string line;
+    std::vector<std::string> lines;
+    while (std::getline(in_file, line)){
+        lines.push_back(line);
+    }
+    ASSERT_EQ(lines.size(), 11);
+    ASSERT_EQ(lines[1], "0,0,0,0,50,50,10,0");
+    ASSERT_EQ(lines[10], "9,0,1,900,950,50,10,0");
+    ASSERT_EQ(history.get_num_dropped(), 0);
+
+    std::remove(spill_path.c_str());
+    std::remove(export_path.c_str());
+}
+
+TEST(TaskHistoryTest, findAfterShrink){
+    efair::scheduler::TaskHistory history(4);
+    auto t0 = std::chrono::steady_clock::now();
+    for (efair::TaskID tid = 0; tid < 6; tid++){
+        history.add({tid, 0, 0, t0, t0, t0, 50, 10, 0});
+    }
+
+    efair::scheduler::TaskRecord record;
+    ASSERT_EQ(history.find(1, record), efair::Status::NotFound);
+    ASSERT_SUCC(history.find(2, record));
+    ASSERT_EQ(record.tid, 2);
+
+    ASSERT_SUCC(history.set_capacity(2));
+    ASSERT_EQ(history.find(3, record), efair::Status::NotFound);
+    ASSERT_SUCC(history.find(5, record));
+    ASSERT_EQ(record.tid, 5);
+
+    history.add({6, 0, 0, t0, t0, t0, 50, 10, 0});
+    ASSERT_EQ(history.find(4, record), efair::Status::NotFound);
+    ASSERT_SUCC(history.find(6, record));
+    ASSERT_EQ(record.tid, 6);
+}
+
+TEST(TaskHistoryTest, slabRecycles){
+    efair::util::ObjectSlab<int> slab(2);
+    auto *a = slab.acquire();
+    auto *b = slab.acquire();
+    slab.release(a);
+    ASSERT_EQ(slab.acquire(), a);
+    slab.release(b);
+    ASSERT_EQ(slab.get_capacity(), 2);
+    ASSERT_EQ(slab.get_num_free(), 1);
+}
+
+struct SubmissionItem {
+    size_t producer;
+    size_t seq;
+    SubmissionItem *next;
+};
+
+TEST(SubmissionQueueTest, multiProducerOrder){
+    const size_t num_producers = 4, num_items = 100000;
+    efair::scheduler::SubmissionQueue<SubmissionItem, &SubmissionItem::next> queue;
+    std::vector<std::vector<SubmissionItem>> items(num_producers, std::vector<SubmissionItem>(num_items));
+
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < num_producers; p++){
+        producers.emplace_back([&, p] {
+            for (size_t i = 0; i < num_items; i++){
+                items[p][i] = {p, i, nullptr};
+                queue.push(&items[p][i]);
+            }
+        });
+    }
+
+    // Items of one producer come out in the order it pushed them, however the drains interleave with the pushes
+    std::vector<size_t> next_seq(num_producers, 0);
+    size_t received = 0;
+    while (received < num_producers * num_items){
+        for (auto *item = queue.drain(); item != nullptr; item = item->next){
+            ASSERT_EQ(item->seq, next_seq[item->producer]);
+            next_seq[item->producer]++;
+            received++;
+        }
+    }
+
+    for (auto &t : producers){
+        t.join();
+    }
+    ASSERT_TRUE(queue.empty());
+}
+
+struct RegistryItem {
+    size_t id;
+};
+
+TEST(RegistryTest, concurrentLookups){
+    const size_t num_writers = 2, num_items = 20000, window = 100;
+    efair::scheduler::ConcurrentRegistry<RegistryItem, &RegistryItem::id> registry(16);
+    std::vector<RegistryItem> items(num_writers * num_items);
+    std::atomic<size_t> next_id{0}, failures{0};
+    std::atomic_bool done{false};
+
+    // Writers keep a sliding window of live IDs, so the table has to grow while readers look IDs up
+    std::vector<std::thread> writers;
+    for (size_t w = 0; w < num_writers; w++){
+        writers.emplace_back([&] {
+            std::vector<size_t> live;
+            for (size_t i = 0; i < num_items; i++){
+                size_t id = next_id.fetch_add(1);
+                items[id].id = id;
+                registry.insert(&items[id]);
+                if (registry.find(id) != &items[id])
+                    failures++;
+
+                live.push_back(id);
+                if (live.size() > window){
+                    registry.remove(live.front());
+                    live.erase(live.begin());
+                }
+            }
+        });
+    }
+
+    std::thread reader([&] {
+        while (!done.load()){
+            size_t issued = next_id.load();
+            for (size_t id = issued > window ? issued - window : 0; id < issued; id++){
+                auto *item = registry.find(id);
+                if (item != nullptr && item->id != id)
+                    failures++;
+            }
+        }
+    });
+
+    for (auto &t : writers){
+        t.join();
+    }
+    done.store(true);
+    reader.join();
+
+    ASSERT_EQ(failures.load(), 0);
+    ASSERT_EQ(registry.size(), num_writers * window);
+    ASSERT_EQ(registry.find(num_writers * num_items), nullptr);
+}
+
+struct RecycledItem {
+    std::atomic<size_t> id{0};
+};
+
+TEST(RegistryTest, recycledKeys){
+    const size_t num_slots = 8, num_rounds = 20000;
+    efair::scheduler::ConcurrentRegistry<RecycledItem, &RecycledItem::id> registry(16);
+    std::vector<RecycledItem> items(num_slots);
+    std::atomic<size_t> next_id{0}, failures{0};
+    std::atomic_bool done{false};
+
+    // Like the task slab, a removed item comes back under a newer ID while readers may still hold it
+    std::thread writer([&] {
+        for (size_t i = 0; i < num_slots; i++){
+            items[i].id = next_id.fetch_add(1);
+            registry.insert(&items[i]);
+        }
+        for (size_t round = 0; round < num_rounds; round++){
+            auto &item = items[round % num_slots];
+            registry.remove(item.id);
+            item.id = next_id.fetch_add(1);
+            registry.insert(&item);
+        }
+    });
+
+    std::thread reader([&] {
+        while (!done.load()){
+            size_t issued = next_id.load();
+            for (size_t id = issued > 2 * num_slots ? issued - 2 * num_slots : 0; id < issued; id++){
+                // IDs only grow, so a stale hit can only show a newer ID, never an older one
+                auto *item = registry.find(id);
+                if (item != nullptr && item->id.load() < id)
+                    failures++;
+            }
+        }
+    });
+
+    writer.join();
+    done.store(true);
+    reader.join();
+
+    ASSERT_EQ(failures.load(), 0);
+    ASSERT_EQ(registry.size(), num_slots);
+}
+
+TEST(TraceTest, ringOverwriteAndExport){
+    efair::util::Tracer tracer;
+    ASSERT_TRUE(tracer.set_ring_size(0) == efair::Status::Fail);
+    ASSERT_SUCC(tracer.set_ring_size(3));
+
+    tracer.record(efair::util::FrequencyChange, 100);
+    tracer.set_enabled(true);
+    tracer.set_thread_name("test thread");
+    for (uint64_t freq = 1; freq <= 6; freq++){
+        tracer.record(efair::util::FrequencyChange, freq);
+    }
+
+    // The ring holds 4 events and the slot written next is left out, so only the last 3 frequencies are exported
+    std::string path = testing::TempDir() + "efair_trace_test.json";
+    ASSERT_SUCC(tracer.export_chrome_trace(path));
+    std::ifstream in_file(path);
+    std::string trace((std::istreambuf_iterator<char>(in_file)), std::istreambuf_iterator<char>());
+    std::remove(path.c_str());
+
+    ASSERT_NE(trace.find("\"name\":\"test thread\""), std::string::npos);
+    for (uint64_t freq = 1; freq <= 6; freq++){
+        bool found = trace.find("\"frequency\":" + std::to_string(freq) + "}") != std::string::npos;
+        ASSERT_EQ(found, freq > 3);
+    }
+    ASSERT_EQ(trace.find("\"frequency\":100}"), std::string::npos);
+
+    tracer.clear();
+    ASSERT_SUCC(tracer.export_chrome_trace(path));
+    std::ifstream cleared_file(path);
+    std::string cleared((std::istreambuf_iterator<char>(cleared_file)), std::istreambuf_iterator<char>());
+    std::remove(path.c_str());
+    ASSERT_EQ(cleared.find("\"frequency\""), std::string::npos);
+}
+
+TEST(TraceTest, exitedThreadRingsReused){
+    efair::util::Tracer tracer;
+    tracer.set_enabled(true);
+
+    // Threads that record one after another share a ring
+    for (int i = 0; i < 8; i++){
+        std::thread([&tracer] { tracer.record(efair::util::TaskSubmit, 1); }).join();
+    }
+    ASSERT_EQ(tracer.get_num_rings(), 1);
+
+    // Threads that record at the same time need their own
+    std::vector<std::thread> threads;
+    std::atomic_int recorded{0};
+    for (int i = 0; i < 4; i++){
+        threads.emplace_back([&tracer, &recorded] {
+            tracer.record(efair::util::TaskSubmit, 2);
+            recorded++;
+            while (recorded.load() < 4){
+                std::this_thread::yield();
+            }
+        });
+    }
+    for (auto &t : threads){
+        t.join();
+    }
+    ASSERT_EQ(tracer.get_num_rings(), 4);
+
+    // A ring of another size is freed instead of reused
+    ASSERT_SUCC(tracer.set_ring_size(8));
+    std::thread([&tracer] { tracer.record(efair::util::TaskSubmit, 3); }).join();
+    ASSERT_EQ(tracer.get_num_rings(), 1);
+}
+
+TEST(TraceTest, recreatedTracerGetsOwnRing){
+    std::string path = testing::TempDir() + "efair_trace_recreated.json";
+    for (uint64_t i = 1; i <= 3; i++){
+        // Each tracer may be built where the last one lived, its events must not land in the destroyed ring
+        auto tracer = std::make_unique<efair::util::Tracer>();
+        tracer->set_enabled(true);
+        tracer->record(efair::util::FrequencyChange, i);
+        ASSERT_EQ(tracer->get_num_rings(), 1);
+
+        ASSERT_SUCC(tracer->export_chrome_trace(path));
+        std::ifstream in_file(path);
+        std::string trace((std::istreambuf_iterator<char>(in_file)), std::istreambuf_iterator<char>());
+        std::remove(path.c_str());
+        ASSERT_NE(trace.find("\"frequency\":" + std::to_string(i) + "}"), std::string::npos);
+    }
+}
@@ -32,7 +32,7 @@ namespace efair {
                 return Status::Fail;  // vector already has content
             }
 
-            std::ifstream avai_freq_file (AVAILABLE_FREQUENCY_FILE);
+            std::ifstream avai_freq_file (devfreq_file(AVAILABLE_FREQUENCY_FILE));
 
             if (avai_freq_file.is_open()){
                 for (std::string line; std::getline(avai_freq_file, line, ' '); ){
@@ -62,6 +62,14 @@ namespace efair {
         }
 
         Status FrequencyController::get_frequency(std::string& freq) {
+            // Read on every dispatch, so known frequencies are looked up by index without waiting for the worker
+            auto idx = target_idx.load();
+            if (idx != UNKNOWN_FREQUENCY_IDX){
+                freq = idx2freq.at(idx);
+                return Status::Succeed;
+            }
+
+            std::unique_lock<std::mutex> lock(freq_lock);
             freq = target_frequency;
             return Status::Succeed;
         }
@@ -69,6 +77,8 @@ namespace efair {
         Status FrequencyController::set_cur_frequency(const std::string &freq) {
             std::unique_lock<std::mutex> lock(freq_lock);
             target_frequency = freq;
+            auto it = freq2idx.find(freq);
+            target_idx.store(it != freq2idx.end() ? it->second : UNKNOWN_FREQUENCY_IDX);
             cv.notify_one();
 
             return Status::Succeed;
@@ -84,14 +94,14 @@ namespace efair {
 
             Status s1 = Status::Succeed, s2 = Status::Succeed;
             if (cur_freq_num > target_freq_num){
-                RETURN_STATUS(write_frequency(MIN_FREQUENCY_FILE, freq));
-                RETURN_STATUS(write_frequency(MAX_FREQUENCY_FILE, freq));
+                RETURN_STATUS(write_frequency(devfreq_file(MIN_FREQUENCY_FILE), freq));
+                RETURN_STATUS(write_frequency(devfreq_file(MAX_FREQUENCY_FILE), freq));
             } else if (cur_freq_num < target_freq_num) {
-                RETURN_STATUS(write_frequency(MAX_FREQUENCY_FILE, freq));
-                RETURN_STATUS(write_frequency(MIN_FREQUENCY_FILE, freq));
+                RETURN_STATUS(write_frequency(devfreq_file(MAX_FREQUENCY_FILE), freq));
+                RETURN_STATUS(write_frequency(devfreq_file(MIN_FREQUENCY_FILE), freq));
             }
 
-            RETURN_STATUS(read_frequency_from_file(CUR_FREQUENCY_FILE));
+            RETURN_STATUS(read_frequency_from_file(devfreq_file(CUR_FREQUENCY_FILE)));
             return cur_frequency == freq ? Status::Succeed : Status::Fail;
         }
 
@@ -121,7 +131,20 @@ namespace efair {
             cv.wait(lock, [&]{
                 return target_frequency != cur_frequency || shutdown_requested;
             });
+            if (target_frequency == cur_frequency)
+                return;
+
+            auto start_t = std::chrono::steady_clock::now();
             ASSERT_STATUS(set_cur_frequency_internal(target_frequency));
+            switch_time += std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start_t).count();
+            num_switches++;
+        }
+
+        Status FrequencyController::get_switch_stats(size_t &ret_num_switches, size_t &ret_switch_time) {
+            ret_num_switches = num_switches.load();
+            ret_switch_time = switch_time.load();
+            return Status::Succeed;
         }
 
         void FrequencyController::shutdown() {
@@ -131,16 +154,18 @@ namespace efair {
                 cv.notify_one();
             }
 
+            if (!worker_thread->joinable())
+                return;
             worker_thread->join();
             LOG(INFO) << "Frequency controller is shutdown.";
         }
 
-        FrequencyController::FrequencyController() {
+        FrequencyController::FrequencyController(const std::string &devfreq_dir) : devfreq_dir(devfreq_dir) {
             if (getuid()) {
                 throw std::runtime_error("Need root to change GPU frequency, exiting.");
             }
 
-            ASSERT_STATUS(read_frequency_from_file(CUR_FREQUENCY_FILE));
+            ASSERT_STATUS(read_frequency_from_file(devfreq_file(CUR_FREQUENCY_FILE)));
             target_frequency = cur_frequency;
             shutdown_requested = false;
 
@@ -151,6 +176,7 @@ namespace efair {
                 idx2freq[i] = freq_vec[i];
                 freq2idx[freq_vec[i]] = i;
             }
+            target_idx = freq2idx.count(target_frequency) ? freq2idx[target_frequency] : UNKNOWN_FREQUENCY_IDX;
 
             worker_thread = std::make_unique<std::thread>([this]{
                 while (!this->shutdown_requested){
@@ -159,6 +185,8 @@ namespace efair {
             });
         }
 
-        FrequencyController::~FrequencyController() = default;
+        FrequencyController::~FrequencyController() {
+            shutdown();
+        }
 }
 }
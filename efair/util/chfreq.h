@@ -12,20 +12,24 @@
 #include <memory>
 #include <thread>
 #include <condition_variable>
+#include <atomic>
+#include <limits>
 #include "util/common.h"
 
-#define MIN_FREQUENCY_FILE "/sys/devices/17000000.gp10b/devfreq/17000000.gp10b/min_freq"
-#define CUR_FREQUENCY_FILE "/sys/devices/17000000.gp10b/devfreq/17000000.gp10b/cur_freq"
-#define MAX_FREQUENCY_FILE "/sys/devices/17000000.gp10b/devfreq/17000000.gp10b/max_freq"
-#define AVAILABLE_FREQUENCY_FILE "/sys/devices/17000000.gp10b/devfreq/17000000.gp10b/available_frequencies"
+#define DEVFREQ_DIR "/sys/devices/17000000.gp10b/devfreq/17000000.gp10b"
+#define MIN_FREQUENCY_FILE "min_freq"
+#define CUR_FREQUENCY_FILE "cur_freq"
+#define MAX_FREQUENCY_FILE "max_freq"
+#define AVAILABLE_FREQUENCY_FILE "available_frequencies"
 #define GPU_POWER_FILE "/sys/bus/i2c/drivers/ina3221x/0-0040/iio:device0/in_power0_input"
 
 namespace efair {
 namespace util {
 
+    // Controls the frequency of one GPU through the devfreq files in devfreq_dir
     class FrequencyController {
     public:
-        FrequencyController();
+        explicit FrequencyController(const std::string &devfreq_dir = DEVFREQ_DIR);
         ~FrequencyController();
 
         Status get_frequency(std::string& freq);
@@ -33,6 +37,8 @@ namespace util {
         Status set_cur_frequency_by_index(const size_t &idx);
         Status get_available_frequencies(std::vector<std::string> &ret_freq);
         Status get_gpu_power(size_t& gpu_power);
+        // Frequency changes applied so far and the time spent applying them, in µs
+        Status get_switch_stats(size_t &num_switches, size_t &switch_time);
 
         void shutdown();
 
@@ -44,12 +50,20 @@ namespace util {
 
         void loop_body();
 
+        std::string devfreq_file(const char *name) const { return devfreq_dir + "/" + name; }
+
+        std::string devfreq_dir;
         bool shutdown_requested;
         std::mutex freq_lock;
         std::condition_variable cv;
         std::unique_ptr<std::thread> worker_thread;
 
+        static constexpr size_t UNKNOWN_FREQUENCY_IDX = std::numeric_limits<size_t>::max();
+
         std::string target_frequency;
+        std::atomic<size_t> target_idx{UNKNOWN_FREQUENCY_IDX};   // index of target_frequency, if it is available
+        std::atomic<size_t> num_switches{0};
+        std::atomic<size_t> switch_time{0};
         std::string cur_frequency;
         std::unordered_map<std::string, size_t> freq2idx;
         std::unordered_map<size_t, std::string> idx2freq;
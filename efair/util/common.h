@@ -7,6 +7,7 @@
 
 #include <glog/logging.h>
 #include <iostream>
+#include <utility>
 
 #define ASSERT(condition)\
      do { \
@@ -45,9 +46,26 @@ namespace efair {
     typedef size_t TaskID;
 
     typedef size_t KernelIdx;
+    typedef size_t FreqIdx;
 
     typedef double VRuntime;
     typedef int Priority;
+
+    // Runs a cleanup when the scope exits unless dismissed first, so every early return of a setup undoes it
+    template <typename F>
+    class ScopeGuard {
+    public:
+        explicit ScopeGuard(F cleanup) : _cleanup(std::move(cleanup)) {}
+        ScopeGuard(const ScopeGuard &) = delete;
+        ScopeGuard& operator=(const ScopeGuard &) = delete;
+        ~ScopeGuard() { if (_active) _cleanup(); }
+
+        void dismiss() { _active = false; }
+
+    private:
+        F _cleanup;
+        bool _active = true;
+    };
 }
 
 #endif //EFAIR_COMMON_H
\ No newline at end of file
@@ -0,0 +1,69 @@
+//
+// Created by Qianlin Liang on 4/25/23.
+//
+
+#ifndef EFAIR_OBJECT_SLAB_H
+#define EFAIR_OBJECT_SLAB_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace efair {
+namespace util {
+
+    /*
+     * Fixed-size chunks of objects handed out from a free list. Objects are constructed once when their chunk is
+     * allocated and recycled as they are, so they may hold members that cannot be moved, such as mutexes, and the
+     * caller resets whatever fields it uses after acquire. Chunks are only freed with the slab, so a workload that
+     * keeps at most n objects alive stays at n objects rounded up to a chunk.
+     */
+    template<typename T>
+    class ObjectSlab {
+    public:
+        explicit ObjectSlab(size_t chunk_size = 256) : chunk_size(chunk_size > 0 ? chunk_size : 1) {}
+        ObjectSlab(const ObjectSlab &) = delete;
+        ObjectSlab& operator=(const ObjectSlab &) = delete;
+        ~ObjectSlab() = default;
+
+        T* acquire() {
+            std::unique_lock<std::mutex> guard(lock);
+            if (free_list.empty()){
+                chunks.emplace_back(new T[chunk_size]);
+                auto *chunk = chunks.back().get();
+                for (size_t i = chunk_size; i-- > 0; ){
+                    free_list.push_back(chunk + i);
+                }
+            }
+
+            T *object = free_list.back();
+            free_list.pop_back();
+            return object;
+        }
+
+        void release(T *object) {
+            std::unique_lock<std::mutex> guard(lock);
+            free_list.push_back(object);
+        }
+
+        size_t get_capacity() {
+            std::unique_lock<std::mutex> guard(lock);
+            return chunks.size() * chunk_size;
+        }
+
+        size_t get_num_free() {
+            std::unique_lock<std::mutex> guard(lock);
+            return free_list.size();
+        }
+
+    private:
+        size_t chunk_size;
+        std::mutex lock;
+        std::vector<std::unique_ptr<T[]>> chunks;
+        std::vector<T *> free_list;
+    };
+
+} // namespace util
+} // namespace efair
+
+#endif //EFAIR_OBJECT_SLAB_H
@@ -0,0 +1,205 @@
+//
+// Created by Qianlin Liang on 4/28/23.
+//
+
+#include <algorithm>
+#include <fstream>
+
+#include "util/trace.h"
+
+namespace efair {
+namespace util {
+
+    Tracer& Tracer::global() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    Status Tracer::set_ring_size(size_t num_events) {
+        if (num_events == 0)
+            return Status::Fail;
+
+        std::unique_lock<std::mutex> lock(trace_lock);
+        ring_size = 1;
+        while (ring_size < num_events){
+            ring_size <<= 1;
+        }
+        return Status::Succeed;
+    }
+
+    void Tracer::set_thread_name(const std::string &name) {
+        Ring *ring = thread_ring();
+        std::unique_lock<std::mutex> lock(trace_lock);
+        ring->name = name;
+    }
+
+    std::atomic<uint64_t> Tracer::next_generation{0};
+
+    Tracer::ThreadRings::~ThreadRings() {
+        for (auto &entry : entries){
+            if (auto ring = entry.owner.lock())
+                ring->exited.store(true, std::memory_order_release);
+        }
+    }
+
+    void Tracer::find_thread_ring(ThreadRings &thread_rings) {
+        // Entries of destroyed tracers are dropped on the way, their rings went with them
+        auto &entries = thread_rings.entries;
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [](const ThreadRings::Entry &entry) {
+            return entry.owner.expired();
+        }), entries.end());
+
+        Ring *ring = nullptr;
+        for (auto &entry : entries){
+            if (entry.generation == generation)
+                ring = entry.ring;
+        }
+        if (ring == nullptr){
+            auto registered = register_thread();
+            ring = registered.get();
+            entries.push_back({generation, ring, registered});
+        }
+
+        thread_rings.last_generation = generation;
+        thread_rings.last_ring = ring;
+    }
+
+    std::shared_ptr<Tracer::Ring> Tracer::register_thread() {
+        std::unique_lock<std::mutex> lock(trace_lock);
+
+        // Rings of exited threads are reused if they have the current size and freed otherwise. A reused ring keeps
+        // the events of its previous thread, which carry that thread's ID, until they are overwritten.
+        std::shared_ptr<Ring> ring;
+        rings.erase(std::remove_if(rings.begin(), rings.end(), [this](const std::shared_ptr<Ring> &r) {
+            return r->exited.load(std::memory_order_acquire) && r->mask + 1 != ring_size;
+        }), rings.end());
+        for (auto &r : rings){
+            if (r->exited.load(std::memory_order_acquire)){
+                ring = r;
+                break;
+            }
+        }
+
+        if (ring == nullptr){
+            ring = std::make_shared<Ring>();
+            ring->mask = ring_size - 1;
+            ring->events.reset(new TraceEvent[ring_size]);
+            rings.push_back(ring);
+        }
+
+        ring->thread = next_thread++;
+        ring->name = "thread " + std::to_string(ring->thread);
+        ring->exited.store(false, std::memory_order_relaxed);
+        return ring;
+    }
+
+    void Tracer::clear() {
+        std::unique_lock<std::mutex> lock(trace_lock);
+        for (auto &ring : rings){
+            ring->cleared = ring->head.load(std::memory_order_acquire);
+        }
+    }
+
+    size_t Tracer::get_num_rings() {
+        std::unique_lock<std::mutex> lock(trace_lock);
+        return rings.size();
+    }
+
+    Status Tracer::export_chrome_trace(const std::string &path) {
+        std::vector<TraceEvent> events;
+        std::vector<std::pair<uint32_t, std::string>> names;
+        {
+            std::unique_lock<std::mutex> lock(trace_lock);
+            for (auto &ring : rings){
+                names.emplace_back(ring->thread, ring->name);
+
+                // Copy what the ring holds, then drop whatever the thread overwrote meanwhile
+                size_t size = ring->mask + 1;
+                uint64_t head = ring->head.load(std::memory_order_acquire);
+                uint64_t first = std::max<uint64_t>(ring->cleared, head > size ? head - size : 0);
+                size_t copied = events.size();
+                for (uint64_t i = first; i < head; i++){
+                    events.push_back(ring->events[i & ring->mask]);
+                }
+
+                // The thread may be writing slot new_head already, which holds event new_head - size
+                uint64_t new_head = ring->head.load(std::memory_order_acquire);
+                uint64_t overwritten = new_head + 1 > size ? new_head + 1 - size : 0;
+                if (overwritten > first){
+                    auto drop = std::min<uint64_t>(overwritten - first, head - first);
+                    events.erase(events.begin() + copied, events.begin() + copied + drop);
+                }
+            }
+        }
+
+        std::sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b) { return a.ts < b.ts; });
+        int64_t origin = events.empty() ? 0 : events.front().ts;
+
+        std::ofstream out_file(path);
+        if (!out_file.is_open()){
+            LOG(ERROR) << "Cannot save trace to file " << path;
+            return Status::Fail;
+        }
+
+        out_file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        bool first = true;
+        auto begin = [&](const char *ph, const char *name, const TraceEvent &e) -> std::ofstream& {
+            out_file << (first ? "" : ",\n") << "{\"ph\":\"" << ph << "\",\"name\":\"" << name
+                     << "\",\"pid\":0,\"tid\":" << e.thread << ",\"ts\":" << (e.ts - origin) / 1000.0;
+            first = false;
+            return out_file;
+        };
+
+        for (const auto &[thread, name] : names){
+            out_file << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":" << thread
+                     << ",\"args\":{\"name\":\"" << name << "\"}}";
+            first = false;
+        }
+
+        for (const auto &e : events){
+            switch (e.type){
+                case QuantumStart:
+                    begin("B", "quantum", e) << ",\"args\":{\"entity\":" << e.arg0 << ",\"device\":" << e.arg1 << "}}";
+                    break;
+                case QuantumEnd:
+                    begin("E", "quantum", e) << ",\"args\":{\"time_used_us\":" << e.arg1 << "}}";
+                    break;
+                case KernelDispatch:
+                    begin("i", "dispatch", e) << ",\"s\":\"t\",\"args\":{\"task\":" << e.arg0 << ",\"begin\":"
+                                              << (e.arg1 >> 32) << ",\"end\":" << (e.arg1 & 0xffffffff) << "}}";
+                    break;
+                case FrequencyChange:
+                    begin("i", "frequency", e) << ",\"s\":\"g\",\"args\":{\"frequency\":" << e.arg0 << "}}";
+                    break;
+                case TaskSubmit:
+                    begin("b", "task", e) << ",\"cat\":\"task\",\"id\":" << e.arg0 << ",\"args\":{\"entity\":"
+                                          << e.arg1 << "}}";
+                    break;
+                case TaskStart:
+                    begin("n", "start", e) << ",\"cat\":\"task\",\"id\":" << e.arg0 << ",\"args\":{\"device\":"
+                                           << e.arg1 << "}}";
+                    break;
+                case TaskFinish:
+                    begin("e", "task", e) << ",\"cat\":\"task\",\"id\":" << e.arg0 << ",\"args\":{\"service_us\":"
+                                          << e.arg1 << "}}";
+                    break;
+                case EntityEnqueue:
+                    begin("i", "enqueue", e) << ",\"s\":\"t\",\"args\":{\"entity\":" << e.arg0 << ",\"device\":"
+                                             << e.arg1 << "}}";
+                    break;
+                case EntityDequeue:
+                    begin("i", "dequeue", e) << ",\"s\":\"t\",\"args\":{\"entity\":" << e.arg0 << ",\"device\":"
+                                             << e.arg1 << "}}";
+                    break;
+                default:
+                    break;
+            }
+        }
+        out_file << "\n]}\n";
+        out_file.close();
+
+        return Status::Succeed;
+    }
+
+}   // namespace util
+}   // namespace efair
@@ -0,0 +1,136 @@
+//
+// Created by Qianlin Liang on 4/28/23.
+//
+
+#ifndef EFAIR_TRACE_H
+#define EFAIR_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util/common.h"
+
+namespace efair {
+namespace util {
+
+    enum TraceEventType : uint32_t {
+        QuantumStart,       // arg0 entity, arg1 device
+        QuantumEnd,         // arg0 entity, arg1 time used in µs
+        KernelDispatch,     // arg0 task, arg1 first kernel << 32 | end kernel
+        FrequencyChange,    // arg0 target frequency
+        TaskSubmit,         // arg0 task, arg1 entity
+        TaskStart,          // arg0 task, arg1 device
+        TaskFinish,         // arg0 task, arg1 service time in µs
+        EntityEnqueue,      // arg0 entity, arg1 device
+        EntityDequeue       // arg0 entity, arg1 device
+    };
+
+    struct TraceEvent {
+        int64_t ts;         // steady clock, ns
+        uint64_t arg0;
+        uint64_t arg1;
+        uint32_t type;
+        uint32_t thread;
+    };
+
+    /*
+     * Timeline of scheduler events kept in memory. Every thread that records gets its own ring of fixed-size events,
+     * so recording is a few stores and one release store of the ring head, with no lock and no formatting. When a
+     * ring is full the oldest events are overwritten. The rings can be exported at any time as a Chrome trace, which
+     * Perfetto and chrome://tracing open; events overwritten while an export copies a ring are left out of it.
+     * The ring of a thread that exits is handed to the next thread that starts recording, so short-lived threads
+     * such as RPC workers cost no more rings than run at the same time.
+     */
+    class Tracer {
+    public:
+        static Tracer& global();
+
+        Tracer() = default;
+        Tracer(const Tracer &) = delete;
+        Tracer& operator=(const Tracer &) = delete;
+        ~Tracer() = default;
+
+        // Events per thread, rounded up to a power of two. Applies to threads that have not recorded yet.
+        Status set_ring_size(size_t num_events);
+        void set_enabled(bool on) { enabled.store(on, std::memory_order_relaxed); }
+        bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+        // Names the calling thread in exported traces
+        void set_thread_name(const std::string &name);
+
+        void record(TraceEventType type, uint64_t arg0 = 0, uint64_t arg1 = 0) {
+            if (!enabled.load(std::memory_order_relaxed))
+                return;
+
+            Ring *ring = thread_ring();
+            auto head = ring->head.load(std::memory_order_relaxed);
+            auto &event = ring->events[head & ring->mask];
+            event.ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+            event.arg0 = arg0;
+            event.arg1 = arg1;
+            event.type = type;
+            event.thread = ring->thread;
+            ring->head.store(head + 1, std::memory_order_release);
+        }
+
+        Status export_chrome_trace(const std::string &path);
+        void clear();
+        size_t get_num_rings();
+
+    private:
+        struct Ring {
+            uint32_t thread;
+            std::string name;
+            size_t mask;
+            std::unique_ptr<TraceEvent[]> events;
+            std::atomic<uint64_t> head{0};
+            uint64_t cleared = 0;   // events before this index were cleared
+            std::atomic_bool exited{false};
+        };
+
+        // Rings of the calling thread by tracer generation, so a tracer created where a destroyed one lived is
+        // never mistaken for it. Marks the rings of live tracers free for reuse when the thread exits.
+        struct ThreadRings {
+            struct Entry {
+                uint64_t generation;
+                Ring *ring;
+                std::weak_ptr<Ring> owner;
+            };
+
+            ~ThreadRings();
+
+            uint64_t last_generation = 0;
+            Ring *last_ring = nullptr;
+            std::vector<Entry> entries;
+        };
+
+        Ring* thread_ring() {
+            thread_local ThreadRings thread_rings;
+            if (thread_rings.last_generation != generation)
+                find_thread_ring(thread_rings);
+            return thread_rings.last_ring;
+        }
+
+        void find_thread_ring(ThreadRings &thread_rings);
+        std::shared_ptr<Ring> register_thread();
+
+        static std::atomic<uint64_t> next_generation;
+        const uint64_t generation = next_generation.fetch_add(1) + 1;
+
+        std::atomic_bool enabled{false};
+        std::mutex trace_lock;
+        size_t ring_size = 1 << 16;
+        uint32_t next_thread = 0;
+        std::vector<std::shared_ptr<Ring>> rings;
+    };
+
+}   // namespace util
+}   // namespace efair
+
+#endif //EFAIR_TRACE_H